@@ -0,0 +1,209 @@
+#ifndef func_aot_h
+#define func_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Ahead-of-time compilation of scripts to C, see aot.c.
+// The C files written by emitC() include this header and only use the
+// macros below and the runtime functions in vm.h, value.h and chunk.h.
+
+// Bumped whenever the generated code or the bytecode changes incompatibly
+#define AOT_VERSION 1
+
+typedef struct {
+  uint32_t hash;   // Of the bytecode, see hashCode() in aot.c
+  int length;      // Of the bytecode
+  AotFn function;
+} AotFunction;
+
+// Exported as func_aot_module by a compiled script
+typedef struct AotModule {
+  int version;     // AOT_VERSION of the func that wrote the C file
+  int count;
+  const AotFunction* functions;
+} AotModule;
+
+bool emitC(VM* vm, ObjFunction* script, const char* path, FILE* out);
+void attachAot(VM* vm, ObjFunction* function);
+bool runAot(VM* vm, CallFrame* frame);
+
+
+// The generated code works like the JIT (jit.c): a function can be entered
+// at any instruction, and returns the offset of the first instruction it
+// doesn't handle, times two, plus one if the timeslice ran out. run()
+// executes that instruction, errors included.
+
+#define AOT_BEGIN() \
+    VM* vm = (VM*)vmp; \
+    CallFrame* frame = (CallFrame*)framep; \
+    Chunk* chunk = &frame->closure->function->chunk; \
+    Value* constants = chunk->constants.values; \
+    Value* slots = frame->slots; \
+    Value* sp = vm->stackTop; \
+    int target = (int)(frame->ip - chunk->code); \
+    (unused)constants; \
+    (unused)slots
+
+#define AOT_EXIT(offset) \
+    do { \
+      vm->stackTop = sp; \
+      return (offset) << 1; \
+    } while (false)
+
+#define AOT_YIELD(offset) \
+    do { \
+      vm->stackTop = sp; \
+      return ((offset) << 1) | 1; \
+    } while (false)
+
+// Same as TICK in run()
+#define AOT_TICK(offset) \
+    do { \
+      int left = atomic_load_explicit(&vm->fuel, memory_order_relaxed) - 1; \
+      atomic_store_explicit(&vm->fuel, left, memory_order_relaxed); \
+      if (left <= 0 && timesliceExpired(vm)) AOT_YIELD(offset); \
+    } while (false)
+
+#define AOT_PUSH(value) (*sp++ = (value))
+
+#define AOT_NUMBERS(a, b) (ARE_INTS(a, b) || (IS_NUMBER(a) && IS_NUMBER(b)))
+
+#define AOT_GET_GLOBAL(offset, slot) \
+    do { \
+      Value value = vm->globals.values[slot]; \
+      if (IS_UNDEFINED(value)) AOT_EXIT(offset); \
+      AOT_PUSH(value); \
+    } while (false)
+
+#define AOT_SET_GLOBAL(offset, slot) \
+    do { \
+      if (IS_UNDEFINED(vm->globals.values[slot])) AOT_EXIT(offset); \
+      vm->globals.values[slot] = sp[-1]; \
+    } while (false)
+
+#define AOT_GET_INDEX(offset) \
+    do { \
+      Value index = sp[-1]; \
+      Value array = sp[-2]; \
+      if (!IS_INT(index) || !IS_ARRAY(array)) AOT_EXIT(offset); \
+      int64_t i = AS_INT(index); \
+      if (i < 0 || i >= AS_ARRAY(array)->length) AOT_EXIT(offset); \
+      sp--; \
+      sp[-1] = AS_ARRAY(array)->values[i]; \
+    } while (false)
+
+#define AOT_SET_INDEX(offset) \
+    do { \
+      Value index = sp[-2]; \
+      Value array = sp[-3]; \
+      if (!IS_INT(index) || !IS_ARRAY(array)) AOT_EXIT(offset); \
+      int64_t i = AS_INT(index); \
+      if (i < 0 || i >= AS_ARRAY(array)->length) AOT_EXIT(offset); \
+      AS_ARRAY(array)->values[i] = sp[-1]; \
+      sp[-3] = sp[-1]; \
+      sp -= 2; \
+    } while (false)
+
+// Comparisons: COMPARE_NUMBERS for numbers, generic for anything else
+#define AOT_COMPARE(op, generic) \
+    do { \
+      Value b = *--sp; \
+      Value a = sp[-1]; \
+      sp[-1] = BOOL_VAL(AOT_NUMBERS(a, b) ? COMPARE_NUMBERS(a, op, b) : (generic)); \
+    } while (false)
+
+#define AOT_LESS_VALUES(a, b) \
+    (AOT_NUMBERS(a, b) ? COMPARE_NUMBERS(a, <, b) : valuesGreater(b, a))
+
+// Arithmetic on two numbers, anything else goes back to run()
+#define AOT_ARITHMETIC(offset, operation) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (!AOT_NUMBERS(a, b)) AOT_EXIT(offset); \
+      sp--; \
+      sp[-1] = operation(a, b); \
+    } while (false)
+
+#define AOT_DIVIDE(offset) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (!AOT_NUMBERS(a, b)) AOT_EXIT(offset); \
+      Value result = divideNumbers(a, b); \
+      if (isinf(AS_NUMBER(result))) AOT_EXIT(offset); \
+      sp--; \
+      sp[-1] = result; \
+    } while (false)
+
+// Bitwise operators and modulo on the integer values of two numbers
+#define AOT_AND(a, b) INT_VAL((a) & (b))
+#define AOT_OR(a, b)  INT_VAL((a) | (b))
+#define AOT_XOR(a, b) INT_VAL((a) ^ (b))
+
+#define AOT_INTEGER(offset, operation) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (!AOT_NUMBERS(a, b)) AOT_EXIT(offset); \
+      sp--; \
+      sp[-1] = operation(valueToInt(a), valueToInt(b)); \
+    } while (false)
+
+#define AOT_MODULO(offset) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (!AOT_NUMBERS(a, b) || valueToInt(b) == 0) AOT_EXIT(offset); \
+      sp--; \
+      sp[-1] = moduloInts(valueToInt(a), valueToInt(b)); \
+    } while (false)
+
+#define AOT_NEGATE(offset) \
+    do { \
+      Value a = sp[-1]; \
+      if (IS_NUMBER(a)) { \
+        sp[-1] = negateNumber(a); \
+      } else if (IS_BOOL(a)) { \
+        sp[-1] = BOOL_VAL(!AS_BOOL(a)); \
+      } else { \
+        AOT_EXIT(offset); \
+      } \
+    } while (false)
+
+#define AOT_BIN_NOT(offset) \
+    do { \
+      if (!IS_NUMBER(sp[-1])) AOT_EXIT(offset); \
+      sp[-1] = INT_VAL(~valueToInt(sp[-1])); \
+    } while (false)
+
+// Increment or decrement a value in place, operation is addNumbers or
+// subtractNumbers
+#define AOT_STEP(offset, value, operation) \
+    do { \
+      if (!IS_NUMBER(value)) AOT_EXIT(offset); \
+      value = operation(value, INT_VAL(1)); \
+    } while (false)
+
+// Superinstructions and register instructions: two operands that are not
+// on the stack, the result is pushed or stored in a slot
+#define AOT_PUSH_RESULT(offset, first, second, operation) \
+    do { \
+      Value a = (first); \
+      Value b = (second); \
+      if (!AOT_NUMBERS(a, b)) AOT_EXIT(offset); \
+      AOT_PUSH(operation(a, b)); \
+    } while (false)
+
+#define AOT_STORE_RESULT(offset, first, second, operation, result) \
+    do { \
+      Value a = (first); \
+      Value b = (second); \
+      if (!AOT_NUMBERS(a, b)) AOT_EXIT(offset); \
+      result = operation(a, b); \
+    } while (false)
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef func_bytecode_h
+#define func_bytecode_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Compiled scripts on disk (.fbc files), see bytecode.c
+
+// Bumped whenever the format or the instruction set changes incompatibly
+#define FBC_VERSION 1
+
+uint64_t hashSource(const char* filename, const char* source);
+bool isBytecode(const char* bytes, size_t size);
+bool writeBytecode(VM* vm, ObjFunction* script, uint64_t sourceHash, FILE* out);
+ObjFunction* readBytecode(VM* vm, const char* bytes, size_t size);
+ObjFunction* compileCached(VM* vm, int fileno, const char* source, const char* filename);
+
+#endif
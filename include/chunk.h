@@ -17,9 +17,9 @@ typedef enum {
   OP_DUP,           // push(peek top of stack)
   OP_GET_LOCAL,     // get index bytecode, peek stack[index] for value, then push a copy
   OP_SET_LOCAL,     // get index bytecode, peek top of stack, poke the value into stack[index]
-  OP_GET_GLOBAL,    // get constant bytecode, get value from hash, then push
-  OP_DEFINE_GLOBAL, // get constant bytecode, store value in hash, then pop
-  OP_SET_GLOBAL,    // get constant bytecode, store value
+  OP_GET_GLOBAL,    // get global slot bytecode, push value
+  OP_DEFINE_GLOBAL, // get global slot bytecode, store value, then pop
+  OP_SET_GLOBAL,    // get global slot bytecode, store value
   OP_MAKE_ARRAY,    // get length, make array of stack values, pop values, push array value
   OP_GET_INDEX,     // EXPERIMENTAL
   OP_SET_INDEX,     // EXPERIMENTAL
@@ -27,8 +27,8 @@ typedef enum {
   OP_SET_SLICE,     // EXPERIMENTAL
   OP_GET_UPVALUE,   // a closure thing. (comment tbd if/when I get it.)
   OP_SET_UPVALUE,   // a closure thing. (comment tbd if/when I get it.)
-  OP_GET_PROPERTY,  // get property of class instance
-  OP_SET_PROPERTY,  // set property (field) of class instance
+  OP_GET_PROPERTY,  // get property of class instance, has an inline cache
+  OP_SET_PROPERTY,  // set property (field) of class instance, has an inline cache
   OP_GET_SUPER,     //
   OP_EQUAL,         // pop b, pop a, push bool(a==b)
   OP_NEQUAL,        // pop b, pop a, push bool(a!=b)
@@ -56,8 +56,10 @@ typedef enum {
   OP_PJMP_IF_FALSE, // pop hi, pop lo, POP a, IF a==falsey THEN ip += (hi<<8)|lo
   OP_QJMP_IF_FALSE, // pop hi, pop lo, PEEK a, IF a==falsey THEN ip += (hi<<8)|lo
   OP_LOOP,          // pop hi, pop lo, ip -= (hi<<8)|lo
+  OP_SWITCH_TABLE,  // get table index, PEEK a, jump to the case matching a
   OP_CALL,          // call a function. (sounds easy. isn't.)
-  OP_INVOKE,        // look up a method and call it (optimization from ch.28.5)
+  OP_TAIL_CALL,     // OP_CALL in tail position, reuses the frame of the caller
+  OP_INVOKE,        // look up a method and call it (optimization from ch.28.5), has an inline cache
   OP_SUPER_INVOKE,  //
   OP_CLOSURE,       // a closure thing. (tbd if/when I get it.)
   OP_CLOSE_UPVALUE, // another, even stranger closure thing
@@ -66,8 +68,58 @@ typedef enum {
   OP_CLASS,         //
   OP_INHERIT,       //
   OP_METHOD,        //
+  // Superinstructions, only emitted by the peephole optimizer (optimizer.c)
+  OP_ADD_LOCALS,           // push(stack[a] + stack[b])
+  OP_ADD_LOCAL_CONST,      // push(stack[a] + constant)
+  OP_SUB_LOCAL_CONST,      // push(stack[a] - constant)
+  OP_LESS_LOCAL_CONST_JMP, // IF NOT stack[a] < constant THEN ip += offset
+  OP_INC_LOCAL,            // stack[a]++, nothing pushed
+  OP_DEC_LOCAL,            // stack[a]--, nothing pushed
+  OP_SET_LOCAL_POP,        // pop value, poke it into stack[a]
+  // Register instructions, only emitted by the peephole optimizer when built
+  // with REGISTER_OPS. The operands name frame slots and constants directly,
+  // the result goes to the slot in the last operand and nothing is pushed.
+  OP_MOVE,          // stack[b] = stack[a]
+  OP_LOAD_CONST,    // stack[b] = constant
+  OP_ADD_RR,        // stack[c] = stack[a] + stack[b]
+  OP_SUB_RR,        // stack[c] = stack[a] - stack[b]
+  OP_MUL_RR,        // stack[c] = stack[a] * stack[b]
+  OP_ADD_RK,        // stack[c] = stack[a] + constant
+  OP_SUB_RK,        // stack[c] = stack[a] - constant
+  OP_MUL_RK,        // stack[c] = stack[a] * constant
+  // Quickened instructions, only written over their generic op by run() (vm.c)
+  OP_EQUAL_NUM,     // OP_EQUAL for numbers
+  OP_NEQUAL_NUM,    // OP_NEQUAL for numbers
+  OP_GREATER_NUM,   // OP_GREATER for numbers
+  OP_GEQUAL_NUM,    // OP_GEQUAL for numbers
+  OP_LESS_NUM,      // OP_LESS for numbers
+  OP_LEQUAL_NUM,    // OP_LEQUAL for numbers
+  OP_ADD_NUM,       // OP_ADD for numbers
+  OP_SUBTRACT_NUM,  // OP_SUBTRACT for numbers
+  OP_MULTIPLY_NUM,  // OP_MULTIPLY for numbers
+  OP_DIVIDE_NUM,    // OP_DIVIDE for numbers
+  OP_CALL_NATIVE,   // OP_CALL of a native with a signature
 } OpCode;
 
+// Jump table of an OP_SWITCH_TABLE instruction, see switchStatement() in
+// compiler.c. Case values are numbers or strings, targets are offsets in
+// the chunk. All cases are in the hash table; if they are all integers
+// in a small range they can also be found in the dense array.
+typedef struct {
+  Value key;  // UNDEFINED_VAL if the entry is empty
+  int target;
+} SwitchCase;
+
+typedef struct {
+  SwitchCase* cases;  // Open addressing, capacity is a power of two
+  int capacity;
+  int count;
+  int* dense;         // Targets of the cases low .. low+denseCount-1, -1 = none
+  int low;
+  int denseCount;
+  int missTarget;     // Where to continue if no case matches
+} SwitchTable;
+
 typedef struct {
   int         count;       // Elements currently stored
   int         capacity;    // Total element capacity
@@ -76,12 +128,27 @@ typedef struct {
   int*        lines;       // Source code line number
   int*        chars;       // Source code char number
   ValueArray  constants;   // Literal values (value.h)
+  int         switchCount; // Jump tables for OP_SWITCH_TABLE
+  SwitchTable* switches;
 } Chunk;
 
 void initChunk(void* vm, Chunk* chunk);
 void freeChunk(void* vm, Chunk* chunk);
+void freeSharedChunk(void* vm, Chunk* chunk);
 void writeChunk(void* vm, Chunk* chunk, uint8_t byte, int fileno, int lineno, int charno);
 int addConstant(void* vm, Chunk* chunk, Value value);
 void writeConstant(void* vm, Chunk* chunk, Value value, int fileno, int lineno, int charno);
+uint8_t getGenericOpcode(uint8_t op);
+int getInstructionLength(Chunk* chunk, int offset);
+int getJumpTarget(Chunk* chunk, int offset);
+int getStackEffect(Chunk* chunk, int offset);
+int getMaxStackDepth(void* vm, Chunk* chunk, int depth);
+
+int addSwitchTable(void* vm, Chunk* chunk);
+void removeSwitchTables(void* vm, Chunk* chunk, int count);
+bool addSwitchCase(void* vm, SwitchTable* table, Value key, int target);
+void finishSwitchTable(void* vm, SwitchTable* table);
+int findSwitchTarget(SwitchTable* table, Value key);
+void remapSwitchTable(SwitchTable* table, int* newOffset);
 
 #endif
@@ -30,6 +30,7 @@ typedef void unused; // Silence warnings about unused variables with "(unused) v
 //#define DEBUG_LOG_GC_VERBOSE
 //#define DEBUG_LOG_GC_HEXDUMP
 //#define DEBUG_LOG_GC_EXTREME
+//#define DEBUG_COUNT_INSTRUCTIONS
 #endif // DEBUG
 
 #define UINT8_COUNT (UINT8_MAX + 1)
@@ -41,6 +42,29 @@ typedef void unused; // Silence warnings about unused variables with "(unused) v
 // For debugging, optionally disable OP_INVOKE
 #define OPTIMIZE_METHOD_CALLS
 
+// Use "computed goto" (labels as values) in the VM main loop when the
+// compiler supports it, build with -DNO_COMPUTED_GOTO to use the switch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Baseline JIT compiler for x86-64 Linux, see jit.c.
+// Build with -DNO_JIT to leave it out.
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+// Let the peephole optimizer emit the register instructions (OP_MOVE,
+// OP_ADD_RR etc.) for locals, see chunk.h and tools/regbench.sh
+//#define REGISTER_OPS
+
+// Branch hints for the fast paths in the VM
+#if defined(__GNUC__) || defined(__clang__)
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#else
+#define LIKELY(condition) (condition)
+#endif
+
 
 
 #endif // clox_common_h
@@ -3,9 +3,11 @@
 
 
 #include "object.h"
+#include "optimizer.h"
 
 
-ObjFunction* compile(void* vm, int fileno, const char* source);
+// optimize is one of the OPTIMIZE_ levels in optimizer.h
+ObjFunction* compile(void* vm, int fileno, const char* source, int optimize);
 void markCompilerRoots();
 
 #endif
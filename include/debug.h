@@ -6,6 +6,7 @@
 void dumpChunk(Chunk* chunk);
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* getOpcodeName(uint8_t opcode);
 
 // Not needed according to doc.
 // Compiler barks if missing unless .c file declares them static.
@@ -13,6 +14,11 @@ int disassembleInstruction(Chunk* chunk, int offset);
 int simpleInstruction(const char* name, int offset);
 int constantInstruction(const char* name, Chunk* chunk, int offset);
 int invokeInstruction(const char* name, Chunk* chunk, int offset);
+int cacheInstruction(const char* name, Chunk* chunk, int offset);
+int localConstantInstruction(const char* name, Chunk* chunk, int offset);
+int registerInstruction(const char* name, Chunk* chunk, int offset, int operands, bool constant);
 int byteInstruction(const char* name, Chunk* chunk, int offset);
+int shortInstruction(const char* name, Chunk* chunk, int offset);
 int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
+int switchInstruction(const char* name, Chunk* chunk, int offset);
 #endif
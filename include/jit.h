@@ -0,0 +1,25 @@
+#ifndef func_jit_h
+#define func_jit_h
+
+#include "common.h"
+#include "vm.h"
+
+// Baseline JIT, see jit.c. Only built on x86-64 Linux, see common.h
+
+typedef enum {
+  JIT_RESUME, // Carry on interpreting at frame->ip
+  JIT_YIELD,  // The timeslice ran out or the VM was interrupted at a loop
+} JitResult;
+
+typedef struct JitCode {
+  uint8_t* code;  // Executable memory, starts with the entry stub
+  size_t size;
+  void** targets; // Native address of each instruction by bytecode offset,
+                  // NULL where native code can't be entered
+} JitCode;
+
+bool compileJit(VM* vm, ObjFunction* function);
+JitResult runJit(VM* vm, CallFrame* frame);
+void freeJit(JitCode* jit);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef clox_array_h
 #define clox_array_h
 
+#include "table.h"
 #include "value.h"
 
 
@@ -23,6 +24,7 @@
 */
 
 
+void defineArrayMethods(void* vm, Table* methods);
 bool getArrayProperty(void* vm, Value receiver, ObjString* name, Value* property);
 bool pushArrayProperty(void* vm, Value receiver, ObjString* name);
 //bool arrayProperty(void* vm, Value receiver, ObjString* name);
@@ -50,22 +50,68 @@ struct sObj {
   struct sObj* next;
 };
 
+struct sShape;
+
+// Inline cache for one OP_GET_PROPERTY, OP_SET_PROPERTY or OP_INVOKE site,
+// see vm.c. Method entries are only valid while klass->version is unchanged.
+#define INLINE_CACHE_ENTRIES 4 // Classes seen before a site is megamorphic
+
+typedef struct {
+  struct sObjClass* klass;
+  int version;
+  struct sObjClosure* method;
+} CacheEntry;
+
+typedef struct {
+  struct sShape* shape;      // Instance shape the field was last found in
+  struct sShape* transition; // OP_SET_PROPERTY: shape after adding the field
+  int slot;                  // Slot of the field in instance->fields
+  int count;
+  CacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
+// Ahead-of-time compiled C of a function, see aot.h
+typedef int (*AotFn)(void* vm, void* frame);
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int maxSlots; // Stack slots used by a call, including callee and arguments
   Chunk chunk;
   ObjString* name;
+  int cacheCount;
+  InlineCache* caches; // One per property access site in chunk
+  struct JitCode* jit; // Native code, NULL until the function is hot
+  AotFn aot; // From the module set with set_aot_module(), or NULL
+  struct Program* program; // Owner of the code and debug info if shared, see program.c
+  int hotness; // Ticks counted towards vm->jitThreshold
 } ObjFunction;
 
 typedef bool (*NativeFn)(void* vm, int argCount, Value* args, Value* result);
 typedef bool (*NativeMFn)(void* vm, Value receiver, int argCount, Value* args, Value* result);
 typedef void (*ErrorCb)(const char* format,...);
 
+// Natives that take and return plain numbers, called without boxing
+typedef union {
+  double (*n0)(void);
+  double (*n1)(double);
+  double (*n2)(double, double);
+  double (*n3)(double, double, double);
+} NativeUnboxedFn;
+
+#define NATIVE_MAX_PARAMS 8
+
 typedef struct {
   Obj obj;
   NativeFn function;
   ObjString* name;
+  // Typed natives only, see defineNativeTyped()
+  int arity;                       // -1 if untyped
+  char params[NATIVE_MAX_PARAMS];  // Parameter types
+  char returns;                    // Return type
+  bool isUnboxed;                  // Call unboxed instead of function
+  NativeUnboxedFn unboxed;
 } ObjNative;
 
 typedef struct {
@@ -95,7 +141,7 @@ typedef struct sUpvalue {
   struct sUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct sObjClosure {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
@@ -106,12 +152,21 @@ typedef struct sObjClass {
   Obj obj;
   ObjString* name;
   Table methods;
+  int version; // Bumped whenever cached methods become invalid
+  bool fieldShadowsMethod; // An instance has a field named like a method
+  struct sShape* shape; // Root of the instance shape tree (shape.h)
+  int instanceSlots; // Inline field slots to give new instances
 } ObjClass;
 
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields;
+  struct sShape* shape;  // Field layout, NULL in dictionary mode
+  Value* fields;         // Field values, indexed by shape slot
+  int capacity;          // Slots available in fields
+  int inlineCapacity;    // Slots available in inlineFields
+  Table* dictionary;     // Fields by name, only in dictionary mode
+  Value inlineFields[];  // Used as fields until more slots are needed
 } ObjInstance; // Instance of an ObjClass
 
 typedef struct {
@@ -125,6 +180,7 @@ ObjBoundMethod* newBoundMethod(void* vm, Value receiver, ObjClosure* method);
 ObjClass* newClass(void* vm, ObjString* name);
 ObjClosure* newClosure(void* vm, ObjFunction* function);
 ObjFunction* newFunction(void* vm);
+void newInlineCaches(void* vm, ObjFunction* function);
 ObjInstance* newInstance(void* vm, ObjClass* klass);
 ObjNative* newNative(void* vm, ObjString* name, NativeFn function);
 ObjNativeMethod* newNativeMethod(void* vm, Value receiver, ObjString* name, NativeMFn function);
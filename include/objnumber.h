@@ -2,6 +2,7 @@
 #ifndef clox_objnumber_h
 #define clox_objnumber_h
 
+#include "table.h"
 #include "value.h"
 
 
@@ -45,6 +46,7 @@
 */
 
 
+void defineNumberMethods(void* vm, Table* methods);
 bool getNumberProperty(void* vm, Value receiver, ObjString* name, Value* property);
 bool pushNumberProperty(void* vm, Value receiver, ObjString* name);
 //bool numberProperty(void* vm, Value receiver, ObjString* name);
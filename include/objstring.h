@@ -2,6 +2,7 @@
 #ifndef clox_string_h
 #define clox_string_h
 
+#include "table.h"
 #include "value.h"
 
 
@@ -24,6 +25,7 @@
 */
 
 
+void defineStringMethods(void* vm, Table* methods);
 bool getStringProperty(void* vm, Value receiver, ObjString* name, Value* property);
 bool pushStringProperty(void* vm, Value receiver, ObjString* name);
 //bool stringProperty(void* vm, Value receiver, ObjString* name);
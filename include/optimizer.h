@@ -0,0 +1,13 @@
+#ifndef func_optimizer_h
+#define func_optimizer_h
+
+#include "chunk.h"
+
+// Optimization levels for compile()
+#define OPTIMIZE_NONE     0 // Emit the bytecode as compiled
+#define OPTIMIZE_PEEPHOLE 1 // Fuse common sequences into superinstructions
+#define OPTIMIZE_FLOW     2 // Also thread jumps, drop dead code and merge pops
+
+void optimizeChunk(void* vm, Chunk* chunk, int level);
+
+#endif
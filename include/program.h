@@ -0,0 +1,17 @@
+#ifndef func_program_h
+#define func_program_h
+
+#include "common.h"
+#include "vm.h"
+
+// A script compiled once and run by many VMs, see program.c
+
+typedef struct Program Program;
+
+Program* newProgram(VM* vm, ObjFunction* script);
+Program* compileProgram(VM* vm, const char* source, const char* filename);
+void retainProgram(Program* program);
+void releaseProgram(Program* program);
+ObjFunction* instantiateProgram(VM* vm, Program* program);
+
+#endif
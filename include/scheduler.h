@@ -0,0 +1,23 @@
+#ifndef func_scheduler_h
+#define func_scheduler_h
+
+#include "common.h"
+#include "vm.h"
+
+// Runs many VMs on a few threads, a timeslice at a time, see scheduler.c
+
+typedef struct Scheduler Scheduler;
+
+// Called once per VM when run() returns INTERPRET_OK, an error or
+// INTERPRET_INTERRUPTED, on the thread that ran the last slice. The
+// scheduler is done with vm by then, an interrupted one can be scheduled
+// again to resume.
+typedef void (*SchedulerCb)(VM* vm, InterpretResult result, void* data);
+
+Scheduler* newScheduler(int threads, SchedulerCb done);
+bool schedule(Scheduler* scheduler, VM* vm, void* data);
+void interruptScheduled(Scheduler* scheduler, VM* vm, int reason);
+void waitScheduler(Scheduler* scheduler);
+void freeScheduler(Scheduler* scheduler);
+
+#endif
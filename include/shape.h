@@ -0,0 +1,34 @@
+#ifndef func_shape_h
+#define func_shape_h
+
+#include "object.h"
+
+// Instances with more fields than this switch to dictionary mode
+#define SHAPE_MAX_FIELDS 64
+
+// A shape (hidden class) describes the field layout of an instance:
+// which field lives in which slot of instance->fields. Shapes form a
+// transition tree per class, keyed by the order in which fields are
+// added, so instances that get the same fields in the same order share
+// a shape. The root shape has no fields.
+typedef struct sShape {
+  ObjClass* klass;         // Owner, each class has its own tree
+  struct sShape* parent;
+  ObjString* name;         // Field added by the transition from parent
+  int slotCount;           // Number of fields in this shape
+  Table slots;             // Field name -> slot number, for all fields
+  struct sShape* children; // Transitions from this shape
+  struct sShape* sibling;  // Next transition from parent
+} Shape;
+
+Shape* newShape(void* vm, ObjClass* klass, Shape* parent, ObjString* name);
+Shape* shapeAddField(void* vm, Shape* shape, ObjString* name);
+int shapeFindSlot(void* vm, Shape* shape, ObjString* name);
+void markShape(void* vm, Shape* shape);
+void freeShape(void* vm, Shape* shape);
+
+bool getField(void* vm, ObjInstance* instance, ObjString* name, Value* value);
+bool setField(void* vm, ObjInstance* instance, ObjString* name, Value value);
+void freeFields(void* vm, ObjInstance* instance);
+
+#endif
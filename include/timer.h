@@ -0,0 +1,21 @@
+#ifndef func_timer_h
+#define func_timer_h
+
+#include "common.h"
+#include "vm.h"
+
+// Sleeping VMs parked until their wake time, see timer.c
+
+typedef struct TimerWheel TimerWheel;
+
+TimerWheel* newTimerWheel(void);
+void freeTimerWheel(TimerWheel* wheel);
+bool parkVM(TimerWheel* wheel, VM* vm, void* data);
+bool unparkVM(TimerWheel* wheel, VM* vm);
+bool wakeVM(TimerWheel* wheel, double time, VM** vm, void** data);
+double nextWakeTime(TimerWheel* wheel);
+int timerFd(TimerWheel* wheel);
+void waitTimers(TimerWheel* wheel, double until);
+bool waitUntil(double time);
+
+#endif
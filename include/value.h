@@ -1,6 +1,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <math.h>
+
 #include "common.h"
 
 typedef struct sObj Obj;
@@ -22,18 +24,31 @@ typedef enum {
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN     ((uint64_t)0x7ffc000000000000)
 
+#define TAG_UNDEFINED 0 // 00. Unassigned global slot, never seen by scripts
 #define TAG_NULL  1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
 
+// Integers are kept unboxed as a 48 bit two's complement payload
+// under QNAN | TAG_INT. Both integers and doubles are numbers to the
+// scripts, IS_INT only tells which representation a number has.
+#define TAG_INT  ((uint64_t)0x0002000000000000)
+#define INT_MASK ((uint64_t)0x0000ffffffffffff)
+
 typedef uint64_t Value;
 
-#define IS_BOOL(v)      (((v) & FALSE_VAL) == FALSE_VAL)
+#define IS_BOOL(v)      (((v) | 1) == TRUE_VAL)
 #define IS_NULL(v)      ((v) == NULL_VAL)
-#define IS_NUMBER(v)    (((v) & QNAN) != QNAN)
+#define IS_UNDEFINED(v) ((v) == UNDEFINED_VAL)
+#define IS_DOUBLE(v)    (((v) & QNAN) != QNAN)
+#define IS_INT(v)       (((v) & (QNAN | TAG_INT)) == (QNAN | TAG_INT)) // Objects lack TAG_INT
+#define IS_NUMBER(v)    (((v) & (QNAN | TAG_INT)) != QNAN) // Either of the above
 #define IS_OBJ(v)       (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
+#define ARE_INTS(a, b)  IS_INT((a) & (b))
+
 #define AS_BOOL(v)      ((v) == TRUE_VAL)
+#define AS_INT(v)       ((int64_t)((v) << 16) >> 16) // Sign extend the payload
 #define AS_NUMBER(v)    valueToNum(v)
 #define AS_OBJ(v)       ((Obj*)(uintptr_t)((v) & ~(SIGN_BIT | QNAN)))
 
@@ -41,7 +56,9 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NULL_VAL        ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
+#define INT_VAL(i)      ((Value)(QNAN | TAG_INT | ((uint64_t)(i) & INT_MASK)))
 #define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 typedef union {
@@ -50,6 +67,7 @@ typedef union {
 } DoubleUnion;
 
 static inline double valueToNum(Value value) {
+  if ((value & QNAN) == QNAN) return (double)AS_INT(value); // IS_INT() for a number
   DoubleUnion data;
   data.bits = value;
   return data.num;
@@ -75,23 +93,124 @@ typedef struct {
 // Type checking
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NULL(value)    ((value).type == VAL_NULL)
+#define IS_UNDEFINED(value) ((value).type == VAL_NULL && (value).as.number != 0)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value)  IS_NUMBER(value)
+#define IS_INT(value)     false // Integers are doubles without NAN_BOXING
+#define ARE_INTS(a, b)    false
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 // From Value to native types: bool b = AS_BOOL(v)
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((int64_t)(value).as.number)
 #define AS_OBJ(value)     ((value).as.obj)
 
 // From native types to Value: Value v = BOOL_VAL(true);
 #define BOOL_VAL(value)   ((Value){ VAL_BOOL, { .boolean = value } })
 #define NULL_VAL          ((Value){ VAL_NULL, { .number = 0 } })
+#define UNDEFINED_VAL     ((Value){ VAL_NULL, { .number = 1 } }) // Unassigned global slot
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
+#define INT_VAL(value)    NUMBER_VAL((double)(value))
 #define OBJ_VAL(object)   ((Value){ VAL_OBJ, { .obj = (Obj*)object } })
 
 #endif
 
 
+// Range of numbers that INT_VAL() can hold
+#define INT_MAX_VALUE (((int64_t)1 << 47) - 1)
+#define INT_MIN_VALUE (-((int64_t)1 << 47))
+
+// Box an integer, as a double if it is too large for INT_VAL()
+static inline Value intToValue(int64_t i) {
+  return LIKELY(i >= INT_MIN_VALUE && i <= INT_MAX_VALUE) ? INT_VAL(i) : NUMBER_VAL((double)i);
+}
+
+// Box a double, as an integer if it is one. -0 stays a double.
+static inline Value normalizeNumber(double number) {
+  if (number >= INT_MIN_VALUE && number <= INT_MAX_VALUE && number == (double)(int64_t)number &&
+      (number != 0 || !signbit(number))) {
+    return INT_VAL((int64_t)number);
+  }
+  return NUMBER_VAL(number);
+}
+
+// Truncate a number towards zero. Values outside of the int64_t range
+// and NaN saturate, so they can never pass for a small integer.
+static inline int64_t valueToInt(Value value) {
+  if (IS_INT(value)) return AS_INT(value);
+  double number = AS_NUMBER(value);
+  if (!(number > (double)INT64_MIN)) return INT64_MIN;
+  if (number >= (double)INT64_MAX) return INT64_MAX;
+  return (int64_t)number;
+}
+
+// Arithmetic on two numbers. Two integers give an integer unless the
+// result overflows INT_VAL(), then it is computed as a double instead.
+static inline Value addNumbers(Value a, Value b) {
+  if (LIKELY(ARE_INTS(a, b))) return intToValue(AS_INT(a) + AS_INT(b));
+  return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+  if (LIKELY(ARE_INTS(a, b))) return intToValue(AS_INT(a) - AS_INT(b));
+  return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b) {
+  if (LIKELY(ARE_INTS(a, b))) {
+    int64_t x = AS_INT(a);
+    int64_t y = AS_INT(b);
+    // The exact product fits int64_t whenever the rounded one is this
+    // small. Zero times a negative number is -0, which needs a double.
+    double product = (double)x * (double)y;
+    if (product > -1e18 && product < 1e18 && (product != 0 || (x | y) >= 0)) {
+      return intToValue(x * y);
+    }
+  }
+  return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+// Two integers stay an integer if they divide evenly (and the result
+// isn't -0). With 48 bit operands the double quotient is only integral
+// if the division is exact. The caller checks for division by zero.
+static inline Value divideNumbers(Value a, Value b) {
+  if (LIKELY(ARE_INTS(a, b)) && AS_INT(b) != 0) {
+    double quotient = (double)AS_INT(a) / (double)AS_INT(b);
+    if (quotient == (double)(int64_t)quotient && (quotient != 0 || AS_INT(b) > 0)) {
+      return intToValue((int64_t)quotient);
+    }
+    return NUMBER_VAL(quotient);
+  }
+  return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negateNumber(Value a) {
+  if (IS_INT(a) && AS_INT(a) != 0) return intToValue(-AS_INT(a));
+  return NUMBER_VAL(-AS_NUMBER(a)); // -0 is a double
+}
+
+// Remainder of the integer division a / b, the caller checks b != 0
+static inline Value moduloInts(int64_t a, int64_t b) {
+  return intToValue(b == -1 ? 0 : a % b);
+}
+
+// The bitwise operators work on 48 bit two's complement integers, where
+// INT_VAL() wraps the result. Shifting by 48 or more shifts every bit out.
+static inline Value shiftLeftInts(int64_t a, int64_t b) {
+  if (b < 0 || b >= 48) return INT_VAL(0);
+  return INT_VAL((uint64_t)a << b);
+}
+
+static inline Value shiftRightInts(int64_t a, int64_t b) {
+  a = AS_INT(INT_VAL(a)); // Sign extend from bit 47 first
+  if (b < 0 || b >= 48) return INT_VAL(a < 0 ? -1 : 0);
+  return INT_VAL(a >> b);
+}
+
+// a op b for two numbers, comparing integers without converting them
+#define COMPARE_NUMBERS(a, op, b) \
+    (LIKELY(ARE_INTS(a, b)) ? AS_INT(a) op AS_INT(b) : AS_NUMBER(a) op AS_NUMBER(b))
 
 
 typedef struct {
@@ -1,14 +1,40 @@
 #ifndef cfun_vm_h
 #define cfun_vm_h
 
+#include <stdatomic.h>
+
 //#include "chunk.h"
 #include "compiler.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call frame and value stacks start small and grow on demand, up to
+// per-VM limits set with set_stack_limits(). Every call makes sure there
+// is room for the callee's maxSlots plus STACK_HEADROOM values, which
+// covers natives and superinstructions that push a few temporaries.
+// push() and the to_*Value() helpers grow the stack as well, so a native
+// that pushes more must not keep pointers into it, like its arguments.
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL 256
+#define DEFAULT_FRAMES_MAX 1024
+#define DEFAULT_STACK_MAX (DEFAULT_FRAMES_MAX * UINT8_COUNT)
+#define STACK_HEADROOM 16
+
+// run() returns INTERPRET_RUNNING when the timeslice is used up.
+// The slice is only checked at backward jumps, calls and method invocations
+// ("ticks"), and the clock is only read once every TIMESLICE_FUEL ticks.
+// After sleep() it returns INTERPRET_SLEEPING, and again without running
+// anything until now() reaches get_wake_time(), see timer.c.
+// vm_interrupt() makes it return INTERPRET_INTERRUPTED at the next tick,
+// from any thread or a signal handler, by emptying the fuel so the check
+// costs nothing extra. Calling run() again resumes.
+#define DEFAULT_TIMESLICE_USEC 10000
+#define TIMESLICE_FUEL 1024
+
+// With set_jit(), a function is compiled to native code once it has used
+// this many ticks
+#define DEFAULT_JIT_THRESHOLD 1000
 
 
 
@@ -25,19 +51,32 @@ typedef enum {
   INTERPRET_RUNNING,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR,
+  INTERPRET_SLEEPING,
+  INTERPRET_INTERRUPTED,
 } InterpretResult;
 
 struct Parser;
+struct Program;
 struct Compiler;
 
 typedef struct FunVM {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
+  int maxFrames;
 
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
-  Table globals; // Global variables
+  int stackCapacity; // In values
+  int maxStack;
+  bool overflow; // push() went past maxStack in a native, see reserveStack()
+  Table globalSlots; // Global name -> index into globals, used by the compiler and API
+  ValueArray globals; // Global variables, UNDEFINED_VAL until defined
+  ValueArray globalNames; // Global names by index, for error messages
   Table strings; // Internalized, unique strings
+  Table arrayMethods;  // Built-in methods by name, ObjNativeMethod without receiver
+  Table stringMethods;
+  Table numberMethods;
   ObjString* initString; // Literally "init", used for calling object initializers
   ObjUpvalue* openUpvalues; // Umm. Yea. Those.
 
@@ -46,6 +85,14 @@ typedef struct FunVM {
 
   double sleep;
   bool yield;
+  atomic_int interrupt; // Reason passed to vm_interrupt(), 0 = none
+  int interruptReason;  // Of the last INTERPRET_INTERRUPTED
+  int sliceUsec;    // Timeslice length in microseconds, 0 = no time limit
+  long sliceTicks;  // Max ticks per timeslice, 0 = no limit
+  long ticks;       // Ticks used in the current timeslice
+  atomic_int fuel;  // Ticks left until the timeslice is checked again, emptied by vm_interrupt()
+  int refuel;       // Fuel given at the last check
+  double sliceStart;
   ErrorCb error_callback;
   char* errbuf; // For compiler errors -- replace with callback FIXME
 
@@ -56,6 +103,11 @@ typedef struct FunVM {
   //struct Parser* parser;
   struct Compiler* compiler; // current
   struct ClassCompiler* currentClass;
+  int optimize; // Optimization level used by interpret(), see optimizer.h
+  int jitThreshold; // Ticks before a function is compiled, 0 = no JIT
+  const struct AotModule* aotModule; // Compiled C attached by interpret(), see aot.c
+  char* cacheDirectory; // Compiled scripts kept by interpret(), see bytecode.c
+  long instructions; // Executed by run(), only counted with DEBUG_COUNT_INSTRUCTIONS
 
   int grayCount; // GC graystack slots in use
   int grayCapacity; // GC graystack slot capacity
@@ -80,14 +132,33 @@ VM* initVM();
 void freeVM(VM* vm);
 void defineGlobal(VM* vm, const char* name, Value value);
 void defineNative(VM* vm, const char* name, NativeFn function); // DEPRECATED
+bool defineNativeTyped(VM* vm, const char* name, NativeFn function, const char* signature);
+bool defineNativeUnboxed(VM* vm, const char* name, NativeUnboxedFn function, const char* signature);
+int resolveGlobal(VM* vm, ObjString* name);
+void defineNativeMethod(VM* vm, Table* methods, const char* name, NativeMFn function);
 void set_error_callback(VM* vm, ErrorCb ptr);
+void set_timeslice(VM* vm, int usec);
+void set_tick_budget(VM* vm, long ticks);
+void set_stack_limits(VM* vm, int maxFrames, int maxStack);
+void set_jit(VM* vm, int threshold);
+bool set_aot_module(VM* vm, const struct AotModule* module);
+bool set_bytecode_cache(VM* vm, const char* directory);
+double get_wake_time(VM* vm);
+void vm_interrupt(VM* vm, int reason);
+int get_interrupt_reason(VM* vm);
+void vm_abort(VM* vm);
+double now();
 void runtimeError(VM* vm, const char* format, ...);
 InterpretResult run(VM* vm);
 
 InterpretResult interpret(VM* vm, const char* source, const char* filename);
+InterpretResult interpretBytecode(VM* vm, const char* bytes, size_t size);
+InterpretResult interpretProgram(VM* vm, struct Program* program);
 void push(VM* vm, Value value);
 Value pop(VM* vm);
 void makeArray(VM* vm, uint8_t length);
+bool isFalsey(Value value);
+bool timesliceExpired(VM* vm);
 
 
 
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "debug.h"
+
+// Ahead-of-time compilation of scripts to C
+//
+// `func --emit-c script.fun` compiles a script and writes the bytecode of
+// each ObjFunction as a C function: one label per instruction, with the
+// AOT_ macros in aot.h in place of the interpreter's handlers and gotos in
+// place of jumps. Built into a shared object, it exports func_aot_module.
+// An embedder loads it with set_aot_module() (see `func --aot` in main.c),
+// and interpret() then attaches the C functions to the ObjFunctions whose
+// bytecode hashes to the same value. Everything else, i.e. functions that
+// changed since the C was written, stays interpreted.
+//
+// The generated code shares the VM, GC and values with the interpreter.
+// It handles the same instructions as the JIT (jit.c) and returns to run()
+// for the others: calls, returns, properties, closures, classes and any
+// operand types or errors the fast paths don't cover. The shared object
+// calls into the runtime, so a func linked statically needs -rdynamic.
+
+// FNV-1a, like hashString() in object.c
+static uint32_t hashCode(Chunk* chunk) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < chunk->count; i++) {
+    hash ^= chunk->code[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static uint16_t readShort(uint8_t* code) {
+  return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+// The number function of an arithmetic instruction
+static const char* arithmetic(uint8_t op) {
+  switch (op) {
+    case OP_ADD: case OP_ADD_LOCALS: case OP_ADD_LOCAL_CONST: case OP_ADD_RR: case OP_ADD_RK:
+      return "addNumbers";
+    case OP_SUBTRACT: case OP_SUB_LOCAL_CONST: case OP_SUB_RR: case OP_SUB_RK:
+      return "subtractNumbers";
+    default:
+      return "multiplyNumbers";
+  }
+}
+
+// Write the C of the instruction at offset
+static void emitInstruction(Chunk* chunk, int offset, int next, FILE* out) {
+  uint8_t* code = chunk->code + offset;
+  uint8_t op = getGenericOpcode(code[0]);
+  int a = chunk->count > offset + 2 ? readShort(code + 1) : 0;
+  int b = chunk->count > offset + 4 ? readShort(code + 3) : 0;
+  int c = chunk->count > offset + 6 ? readShort(code + 5) : 0;
+
+  fprintf(out, "L%d: ", offset);
+  switch (op) {
+    case OP_CONSTANT:      fprintf(out, "AOT_PUSH(constants[%d]);", a); break;
+    case OP_NULL:          fprintf(out, "AOT_PUSH(NULL_VAL);"); break;
+    case OP_TRUE:          fprintf(out, "AOT_PUSH(TRUE_VAL);"); break;
+    case OP_FALSE:         fprintf(out, "AOT_PUSH(FALSE_VAL);"); break;
+    case OP_POP:           fprintf(out, "sp--;"); break;
+    case OP_POPN:          fprintf(out, "sp -= %d;", code[1]); break;
+    case OP_DUP:           fprintf(out, "sp[0] = sp[-1]; sp++;"); break;
+    case OP_GET_LOCAL:     fprintf(out, "AOT_PUSH(slots[%d]);", a); break;
+    case OP_SET_LOCAL:     fprintf(out, "slots[%d] = sp[-1];", a); break;
+    case OP_SET_LOCAL_POP: fprintf(out, "slots[%d] = *--sp;", a); break;
+    case OP_GET_GLOBAL:    fprintf(out, "AOT_GET_GLOBAL(%d, %d);", offset, a); break;
+    case OP_SET_GLOBAL:    fprintf(out, "AOT_SET_GLOBAL(%d, %d);", offset, a); break;
+    case OP_DEFINE_GLOBAL: fprintf(out, "vm->globals.values[%d] = *--sp;", a); break;
+    case OP_GET_INDEX:     fprintf(out, "AOT_GET_INDEX(%d);", offset); break;
+    case OP_SET_INDEX:     fprintf(out, "AOT_SET_INDEX(%d);", offset); break;
+    case OP_EQUAL:   fprintf(out, "AOT_COMPARE(==, valuesEqual(a, b));"); break;
+    case OP_NEQUAL:  fprintf(out, "AOT_COMPARE(!=, !valuesEqual(a, b));"); break;
+    case OP_GREATER: fprintf(out, "AOT_COMPARE(>, valuesGreater(a, b));"); break;
+    case OP_GEQUAL:  fprintf(out, "AOT_COMPARE(>=, valuesEqual(b, a) || valuesGreater(a, b));"); break;
+    case OP_LESS:    fprintf(out, "AOT_COMPARE(<, valuesGreater(b, a));"); break;
+    case OP_LEQUAL:  fprintf(out, "AOT_COMPARE(<=, valuesEqual(b, a) || valuesGreater(b, a));"); break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+      fprintf(out, "AOT_ARITHMETIC(%d, %s);", offset, arithmetic(op));
+      break;
+    case OP_DIVIDE:     fprintf(out, "AOT_DIVIDE(%d);", offset); break;
+    case OP_MODULO:     fprintf(out, "AOT_MODULO(%d);", offset); break;
+    case OP_BIN_SHIFTL: fprintf(out, "AOT_INTEGER(%d, shiftLeftInts);", offset); break;
+    case OP_BIN_SHIFTR: fprintf(out, "AOT_INTEGER(%d, shiftRightInts);", offset); break;
+    case OP_BIN_AND:    fprintf(out, "AOT_INTEGER(%d, AOT_AND);", offset); break;
+    case OP_BIN_OR:     fprintf(out, "AOT_INTEGER(%d, AOT_OR);", offset); break;
+    case OP_BIN_XOR:    fprintf(out, "AOT_INTEGER(%d, AOT_XOR);", offset); break;
+    case OP_NOT:        fprintf(out, "sp[-1] = BOOL_VAL(isFalsey(sp[-1]));"); break;
+    case OP_NEGATE:     fprintf(out, "AOT_NEGATE(%d);", offset); break;
+    case OP_BIN_NOT:    fprintf(out, "AOT_BIN_NOT(%d);", offset); break;
+    case OP_INC:        fprintf(out, "AOT_STEP(%d, sp[-1], addNumbers);", offset); break;
+    case OP_DEC:        fprintf(out, "AOT_STEP(%d, sp[-1], subtractNumbers);", offset); break;
+    case OP_INC_LOCAL:  fprintf(out, "AOT_STEP(%d, slots[%d], addNumbers);", offset, a); break;
+    case OP_DEC_LOCAL:  fprintf(out, "AOT_STEP(%d, slots[%d], subtractNumbers);", offset, a); break;
+    case OP_PRINT:      fprintf(out, "printValue(*--sp); printf(\"\\n\");"); break;
+    case OP_JUMP:
+      fprintf(out, "goto L%d;", next + a);
+      break;
+    case OP_PJMP_IF_FALSE:
+      fprintf(out, "if (isFalsey(*--sp)) goto L%d;", next + a);
+      break;
+    case OP_QJMP_IF_FALSE:
+      fprintf(out, "if (isFalsey(sp[-1])) goto L%d;", next + a);
+      break;
+    case OP_LOOP:
+      fprintf(out, "AOT_TICK(%d); goto L%d;", next - a, next - a);
+      break;
+    case OP_SWITCH_TABLE:
+      fprintf(out, "target = findSwitchTarget(&chunk->switches[%d], sp[-1]); goto dispatch;", a);
+      break;
+    case OP_ADD_LOCALS:
+      fprintf(out, "AOT_PUSH_RESULT(%d, slots[%d], slots[%d], addNumbers);", offset, a, b);
+      break;
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUB_LOCAL_CONST:
+      fprintf(out, "AOT_PUSH_RESULT(%d, slots[%d], constants[%d], %s);",
+              offset, a, b, arithmetic(op));
+      break;
+    case OP_LESS_LOCAL_CONST_JMP:
+      fprintf(out, "if (!AOT_LESS_VALUES(slots[%d], constants[%d])) goto L%d;", a, b, next + c);
+      break;
+    case OP_MOVE:       fprintf(out, "slots[%d] = slots[%d];", b, a); break;
+    case OP_LOAD_CONST: fprintf(out, "slots[%d] = constants[%d];", b, a); break;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+      fprintf(out, "AOT_STORE_RESULT(%d, slots[%d], slots[%d], %s, slots[%d]);",
+              offset, a, b, arithmetic(op), c);
+      break;
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+      fprintf(out, "AOT_STORE_RESULT(%d, slots[%d], constants[%d], %s, slots[%d]);",
+              offset, a, b, arithmetic(op), c);
+      break;
+    default:
+      fprintf(out, "AOT_EXIT(%d);", offset);
+      break;
+  }
+  fprintf(out, " // %s\n", getOpcodeName(code[0]));
+}
+
+static void emitFunction(ObjFunction* function, int index, FILE* out) {
+  Chunk* chunk = &function->chunk;
+  fprintf(out, "// %s\n", function->name != NULL ? function->name->chars : "<script>");
+  fprintf(out, "static int f%d(void* vmp, void* framep) {\n", index);
+  fprintf(out, "  AOT_BEGIN();\n");
+  if (chunk->switchCount > 0) fprintf(out, "dispatch:\n");
+  fprintf(out, "  switch (target) {\n");
+  for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    fprintf(out, "    case %d: goto L%d;\n", offset, offset);
+  }
+  fprintf(out, "  }\n");
+  fprintf(out, "  AOT_EXIT(target);\n");
+  for (int offset = 0; offset < chunk->count;) {
+    int next = offset + getInstructionLength(chunk, offset);
+    emitInstruction(chunk, offset, next, out);
+    offset = next;
+  }
+  fprintf(out, "}\n\n");
+}
+
+// Write the functions of the tree under function, return the next index
+static int emitFunctions(ObjFunction* function, int index, FILE* out) {
+  emitFunction(function, index++, out);
+  Chunk* chunk = &function->chunk;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) index = emitFunctions(AS_FUNCTION(constant), index, out);
+  }
+  return index;
+}
+
+static int emitTable(ObjFunction* function, int index, FILE* out) {
+  fprintf(out, "  { 0x%08xu, %d, f%d },\n", hashCode(&function->chunk), function->chunk.count, index++);
+  Chunk* chunk = &function->chunk;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) index = emitTable(AS_FUNCTION(constant), index, out);
+  }
+  return index;
+}
+
+// Write the C of the compiled script and all its functions
+bool emitC(VM* vm, ObjFunction* script, const char* path, FILE* out) {
+  (unused)vm;
+  fprintf(out, "// Generated by func --emit-c from %s, do not edit.\n", path);
+  fprintf(out, "// Build: cc -shared -fPIC -O2 -I<func>/include %s.c -o %s.so\n", path, path);
+  fprintf(out, "// Run:   func --aot %s.so %s\n\n", path, path);
+  fprintf(out, "#include \"aot.h\"\n\n");
+  int count = emitFunctions(script, 0, out);
+  fprintf(out, "static const AotFunction functions[] = {\n");
+  emitTable(script, 0, out);
+  fprintf(out, "};\n\n");
+  fprintf(out, "const AotModule func_aot_module = { %d, %d, functions };\n", AOT_VERSION, count);
+  return !ferror(out);
+}
+
+
+// Attach the C functions of vm->aotModule to the functions in the tree
+// under function
+void attachAot(VM* vm, ObjFunction* function) {
+  const AotModule* module = vm->aotModule;
+  Chunk* chunk = &function->chunk;
+  uint32_t hash = hashCode(chunk);
+  for (int i = 0; i < module->count; i++) {
+    if (module->functions[i].hash == hash && module->functions[i].length == chunk->count) {
+      function->aot = module->functions[i].function;
+      break;
+    }
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) attachAot(vm, AS_FUNCTION(constant));
+  }
+}
+
+// Run the C of the current function from frame->ip, return true if the
+// timeslice ran out
+bool runAot(VM* vm, CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  int result = function->aot(vm, frame);
+  frame->ip = function->chunk.code + (result >> 1);
+  return result & 1;
+}
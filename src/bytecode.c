@@ -0,0 +1,627 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "file.h"
+#include "memory.h"
+#include "object.h"
+
+// Compiled scripts on disk
+//
+// An .fbc file holds the ObjFunction tree of a compiled script: code,
+// debug info, constants and switch tables of every chunk. What depends on
+// the VM the script was compiled in is stored by name: global slots (see
+// resolveGlobal()) and file numbers (see addFilename()) are resolved again
+// in the VM that reads the file, and strings are interned as usual.
+// Quickened instructions are written as their generic instruction, so a
+// script can be written after it ran.
+//
+// Numbers are varints, signed ones zigzag encoded, and the debug info is
+// delta encoded. The file ends with a hash of everything before it. The
+// reader never reads past the end of the file, but otherwise trusts it as
+// much as a script: a file that hashes right is assumed to be from func.
+//
+// compileCached() is compile() with a cache: with set_bytecode_cache(),
+// the .fbc of each script is kept in a directory under the hash of its
+// name and source. A hit costs reading it, and hashing the files the
+// script included to check they didn't change, instead of compiling.
+
+#define FBC_MAGIC "FBC" // With the terminator, the first 4 bytes of a file
+
+// Header flags, the bytecode the VM understands depends on them
+#ifdef REGISTER_OPS
+#define FBC_FLAGS 1
+#else
+#define FBC_FLAGS 0
+#endif
+
+#define OPCODE_COUNT (OP_CALL_NATIVE + 1) // The last opcode
+
+// Value tags
+#define FBC_NULL     'n'
+#define FBC_TRUE     't'
+#define FBC_FALSE    'f'
+#define FBC_INT      'i'
+#define FBC_DOUBLE   'd'
+#define FBC_STRING   's'
+#define FBC_FUNCTION 'p'
+
+typedef struct {
+  VM* vm;
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+  int* files;   // Index in the file table by fileno, -1 = not used
+  bool failed;  // Out of memory or a constant that can't be written
+} Writer;
+
+typedef struct {
+  VM* vm;
+  const uint8_t* bytes;
+  size_t size;
+  size_t position;
+  int* files;       // fileno in vm by index in the file table
+  int fileCount;
+  int* globals;     // Slot in vm by slot in the file, -1 = not used
+  int globalCount;
+  bool failed;      // Truncated, corrupt or stale
+} Reader;
+
+
+// FNV-1a, 64 bits because it is a cache key
+static uint64_t hashBytes(uint64_t hash, const char* bytes, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)bytes[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+#define HASH_START 14695981039346656037u
+
+uint64_t hashSource(const char* filename, const char* source) {
+  uint64_t hash = hashBytes(HASH_START, filename, strlen(filename) + 1);
+  return hashBytes(hash, source, strlen(source));
+}
+
+// Like readFile(), but a missing file is not an error
+static bool readQuietly(const char* path, char** bytes, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  fseek(file, 0L, SEEK_END);
+  long length = ftell(file);
+  rewind(file);
+  *bytes = length >= 0 ? malloc((size_t)length + 1) : NULL;
+  bool ok = *bytes != NULL && fread(*bytes, 1, (size_t)length, file) == (size_t)length;
+  fclose(file);
+  if (!ok) {
+    free(*bytes);
+    return false;
+  }
+  (*bytes)[length] = '\0';
+  *size = (size_t)length;
+  return true;
+}
+
+// Hash of the contents of a file, 0 if it can't be read
+static uint64_t hashFile(const char* path) {
+  char* bytes;
+  size_t size;
+  if (!readQuietly(path, &bytes, &size)) return 0;
+  uint64_t hash = hashBytes(HASH_START, bytes, size);
+  free(bytes);
+  return hash;
+}
+
+bool isBytecode(const char* bytes, size_t size) {
+  return size >= sizeof(FBC_MAGIC) + sizeof(uint64_t) && memcmp(bytes, FBC_MAGIC, sizeof(FBC_MAGIC)) == 0;
+}
+
+
+// Writing
+
+static void writeByte(Writer* writer, uint8_t byte) {
+  if (writer->count == writer->capacity) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+    uint8_t* bytes = realloc(writer->bytes, capacity);
+    if (bytes == NULL) {
+      writer->failed = true;
+      return;
+    }
+    writer->bytes = bytes;
+    writer->capacity = capacity;
+  }
+  writer->bytes[writer->count++] = byte;
+}
+
+static void writeUnsigned(Writer* writer, uint64_t value) {
+  while (value >= 0x80) {
+    writeByte(writer, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  writeByte(writer, (uint8_t)value);
+}
+
+static void writeSigned(Writer* writer, int64_t value) {
+  writeUnsigned(writer, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void write64(Writer* writer, uint64_t value) {
+  for (int i = 0; i < 8; i++) writeByte(writer, (uint8_t)(value >> (i * 8)));
+}
+
+static void writeChars(Writer* writer, const char* chars, int length) {
+  writeUnsigned(writer, (uint64_t)length);
+  for (int i = 0; i < length; i++) writeByte(writer, (uint8_t)chars[i]);
+}
+
+static bool isGlobalOp(uint8_t op) {
+  return op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL;
+}
+
+// Mark the files and global slots the tree under function uses
+static void collect(VM* vm, ObjFunction* function, bool* files, bool* globals) {
+  Chunk* chunk = &function->chunk;
+  for (int i = 0; i < chunk->count; i++) {
+    if (chunk->files[i] >= 0 && chunk->files[i] < vm->filenames.count) files[chunk->files[i]] = true;
+  }
+  for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    if (isGlobalOp(chunk->code[offset])) {
+      globals[(chunk->code[offset + 1] << 8) | chunk->code[offset + 2]] = true;
+    }
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) collect(vm, AS_FUNCTION(constant), files, globals);
+  }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeValue(Writer* writer, Value value) {
+  if (IS_NULL(value)) {
+    writeByte(writer, FBC_NULL);
+  } else if (IS_BOOL(value)) {
+    writeByte(writer, AS_BOOL(value) ? FBC_TRUE : FBC_FALSE);
+  } else if (IS_INT(value)) {
+    writeByte(writer, FBC_INT);
+    writeSigned(writer, AS_INT(value));
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeByte(writer, FBC_DOUBLE);
+    write64(writer, bits);
+  } else if (IS_STRING(value)) {
+    writeByte(writer, FBC_STRING);
+    writeChars(writer, AS_STRING(value)->chars, AS_STRING(value)->length);
+  } else if (IS_FUNCTION(value)) {
+    writeByte(writer, FBC_FUNCTION);
+    writeFunction(writer, AS_FUNCTION(value));
+  } else {
+    writer->failed = true; // Not a compile time constant
+  }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeUnsigned(writer, (uint64_t)function->arity);
+  writeUnsigned(writer, (uint64_t)function->upvalueCount);
+  writeUnsigned(writer, (uint64_t)function->maxSlots);
+  writeUnsigned(writer, (uint64_t)function->cacheCount);
+  if (function->name == NULL) {
+    writeUnsigned(writer, 0);
+  } else {
+    writeUnsigned(writer, (uint64_t)function->name->length + 1);
+    for (int i = 0; i < function->name->length; i++) writeByte(writer, (uint8_t)function->name->chars[i]);
+  }
+
+  writeUnsigned(writer, (uint64_t)chunk->count);
+  for (int offset = 0; offset < chunk->count;) {
+    int length = getInstructionLength(chunk, offset);
+    writeByte(writer, getGenericOpcode(chunk->code[offset]));
+    for (int i = 1; i < length; i++) writeByte(writer, chunk->code[offset + i]);
+    offset += length;
+  }
+  int file = -1, line = 0, character = 0;
+  for (int i = 0; i < chunk->count; i++) {
+    int fileno = chunk->files[i];
+    int index = fileno >= 0 && fileno < writer->vm->filenames.count ? writer->files[fileno] : -1;
+    writeSigned(writer, index - file);
+    writeSigned(writer, chunk->lines[i] - line);
+    writeSigned(writer, chunk->chars[i] - character);
+    file = index;
+    line = chunk->lines[i];
+    character = chunk->chars[i];
+  }
+
+  writeUnsigned(writer, (uint64_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) writeValue(writer, chunk->constants.values[i]);
+
+  writeUnsigned(writer, (uint64_t)chunk->switchCount);
+  for (int i = 0; i < chunk->switchCount; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    writeSigned(writer, table->missTarget);
+    writeUnsigned(writer, (uint64_t)table->count);
+    for (int j = 0; j < table->capacity; j++) {
+      if (IS_UNDEFINED(table->cases[j].key)) continue;
+      writeValue(writer, table->cases[j].key);
+      writeUnsigned(writer, (uint64_t)table->cases[j].target);
+    }
+  }
+}
+
+// Write script, compiled by vm with vm->optimize from a source with
+// hashSource() sourceHash, to out
+bool writeBytecode(VM* vm, ObjFunction* script, uint64_t sourceHash, FILE* out) {
+  Writer writer = { vm, NULL, 0, 0, NULL, false };
+  bool* files = calloc((size_t)vm->filenames.count + 1, sizeof(bool));
+  bool* globals = calloc((size_t)vm->globals.count + 1, sizeof(bool));
+  writer.files = malloc(((size_t)vm->filenames.count + 1) * sizeof(int));
+  if (files == NULL || globals == NULL || writer.files == NULL) {
+    writer.failed = true;
+    goto done;
+  }
+  collect(vm, script, files, globals);
+
+  for (size_t i = 0; i < sizeof(FBC_MAGIC); i++) writeByte(&writer, (uint8_t)FBC_MAGIC[i]);
+  writeUnsigned(&writer, FBC_VERSION);
+  writeUnsigned(&writer, FBC_FLAGS);
+  writeUnsigned(&writer, OPCODE_COUNT);
+  writeUnsigned(&writer, (uint64_t)vm->optimize);
+  write64(&writer, sourceHash);
+
+  // Files with the hash of their contents, to tell if an include changed
+  int fileCount = 0;
+  for (int i = 0; i < vm->filenames.count; i++) fileCount += files[i];
+  writeUnsigned(&writer, (uint64_t)fileCount);
+  fileCount = 0;
+  for (int i = 0; i < vm->filenames.count; i++) {
+    writer.files[i] = -1;
+    if (!files[i]) continue;
+    writer.files[i] = fileCount++;
+    ObjString* name = AS_STRING(vm->filenames.values[i]);
+    writeChars(&writer, name->chars, name->length);
+    write64(&writer, hashFile(name->chars));
+  }
+
+  int globalCount = 0;
+  for (int i = 0; i < vm->globals.count; i++) globalCount += globals[i];
+  writeUnsigned(&writer, (uint64_t)vm->globals.count);
+  writeUnsigned(&writer, (uint64_t)globalCount);
+  for (int i = 0; i < vm->globals.count; i++) {
+    if (!globals[i]) continue;
+    ObjString* name = AS_STRING(vm->globalNames.values[i]);
+    writeUnsigned(&writer, (uint64_t)i);
+    writeChars(&writer, name->chars, name->length);
+  }
+
+  writeFunction(&writer, script);
+  write64(&writer, hashBytes(HASH_START, (const char*)writer.bytes, writer.count));
+
+done:
+  if (!writer.failed && fwrite(writer.bytes, 1, writer.count, out) != writer.count) writer.failed = true;
+  free(writer.bytes);
+  free(writer.files);
+  free(files);
+  free(globals);
+  return !writer.failed;
+}
+
+
+// Reading
+
+static uint8_t readByte(Reader* reader) {
+  if (reader->position >= reader->size) {
+    reader->failed = true;
+    return 0;
+  }
+  return reader->bytes[reader->position++];
+}
+
+static uint64_t readUnsigned(Reader* reader) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = readByte(reader);
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  reader->failed = true;
+  return 0;
+}
+
+static int64_t readSigned(Reader* reader) {
+  uint64_t value = readUnsigned(reader);
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint64_t read64(Reader* reader) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) value |= (uint64_t)readByte(reader) << (i * 8);
+  return value;
+}
+
+// An int in 0..limit
+static int readIndex(Reader* reader, uint64_t limit) {
+  uint64_t index = readUnsigned(reader);
+  if (index > limit) {
+    reader->failed = true;
+    return 0;
+  }
+  return (int)index;
+}
+
+// A count of up to limit things of at least a byte each
+static int readCount(Reader* reader, uint64_t limit) {
+  int count = readIndex(reader, limit);
+  if ((size_t)count > reader->size - reader->position) {
+    reader->failed = true;
+    return 0;
+  }
+  return count;
+}
+
+// The chars of a string in the file, NULL if they are not all there
+static const char* readChars(Reader* reader, int* length) {
+  *length = readCount(reader, INT32_MAX);
+  if (reader->failed) return NULL;
+  const char* chars = (const char*)reader->bytes + reader->position;
+  reader->position += (size_t)*length;
+  return chars;
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+static bool readValue(Reader* reader, Value* value) {
+  switch (readByte(reader)) {
+    case FBC_NULL:   *value = NULL_VAL; break;
+    case FBC_TRUE:   *value = TRUE_VAL; break;
+    case FBC_FALSE:  *value = FALSE_VAL; break;
+    case FBC_INT:    *value = intToValue(readSigned(reader)); break;
+    case FBC_DOUBLE: {
+      uint64_t bits = read64(reader);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      *value = NUMBER_VAL(number);
+      break;
+    }
+    case FBC_STRING: {
+      int length;
+      const char* chars = readChars(reader, &length);
+      if (chars == NULL) return false;
+      *value = OBJ_VAL(copyString(reader->vm, chars, length));
+      break;
+    }
+    case FBC_FUNCTION: {
+      ObjFunction* function = readFunction(reader);
+      if (function == NULL) return false;
+      *value = OBJ_VAL(function);
+      break;
+    }
+    default:
+      reader->failed = true;
+      return false;
+  }
+  return !reader->failed;
+}
+
+// Check the code can be walked and move the global slots to the slots of
+// the same names in the VM
+static void fixCode(Reader* reader, Chunk* chunk) {
+  for (int offset = 0; offset < chunk->count && !reader->failed;) {
+    uint8_t* code = chunk->code + offset;
+    if (code[0] >= OPCODE_COUNT) break;
+    if (code[0] == OP_CLOSURE) {
+      if (offset + 3 > chunk->count) break;
+      int constant = (code[1] << 8) | code[2];
+      if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant])) break;
+    }
+    int length = getInstructionLength(chunk, offset);
+    if (offset + length > chunk->count) break;
+    if (isGlobalOp(code[0])) {
+      int slot = (code[1] << 8) | code[2];
+      if (slot >= reader->globalCount || reader->globals[slot] < 0) break;
+      code[1] = (uint8_t)(reader->globals[slot] >> 8);
+      code[2] = (uint8_t)reader->globals[slot];
+    }
+    offset += length;
+    if (offset == chunk->count) return;
+  }
+  if (chunk->count > 0) reader->failed = true;
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+  VM* vm = reader->vm;
+  ObjFunction* function = newFunction(vm);
+  push(vm, OBJ_VAL(function)); // Keep safe from GC
+  Chunk* chunk = &function->chunk;
+
+  function->arity = readIndex(reader, UINT8_MAX);
+  function->upvalueCount = readIndex(reader, UINT16_MAX);
+  function->maxSlots = readIndex(reader, INT32_MAX);
+  int cacheCount = readIndex(reader, INT32_MAX);
+  int nameLength = readCount(reader, INT32_MAX);
+  if (nameLength > 0) {
+    const char* chars = (const char*)reader->bytes + reader->position;
+    reader->position += (size_t)nameLength - 1;
+    function->name = copyString(vm, chars, nameLength - 1);
+  }
+
+  int count = readCount(reader, INT32_MAX);
+  for (int i = 0; i < count && !reader->failed; i++) writeChunk(vm, chunk, readByte(reader), -1, 0, 0);
+  int file = -1, line = 0, character = 0;
+  for (int i = 0; i < chunk->count && !reader->failed; i++) {
+    file += (int)readSigned(reader);
+    line += (int)readSigned(reader);
+    character += (int)readSigned(reader);
+    if (file < -1 || file >= reader->fileCount) reader->failed = true;
+    chunk->files[i] = file >= 0 && !reader->failed ? reader->files[file] : -1;
+    chunk->lines[i] = line;
+    chunk->chars[i] = character;
+  }
+
+  int constants = readCount(reader, UINT16_MAX + 1);
+  for (int i = 0; i < constants && !reader->failed; i++) {
+    Value value;
+    if (readValue(reader, &value)) addConstant(vm, chunk, value);
+  }
+
+  int switches = readCount(reader, UINT16_MAX + 1);
+  for (int i = 0; i < switches && !reader->failed; i++) {
+    int index = addSwitchTable(vm, chunk);
+    SwitchTable* table = &chunk->switches[index];
+    table->missTarget = (int)readSigned(reader);
+    int cases = readCount(reader, INT32_MAX);
+    for (int j = 0; j < cases && !reader->failed; j++) {
+      Value key;
+      if (!readValue(reader, &key)) break;
+      int target = readIndex(reader, (uint64_t)chunk->count);
+      push(vm, key);
+      if (!(IS_NUMBER(key) || IS_STRING(key)) || !addSwitchCase(vm, table, key, target)) reader->failed = true;
+      pop(vm);
+    }
+    finishSwitchTable(vm, table);
+    if (table->missTarget < 0 || table->missTarget > chunk->count) reader->failed = true;
+  }
+
+  fixCode(reader, chunk);
+  if (cacheCount > chunk->count) reader->failed = true;
+  if (!reader->failed) {
+    function->cacheCount = cacheCount;
+    newInlineCaches(vm, function);
+  }
+  pop(vm);
+  return reader->failed ? NULL : function;
+}
+
+// Read a script written by writeBytecode(). A cache hit also needs the
+// same source hash, optimization level and unchanged includes, which are
+// all files but filename.
+static ObjFunction* readScript(VM* vm, const char* bytes, size_t size, bool cached,
+                               uint64_t sourceHash, const char* filename) {
+  if (!isBytecode(bytes, size)) return NULL;
+  size -= sizeof(uint64_t);
+  Reader reader = { vm, (const uint8_t*)bytes, size + sizeof(uint64_t), size, NULL, 0, NULL, 0, false };
+  if (read64(&reader) != hashBytes(HASH_START, bytes, size)) return NULL;
+  reader.size = size;
+  reader.position = sizeof(FBC_MAGIC);
+
+  if (readUnsigned(&reader) != FBC_VERSION || readUnsigned(&reader) != FBC_FLAGS ||
+      readUnsigned(&reader) != OPCODE_COUNT) {
+    return NULL;
+  }
+  uint64_t optimize = readUnsigned(&reader);
+  uint64_t hash = read64(&reader);
+  if (cached && (optimize != (uint64_t)vm->optimize || hash != sourceHash)) return NULL;
+
+  ObjFunction* script = NULL;
+  // Check all the includes before adding any, or compile() would skip them
+  reader.fileCount = readCount(&reader, INT32_MAX);
+  reader.files = malloc(((size_t)reader.fileCount + 1) * sizeof(int));
+  if (reader.files == NULL) goto done;
+  size_t files = reader.position;
+  for (int pass = 0; pass < 2; pass++) {
+    reader.position = files;
+    for (int i = 0; i < reader.fileCount && !reader.failed; i++) {
+      int length;
+      const char* chars = readChars(&reader, &length);
+      uint64_t fileHash = read64(&reader);
+      if (reader.failed) break;
+      char* name = malloc((size_t)length + 1);
+      if (name == NULL) goto done;
+      memcpy(name, chars, (size_t)length);
+      name[length] = '\0';
+      if (pass == 0) {
+        if (cached && strcmp(name, filename) != 0 && fileHash != hashFile(name)) reader.failed = true;
+      } else {
+        reader.files[i] = addFilename(vm, name);
+      }
+      free(name);
+    }
+  }
+
+  reader.globalCount = readIndex(&reader, UINT16_MAX + 1);
+  reader.globals = malloc(((size_t)reader.globalCount + 1) * sizeof(int));
+  if (reader.globals == NULL) goto done;
+  for (int i = 0; i < reader.globalCount; i++) reader.globals[i] = -1;
+  int globals = readCount(&reader, (uint64_t)reader.globalCount);
+  for (int i = 0; i < globals && !reader.failed; i++) {
+    int slot = readIndex(&reader, (uint64_t)reader.globalCount - 1);
+    int length;
+    const char* chars = readChars(&reader, &length);
+    if (reader.failed) break;
+    ObjString* name = copyString(vm, chars, length);
+    push(vm, OBJ_VAL(name));
+    reader.globals[slot] = resolveGlobal(vm, name);
+    pop(vm);
+  }
+
+  if (!reader.failed) script = readFunction(&reader);
+  if (reader.position != reader.size) script = NULL;
+
+done:
+  free(reader.files);
+  free(reader.globals);
+  return reader.failed ? NULL : script;
+}
+
+// Read a script written by writeBytecode() into vm, NULL if bytes are not
+// a script or were written by another version of func
+ObjFunction* readBytecode(VM* vm, const char* bytes, size_t size) {
+  return readScript(vm, bytes, size, false, 0, NULL);
+}
+
+
+// Cache
+
+// Write to a temporary file first, so other processes sharing the cache
+// never see half a file
+static void saveCached(VM* vm, ObjFunction* script, uint64_t sourceHash, const char* path) {
+  size_t length = strlen(path) + 32;
+  char* temporary = malloc(length);
+  if (temporary == NULL) return;
+  snprintf(temporary, length, "%s.%d.tmp", path, (int)getpid());
+  FILE* file = fopen(temporary, "wb");
+  if (file != NULL) {
+    bool written = writeBytecode(vm, script, sourceHash, file);
+    if (fclose(file) != 0) written = false;
+    if (!written || rename(temporary, path) != 0) remove(temporary);
+  }
+  free(temporary);
+}
+
+// compile() source, or load it from vm->cacheDirectory if it was compiled
+// before. fileno is addFilename(filename), or -1 without a filename.
+ObjFunction* compileCached(VM* vm, int fileno, const char* source, const char* filename) {
+  if (vm->cacheDirectory == NULL) return compile(vm, fileno, source, vm->optimize);
+
+  uint64_t hash = hashSource(filename, source);
+  size_t length = strlen(vm->cacheDirectory) + 24;
+  char* path = malloc(length);
+  if (path == NULL) return compile(vm, fileno, source, vm->optimize);
+  snprintf(path, length, "%s/%016llx.fbc", vm->cacheDirectory, (unsigned long long)hash);
+
+  ObjFunction* function = NULL;
+  char* bytes;
+  size_t size;
+  if (readQuietly(path, &bytes, &size)) {
+    function = readScript(vm, bytes, size, true, hash, filename);
+    free(bytes);
+  }
+  if (function == NULL) {
+    function = compile(vm, fileno, source, vm->optimize);
+    if (function != NULL) saveCached(vm, function, hash, path);
+  }
+  free(path);
+  return function;
+}
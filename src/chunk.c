@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h" // push/pop
 
 void initChunk(void* vm, Chunk* chunk) {
@@ -20,6 +22,8 @@ void initChunk(void* vm, Chunk* chunk) {
   printf("chunk:initChunk() initializing constants array %p\n", &chunk->constants);
 #endif // DEBUG_TRACE_CHUNK
   initValueArray(&chunk->constants);
+  chunk->switchCount = 0;
+  chunk->switches = NULL;
 #ifdef DEBUG_TRACE_CHUNK
   printf("chunk:initChunk(vm %p, chunk=%p) initialized ok\n", vm, chunk);
 #endif // DEBUG_TRACE_CHUNK
@@ -33,10 +37,22 @@ void freeChunk(void* vm, Chunk* chunk) {
   FREE_ARRAY(vm, int, chunk->files, chunk->capacity);
   FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
   FREE_ARRAY(vm, int, chunk->chars, chunk->capacity);
-  freeValueArray(vm, &chunk->constants);
+  freeSharedChunk(vm, chunk);
 #ifdef DEBUG_TRACE_CHUNK
   printf("chunk:freeChunk(vm %p, chunk=%p) freed ok\n", vm, chunk);
 #endif // DEBUG_TRACE_CHUNK
+}
+
+// Free the parts of a chunk a VM always owns, but not its code and debug
+// info, which may belong to a Program (program.c)
+void freeSharedChunk(void* vm, Chunk* chunk) {
+  freeValueArray(vm, &chunk->constants);
+  for (int i = 0; i < chunk->switchCount; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    FREE_ARRAY(vm, SwitchCase, table->cases, table->capacity);
+    FREE_ARRAY(vm, int, table->dense, table->denseCount);
+  }
+  FREE_ARRAY(vm, SwitchTable, chunk->switches, chunk->switchCount);
   initChunk(vm, chunk);
 }
 
@@ -102,3 +118,366 @@ void writeConstant(void* vm, Chunk* chunk, Value value, int fileno, int lineno,
   writeChunk(vm, chunk, constant, fileno, lineno, charno);
 }
 
+
+// The instruction a quickened instruction was written over by run()
+uint8_t getGenericOpcode(uint8_t op) {
+  switch (op) {
+    case OP_EQUAL_NUM:    return OP_EQUAL;
+    case OP_NEQUAL_NUM:   return OP_NEQUAL;
+    case OP_GREATER_NUM:  return OP_GREATER;
+    case OP_GEQUAL_NUM:   return OP_GEQUAL;
+    case OP_LESS_NUM:     return OP_LESS;
+    case OP_LEQUAL_NUM:   return OP_LEQUAL;
+    case OP_ADD_NUM:      return OP_ADD;
+    case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:   return OP_DIVIDE;
+    case OP_CALL_NATIVE:  return OP_CALL;
+    default:              return op;
+  }
+}
+
+// Total length in bytes of the instruction at offset, including operands
+int getInstructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_POPN:
+    case OP_MAKE_ARRAY:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CALL_NATIVE:
+      return 2;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_SUPER:
+    case OP_JUMP:
+    case OP_PJMP_IF_FALSE:
+    case OP_QJMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SWITCH_TABLE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_INC_LOCAL:
+    case OP_DEC_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return 3;
+    case OP_SUPER_INVOKE:
+      return 4;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUB_LOCAL_CONST:
+      return 5;
+    case OP_MOVE:
+    case OP_LOAD_CONST:
+      return 5;
+    case OP_INVOKE:
+      return 6;
+    case OP_LESS_LOCAL_CONST_JMP:
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+      return 7;
+    case OP_CLOSURE: {
+      uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+      return 3 + function->upvalueCount * 2;
+    }
+    default:
+      return 1;
+  }
+}
+
+// Target offset of the jump instruction at offset, or -1 if it isn't one.
+// The jump distance is always the last operand of the instruction.
+int getJumpTarget(Chunk* chunk, int offset) {
+  int sign;
+  switch (chunk->code[offset]) {
+    case OP_JUMP:
+    case OP_PJMP_IF_FALSE:
+    case OP_QJMP_IF_FALSE:
+    case OP_LESS_LOCAL_CONST_JMP:
+      sign = 1;
+      break;
+    case OP_LOOP:
+      sign = -1;
+      break;
+    default:
+      return -1;
+  }
+  int length = getInstructionLength(chunk, offset);
+  uint16_t jump = (chunk->code[offset + length - 2] << 8) | chunk->code[offset + length - 1];
+  return offset + length + sign * jump;
+}
+
+// Number of values the instruction at offset pushes, negative if it pops.
+// Values that only live inside one instruction are covered by STACK_HEADROOM.
+int getStackEffect(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUB_LOCAL_CONST:
+      return 1;
+    case OP_POPN:
+      return -code[1];
+    case OP_MAKE_ARRAY:
+      return 1 - code[1];
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CALL_NATIVE:
+      return -code[1];
+    case OP_INVOKE:
+      return -code[3];
+    case OP_SUPER_INVOKE:
+      return -code[3] - 1;
+    case OP_SET_INDEX:
+    case OP_GET_SLICE:
+      return -2;
+    case OP_SET_SLICE:
+      return -3;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_INC:
+    case OP_DEC:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_BIN_NOT:
+    case OP_JUMP:
+    case OP_QJMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SWITCH_TABLE:
+    case OP_RETURN:
+    case OP_EXIT:
+    case OP_LESS_LOCAL_CONST_JMP:
+    case OP_INC_LOCAL:
+    case OP_DEC_LOCAL:
+    case OP_MOVE:
+    case OP_LOAD_CONST:
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+      return 0;
+    default:
+      return -1; // Binary operators, OP_POP, OP_PJMP_IF_FALSE etc.
+  }
+}
+
+// Record the depth at a jump target or the next instruction, and queue it
+// the first time. Return false if another path got there with a different
+// depth.
+static bool mergeDepth(int* depths, int* worklist, int* count, int offset, int depth) {
+  if (depths[offset] >= 0) return depths[offset] == depth;
+  depths[offset] = depth;
+  worklist[(*count)++] = offset;
+  return true;
+}
+
+// Highest stack depth reached by a chunk that starts with depth values on
+// the stack (the callee and its arguments). The compiler only generates
+// code where every path to an instruction has the same depth, so each
+// instruction is visited once. Returns -1 if two paths disagree.
+int getMaxStackDepth(void* vm, Chunk* chunk, int depth) {
+  if (chunk->count == 0) return depth;
+
+  int* depths = ALLOCATE(vm, int, chunk->count);
+  int* worklist = ALLOCATE(vm, int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+  int count = 0;
+  int max = depth;
+
+  depths[0] = depth;
+  worklist[count++] = 0;
+  while (count > 0 && max >= 0) {
+    int offset = worklist[--count];
+    int after = depths[offset] + getStackEffect(chunk, offset);
+    if (after > max) max = after;
+
+    uint8_t instruction = chunk->code[offset];
+    int next = offset + getInstructionLength(chunk, offset);
+    int target = getJumpTarget(chunk, offset);
+    if (target >= 0 && target < chunk->count && !mergeDepth(depths, worklist, &count, target, after)) {
+      max = -1;
+    }
+    if (instruction == OP_SWITCH_TABLE) {
+      SwitchTable* table = &chunk->switches[(chunk->code[offset + 1] << 8) | chunk->code[offset + 2]];
+      for (int i = -1; i < table->capacity; i++) {
+        if (i >= 0 && IS_UNDEFINED(table->cases[i].key)) continue;
+        target = i < 0 ? table->missTarget : table->cases[i].target;
+        if (!mergeDepth(depths, worklist, &count, target, after)) max = -1;
+      }
+    }
+    bool fallsThrough = instruction != OP_JUMP && instruction != OP_LOOP &&
+        instruction != OP_SWITCH_TABLE && instruction != OP_RETURN && instruction != OP_EXIT;
+    if (fallsThrough && next < chunk->count && !mergeDepth(depths, worklist, &count, next, after)) {
+      max = -1;
+    }
+  }
+
+  FREE_ARRAY(vm, int, worklist, chunk->count);
+  FREE_ARRAY(vm, int, depths, chunk->count);
+  return max;
+}
+
+
+// Switch tables
+
+int addSwitchTable(void* vm, Chunk* chunk) {
+  chunk->switches = GROW_ARRAY(vm, chunk->switches, SwitchTable,
+      chunk->switchCount, chunk->switchCount + 1);
+  SwitchTable* table = &chunk->switches[chunk->switchCount];
+  table->cases = NULL;
+  table->capacity = 0;
+  table->count = 0;
+  table->dense = NULL;
+  table->low = 0;
+  table->denseCount = 0;
+  table->missTarget = -1;
+  return chunk->switchCount++;
+}
+
+// Free the tables from index count on, for code that was thrown away
+void removeSwitchTables(void* vm, Chunk* chunk, int count) {
+  if (count >= chunk->switchCount) return;
+  for (int i = count; i < chunk->switchCount; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    FREE_ARRAY(vm, SwitchCase, table->cases, table->capacity);
+    FREE_ARRAY(vm, int, table->dense, table->denseCount);
+  }
+  chunk->switches = GROW_ARRAY(vm, chunk->switches, SwitchTable, chunk->switchCount, count);
+  chunk->switchCount = count;
+}
+
+static uint32_t hashSwitchKey(Value key) {
+  if (IS_STRING(key)) return AS_STRING(key)->hash;
+  double number = AS_NUMBER(key);
+  if (number == 0) number = 0; // -0 matches 0
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static SwitchCase* findSwitchCase(SwitchCase* cases, int capacity, Value key) {
+  uint32_t index = hashSwitchKey(key) & (capacity - 1);
+  for (;;) {
+    SwitchCase* entry = &cases[index];
+    if (IS_UNDEFINED(entry->key) || valuesEqual(entry->key, key)) return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+// Add a case, unless an earlier case has the same value. The key must be
+// a number or a string that is kept alive elsewhere, like in the constants.
+bool addSwitchCase(void* vm, SwitchTable* table, Value key, int target) {
+  if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) return false; // NaN never matches
+
+  if ((table->count + 1) * 2 > table->capacity) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    SwitchCase* cases = ALLOCATE(vm, SwitchCase, capacity);
+    for (int i = 0; i < capacity; i++) cases[i].key = UNDEFINED_VAL;
+    for (int i = 0; i < table->capacity; i++) {
+      if (IS_UNDEFINED(table->cases[i].key)) continue;
+      *findSwitchCase(cases, capacity, table->cases[i].key) = table->cases[i];
+    }
+    FREE_ARRAY(vm, SwitchCase, table->cases, table->capacity);
+    table->cases = cases;
+    table->capacity = capacity;
+  }
+
+  SwitchCase* entry = findSwitchCase(table->cases, table->capacity, key);
+  if (!IS_UNDEFINED(entry->key)) return false;
+  entry->key = key;
+  entry->target = target;
+  table->count++;
+  return true;
+}
+
+static bool isSwitchInteger(Value key) {
+  if (!IS_NUMBER(key)) return false;
+  double number = AS_NUMBER(key);
+  return number >= INT32_MIN && number <= INT32_MAX && number == (int)number;
+}
+
+// Build the dense array if all cases are integers in a small range
+void finishSwitchTable(void* vm, SwitchTable* table) {
+  if (table->count < 2) return;
+
+  int low = INT32_MAX;
+  int high = INT32_MIN;
+  for (int i = 0; i < table->capacity; i++) {
+    Value key = table->cases[i].key;
+    if (IS_UNDEFINED(key)) continue;
+    if (!isSwitchInteger(key)) return;
+    int number = (int)AS_NUMBER(key);
+    if (number < low) low = number;
+    if (number > high) high = number;
+  }
+  if ((int64_t)high - low + 1 > (int64_t)table->count * 2) return;
+
+  table->low = low;
+  table->denseCount = high - low + 1;
+  table->dense = ALLOCATE(vm, int, table->denseCount);
+  for (int i = 0; i < table->denseCount; i++) table->dense[i] = -1;
+  for (int i = 0; i < table->capacity; i++) {
+    if (IS_UNDEFINED(table->cases[i].key)) continue;
+    table->dense[(int)AS_NUMBER(table->cases[i].key) - low] = table->cases[i].target;
+  }
+}
+
+// Offset to continue at for the switch value key
+int findSwitchTarget(SwitchTable* table, Value key) {
+  if (table->dense != NULL) {
+    if (IS_INT(key)) {
+      int64_t index = AS_INT(key) - table->low;
+      int target = index >= 0 && index < table->denseCount ? table->dense[index] : -1;
+      return target >= 0 ? target : table->missTarget;
+    }
+    if (!IS_NUMBER(key)) return table->missTarget;
+    double index = AS_NUMBER(key) - table->low;
+    if (!(index >= 0 && index < table->denseCount) || index != (int)index) return table->missTarget;
+    int target = table->dense[(int)index];
+    return target >= 0 ? target : table->missTarget;
+  }
+  if (table->count == 0 || !(IS_NUMBER(key) || IS_STRING(key))) return table->missTarget;
+
+  SwitchCase* entry = findSwitchCase(table->cases, table->capacity, key);
+  return IS_UNDEFINED(entry->key) ? table->missTarget : entry->target;
+}
+
+// Update the targets after the optimizer has moved the code around
+void remapSwitchTable(SwitchTable* table, int* newOffset) {
+  for (int i = 0; i < table->capacity; i++) {
+    if (!IS_UNDEFINED(table->cases[i].key)) table->cases[i].target = newOffset[table->cases[i].target];
+  }
+  for (int i = 0; i < table->denseCount; i++) {
+    if (table->dense[i] >= 0) table->dense[i] = newOffset[table->dense[i]];
+  }
+  table->missTarget = newOffset[table->missTarget];
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <stdint.h>
 
 #include "common.h"
@@ -12,6 +13,7 @@
 #include "parser.h"
 //#include "scanner.h"
 #include "object.h"
+#include "optimizer.h"
 #include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -159,6 +161,18 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastConstant; // Offset of the last constant load emitted, -1 if none
+  int lastTarget; // Highest forward jump target patched so far
+  int optimize; // Optimization level, see optimizer.h
+
+  // Innermost loop and loop or switch, for continue and break, see
+  // https://github.com/munificent/craftinginterpreters/blob/master/note/answers/chapter23_jumping/2.md
+  int innermostLoopStart; // -1 outside of a loop
+  int innermostLoopScopeDepth;
+  int innermostBreakScopeStart; // -1 outside of a loop or switch
+  int innermostBreakScopeDepth;
+  int* innermostBreakJump; // Jumps to patch at the end of the statement
+  int innermostBreakJumps;
 
   ErrorCb error_callback;
 
@@ -174,14 +188,6 @@ typedef struct ClassCompiler {
 // Compiler* current = NULL; // Moved to vm.c
 // ClassCompiler* currentClass = NULL; // Moved to vm.c
 
-// https://github.com/munificent/craftinginterpreters/blob/master/note/answers/chapter23_jumping/2.md
-int innermostLoopStart = -1;
-int innermostLoopScopeDepth = 0;
-int innermostBreakScopeStart = -1;
-int innermostBreakScopeDepth = 0;
-int* innermostBreakJump = NULL;
-int innermostBreakJumps = 0;
-
 static Chunk* currentChunk(VM* vm) {
   return &vm->compiler->function->chunk;
   //return &current->function->chunk;
@@ -256,8 +262,19 @@ static uint16_t makeConstant(VM* vm, Value value) {
   return (uint16_t)constant;
 }
 
+// Allocate an inline cache for an OP_GET/SET_PROPERTY or OP_INVOKE site
+static uint16_t makeInlineCache(VM* vm) {
+  ObjFunction* function = vm->compiler->function;
+  if (function->cacheCount == UINT16_MAX) {
+    error(vm->compiler->parser, "Too many property accesses in one function.");
+    return 0;
+  }
+  return (uint16_t)function->cacheCount++;
+}
+
 static void emitConstant(VM* vm, Value value) {
 //  emitBytes(vm, OP_CONSTANT, makeConstant(vm, value));
+  vm->compiler->lastConstant = currentChunk(vm)->count;
   emitByte(vm, OP_CONSTANT);
   uint16_t constant = makeConstant(vm, value);
   emitWord(vm, constant);
@@ -274,6 +291,176 @@ static void patchJump(VM* vm, int offset) {
 
   currentChunk(vm)->code[offset] = (jump >> 8) & 0xff;
   currentChunk(vm)->code[offset + 1] = jump & 0xff;
+  vm->compiler->lastTarget = currentChunk(vm)->count;
+}
+
+
+// Constant folding
+//
+// A constant operand is a single OP_CONSTANT, OP_TRUE, OP_FALSE or OP_NULL
+// at the very end of the chunk. It can only be folded away if no jump lands
+// inside or right after it, like the else branch of (c ? 1 : 2) + 3 does.
+
+// Return the value of the trailing constant operand, if there is one
+static bool trailingConstant(VM* vm, Value* value) {
+  Compiler* cc = vm->compiler;
+  Chunk* chunk = currentChunk(vm);
+  int start = cc->lastConstant;
+  if (start < 0 || cc->lastTarget > start) return false;
+
+  switch (chunk->code[start]) {
+    case OP_CONSTANT:
+      if (start + 3 != chunk->count) return false;
+      *value = chunk->constants.values[(chunk->code[start + 1] << 8) | chunk->code[start + 2]];
+      return true;
+    case OP_TRUE:  *value = BOOL_VAL(true); break;
+    case OP_FALSE: *value = BOOL_VAL(false); break;
+    case OP_NULL:  *value = NULL_VAL; break;
+    default:
+      return false;
+  }
+  return start + 1 == chunk->count;
+}
+
+// Throw away the code emitted from offset start, it will never run
+static void discardCode(VM* vm, int start) {
+  Compiler* cc = vm->compiler;
+  Chunk* chunk = currentChunk(vm);
+  // Tables are numbered in code order, the first one in the dead code and
+  // all after it go too
+  for (int offset = start; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    if (chunk->code[offset] == OP_SWITCH_TABLE) {
+      removeSwitchTables(vm, chunk, (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+      break;
+    }
+  }
+  chunk->count = start;
+  if (cc->lastConstant >= start) cc->lastConstant = -1;
+  if (cc->lastTarget > start) cc->lastTarget = start;
+  // Break jumps are recorded in order, drop the ones that were discarded
+  while (cc->innermostBreakJumps > 0 && cc->innermostBreakJump[cc->innermostBreakJumps - 1] >= start) {
+    cc->innermostBreakJumps--;
+  }
+}
+
+static void emitValue(VM* vm, Value value) {
+  if (IS_BOOL(value) || IS_NULL(value)) {
+    vm->compiler->lastConstant = currentChunk(vm)->count;
+    emitByte(vm, IS_NULL(value) ? OP_NULL : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(vm, value);
+  }
+}
+
+// Replace the constant operand(s) emitted from offset start with value
+static void replaceConstant(VM* vm, int start, Value value) {
+  push(vm, value); // Keep safe from GC
+  discardCode(vm, start);
+  emitValue(vm, value);
+  pop(vm);
+}
+
+// Same as isFalsey() in vm.c, for the value types a constant can have
+static bool isFalseConstant(Value value) {
+  return IS_NULL(value) ||
+        (IS_BOOL(value) && !AS_BOOL(value)) ||
+        (IS_NUMBER(value) && AS_NUMBER(value) == 0) ||
+        (IS_STRING(value) && AS_STRING(value)->length == 0);
+}
+
+static bool isIntConstant(double number) {
+  return number >= INT32_MIN && number <= INT32_MAX;
+}
+
+static ObjString* repeatString(VM* vm, ObjString* string, int times) {
+  int length = string->length * times;
+  char* chars = ALLOCATE(vm, char, length + 1);
+  for (int i = 0; i < times; i++) {
+    memcpy(chars + i * string->length, string->chars, string->length);
+  }
+  chars[length] = '\0';
+  return takeString(vm, chars, length);
+}
+
+static ObjString* concatenateConstants(VM* vm, ObjString* a, ObjString* b) {
+  int length = a->length + b->length;
+  char* chars = ALLOCATE(vm, char, length + 1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  chars[length] = '\0';
+  return takeString(vm, chars, length);
+}
+
+// Evaluate a binary operator the way run() would. Return false if the
+// operation would fail (or is undefined), the error is left to run time.
+static bool foldBinary(VM* vm, TokenType operatorType, Value a, Value b, Value* result) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    int64_t x = valueToInt(a);
+    int64_t y = valueToInt(b);
+    switch (operatorType) {
+      case TOKEN_PLUS:  *result = addNumbers(a, b); return true;
+      case TOKEN_MINUS: *result = subtractNumbers(a, b); return true;
+      case TOKEN_STAR:  *result = multiplyNumbers(a, b); return true;
+      case TOKEN_SLASH:
+        *result = divideNumbers(a, b);
+        return !isinf(AS_NUMBER(*result)); // Division by zero
+      case TOKEN_PERCENT:
+        if (y == 0) return false;
+        *result = moduloInts(x, y);
+        return true;
+      case TOKEN_LESS_LESS:       *result = shiftLeftInts(x, y); return true;
+      case TOKEN_GREATER_GREATER: *result = shiftRightInts(x, y); return true;
+      case TOKEN_AMP:   *result = INT_VAL(x & y); return true;
+      case TOKEN_PIPE:  *result = INT_VAL(x | y); return true;
+      case TOKEN_CARET: *result = INT_VAL(x ^ y); return true;
+      default:
+        break;
+    }
+  }
+
+  switch (operatorType) {
+    case TOKEN_BANG_EQUAL:    *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+    case TOKEN_EQUAL_EQUAL:   *result = BOOL_VAL(valuesEqual(a, b)); return true;
+    case TOKEN_GREATER:       *result = BOOL_VAL(valuesGreater(a, b)); return true;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(valuesEqual(b, a) || valuesGreater(a, b)); return true;
+    case TOKEN_LESS:          *result = BOOL_VAL(valuesGreater(b, a)); return true;
+    case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(valuesEqual(b, a) || valuesGreater(b, a)); return true;
+    case TOKEN_PLUS:
+      if (!IS_STRING(a) || !IS_STRING(b)) return false;
+      *result = OBJ_VAL(concatenateConstants(vm, AS_STRING(a), AS_STRING(b)));
+      return true;
+    case TOKEN_STAR:
+      if (IS_NUMBER(a) && IS_STRING(b)) {
+        Value swap = a;
+        a = b;
+        b = swap;
+      }
+      if (!IS_STRING(a) || !IS_NUMBER(b)) return false;
+      if (AS_NUMBER(b) < 0 || !isIntConstant(AS_NUMBER(b))) return false;
+      *result = OBJ_VAL(repeatString(vm, AS_STRING(a), (int)AS_NUMBER(b)));
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool foldUnary(TokenType operatorType, Value a, Value* result) {
+  switch (operatorType) {
+    case TOKEN_BANG:
+      *result = BOOL_VAL(isFalseConstant(a));
+      return true;
+    case TOKEN_MINUS:
+      if (IS_NUMBER(a)) *result = negateNumber(a);
+      else if (IS_BOOL(a)) *result = BOOL_VAL(!AS_BOOL(a));
+      else return false;
+      return true;
+    case TOKEN_TILDE:
+      if (!IS_NUMBER(a)) return false;
+      *result = INT_VAL(~valueToInt(a));
+      return true;
+    default:
+      return false;
+  }
 }
 
 
@@ -288,6 +475,15 @@ static void initCompiler(VM* vm, Compiler* compiler, Parser* parser, FunctionTyp
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastConstant = -1;
+  compiler->lastTarget = 0;
+  compiler->innermostLoopStart = -1;
+  compiler->innermostLoopScopeDepth = 0;
+  compiler->innermostBreakScopeStart = -1;
+  compiler->innermostBreakScopeDepth = 0;
+  compiler->innermostBreakJump = NULL;
+  compiler->innermostBreakJumps = 0;
+  compiler->optimize = compiler->enclosing != NULL ? compiler->enclosing->optimize : OPTIMIZE_NONE;
   compiler->error_callback = vm->error_callback;
 
 #ifdef DEBUG_TRACE_COMPILER
@@ -335,6 +531,14 @@ static ObjFunction* endCompiler(VM* vm) {
   emitReturn(vm);
 //  ObjFunction* function = current->function;
   ObjFunction* function = vm->compiler->function;
+  if (!vm->compiler->parser->hadError) {
+    optimizeChunk(vm, currentChunk(vm), vm->compiler->optimize);
+  }
+  if (!vm->compiler->parser->hadError) {
+    function->maxSlots = getMaxStackDepth(vm, currentChunk(vm), function->arity + 1);
+    if (function->maxSlots < 0) error(vm->compiler->parser, "Inconsistent stack depth in generated code.");
+  }
+  newInlineCaches(vm, function);
 #ifdef DEBUG_PRINT_CODE
   if (!vm->compiler->parser->hadError) {
     hexdump(currentChunk(vm)->code, currentChunk(vm)->count);
@@ -397,6 +601,19 @@ static uint16_t identifierConstant(VM* vm, Token* name) {
   return makeConstant(vm, OBJ_VAL(copyString(vm, name->start, name->length)));
 }
 
+// Globals are resolved to a slot in vm->globals at compile time
+static uint16_t globalVariable(VM* vm, Token* name) {
+  ObjString* string = copyString(vm, name->start, name->length);
+  push(vm, OBJ_VAL(string)); // Keep safe from GC
+  int slot = resolveGlobal(vm, string);
+  pop(vm);
+  if (slot > UINT16_MAX) {
+    error(vm->compiler->parser, "Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -498,7 +715,7 @@ static uint16_t parseVariable(VM* vm, const char* errorMessage) {
 //  if (current->scopeDepth > 0) return 0;
   if (vm->compiler->scopeDepth > 0) return 0;
 
-  return identifierConstant(vm, &vm->compiler->parser->previous);
+  return globalVariable(vm, &vm->compiler->parser->previous);
 }
 
 static void markInitialized(VM* vm) {
@@ -553,10 +770,24 @@ static void binary(VM* vm, bool canAssign) {
   // Remember the operator.
   TokenType operatorType = vm->compiler->parser->previous.type;
 
+  // Check for a constant left operand before compiling the right one
+  Value a;
+  int start = vm->compiler->lastConstant;
+  bool isConstant = trailingConstant(vm, &a);
+  int end = currentChunk(vm)->count;
+
   // Compile the right operand.
   ParseRule* rule = getRule(operatorType); // asks: what precedence is this operator?
   parsePrecedence(vm, (Precedence)(rule->precedence + 1)); // ok, look for higher ones
 
+  Value b;
+  Value result;
+  if (isConstant && vm->compiler->lastConstant == end && trailingConstant(vm, &b) &&
+      foldBinary(vm, operatorType, a, b, &result)) {
+    replaceConstant(vm, start, result);
+    return;
+  }
+
   // No higher level expressions found?
   // The stack now contains our two (computed or constant) operands
   // Emit the operator instruction.
@@ -599,6 +830,7 @@ static void dot(VM* vm, bool canAssign) {
 //    emitBytes(vm, OP_SET_PROPERTY, name);
     emitByte(vm, OP_SET_PROPERTY);
     emitWord(vm, name);
+    emitWord(vm, makeInlineCache(vm));
 #ifdef OPTIMIZE_METHOD_CALLS
   } else if (match(vm->compiler->parser, TOKEN_LEFT_PAREN)) {
     // Optimized invocation of bound method calls - chapter 28.5
@@ -609,11 +841,13 @@ static void dot(VM* vm, bool canAssign) {
     emitByte(vm, OP_INVOKE);
     emitWord(vm, name);
     emitByte(vm, argCount);
+    emitWord(vm, makeInlineCache(vm));
   #endif
   } else {
 //    emitBytes(vm, OP_GET_PROPERTY, name);
     emitByte(vm, OP_GET_PROPERTY);
     emitWord(vm, name);
+    emitWord(vm, makeInlineCache(vm));
   }
 
 
@@ -667,6 +901,7 @@ static void dot(VM* vm, bool canAssign) {
 
 static void literal(VM* vm, bool canAssign) {
   (unused)canAssign;
+  vm->compiler->lastConstant = currentChunk(vm)->count;
   switch (vm->compiler->parser->previous.type) {
     case TOKEN_FALSE: emitByte(vm, OP_FALSE); break;
     case TOKEN_NULL: emitByte(vm, OP_NULL); break;
@@ -759,7 +994,7 @@ static void b2number(VM* vm, bool canAssign) {
   (unused)canAssign;
 //  double value = (double) strtol(vm->compiler->parser->previous.start+2, NULL, 2); // +2 = skip '0b' prefix
   double value = str_to_double(vm->compiler->parser->previous.start+2, vm->compiler->parser->previous.length-2, 2); // +2 = skip '0b' prefix
-  emitConstant(vm, NUMBER_VAL(value));
+  emitConstant(vm, normalizeNumber(value));
 }
 
 
@@ -767,7 +1002,7 @@ static void b8number(VM* vm, bool canAssign) {
   (unused)canAssign;
 //  double value = (double) strtol(vm->compiler->parser->previous.start, NULL, 8);
   double value = str_to_double(vm->compiler->parser->previous.start, vm->compiler->parser->previous.length, 8);
-  emitConstant(vm, NUMBER_VAL(value));
+  emitConstant(vm, normalizeNumber(value));
 }
 
 
@@ -775,7 +1010,7 @@ static void b10number(VM* vm, bool canAssign) {
   (unused)canAssign;
 //  double value = strtod(vm->compiler->parser->previous.start, NULL);
   double value = str_to_double(vm->compiler->parser->previous.start, vm->compiler->parser->previous.length, 10);
-  emitConstant(vm, NUMBER_VAL(value));
+  emitConstant(vm, normalizeNumber(value));
 }
 
 
@@ -783,7 +1018,7 @@ static void b16number(VM* vm, bool canAssign) {
   (unused)canAssign;
 //  double value = (double) strtol(vm->compiler->parser->previous.start+2, NULL, 16); // +2 = skip '0x' prefix
   double value = str_to_double(vm->compiler->parser->previous.start+2, vm->compiler->parser->previous.length-2, 16); // +2 = skip '0x' prefix
-  emitConstant(vm, NUMBER_VAL(value));
+  emitConstant(vm, normalizeNumber(value));
 }
 
 
@@ -938,7 +1173,7 @@ static void namedVariable(VM* vm, Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(vm, &name);
+    arg = globalVariable(vm, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
@@ -1062,6 +1297,13 @@ static void unary(VM* vm, bool canAssign) {
   // Compile the operand.
   parsePrecedence(vm, PREC_UNARY);
 
+  Value a;
+  Value result;
+  if (trailingConstant(vm, &a) && foldUnary(operatorType, a, &result)) {
+    replaceConstant(vm, vm->compiler->lastConstant, result);
+    return;
+  }
+
   // Emit the operator instruction.
   switch (operatorType) {
     case TOKEN_BANG: emitByte(vm, OP_NOT); break;
@@ -1077,6 +1319,21 @@ static void unary(VM* vm, bool canAssign) {
 
 static void ternary(VM* vm, bool canAssign) { // aka. conditional()
   (unused)canAssign;
+  Value condition;
+  if (trailingConstant(vm, &condition)) {
+    // Only compile the branch that will be taken
+    int start = vm->compiler->lastConstant;
+    bool isTrue = !isFalseConstant(condition);
+    discardCode(vm, start);
+    parsePrecedence(vm, PREC_CONDITIONAL);
+    if (!isTrue) discardCode(vm, start);
+    consume(vm->compiler->parser, TOKEN_COLON, "Expect ':' after then branch of conditional operator.");
+    start = currentChunk(vm)->count;
+    parsePrecedence(vm, PREC_ASSIGNMENT);
+    if (isTrue) discardCode(vm, start);
+    return;
+  }
+
   int thenJump = emitJump(vm, OP_PJMP_IF_FALSE);
   // Compile the then branch.
   parsePrecedence(vm, PREC_CONDITIONAL);
@@ -1287,7 +1544,7 @@ static void classDeclaration(VM* vm) {
 //  emitBytes(vm, OP_CLASS, nameConstant);
   emitByte(vm, OP_CLASS);
   emitWord(vm, nameConstant);
-  defineVariable(vm, nameConstant);
+  defineVariable(vm, vm->compiler->scopeDepth > 0 ? 0 : globalVariable(vm, &className));
 
   ClassCompiler classCompiler;
   //classCompiler.name = parser.previous;
@@ -1356,8 +1613,13 @@ static void varDeclaration(VM* vm) {
 }
 
 static void breakStatement(VM* vm) {
-  if (innermostBreakScopeStart == -1) {
+  if (vm->compiler->innermostBreakScopeStart == -1) {
     error(vm->compiler->parser, "Cannot use 'break' outside of a loop or switch.");
+    return; // No jump list to add to, e.g. in a function declared in a loop
+  }
+  if (vm->compiler->innermostBreakJumps == MAX_BREAKS_PER_SCOPE) {
+    error(vm->compiler->parser, "Too many 'break' statements in loop or switch.");
+    return;
   }
   consume(vm->compiler->parser, TOKEN_SEMICOLON, "Expect ';' after 'continue'.");
 
@@ -1365,17 +1627,18 @@ static void breakStatement(VM* vm) {
 //  for (int i = current->localCount - 1;
   for (int i = vm->compiler->localCount - 1;
 //       i >= 0 && current->locals[i].depth > innermostBreakScopeDepth;
-       i >= 0 && vm->compiler->locals[i].depth > innermostBreakScopeDepth;
+       i >= 0 && vm->compiler->locals[i].depth > vm->compiler->innermostBreakScopeDepth;
        i--) {
     emitByte(vm, OP_POP);
   }
 
-  innermostBreakJump[innermostBreakJumps++] = emitJump(vm, OP_JUMP);
+  vm->compiler->innermostBreakJump[vm->compiler->innermostBreakJumps++] = emitJump(vm, OP_JUMP);
 }
 
 static void continueStatement(VM* vm) {
-  if (innermostLoopStart == -1) {
+  if (vm->compiler->innermostLoopStart == -1) {
     error(vm->compiler->parser, "Cannot use 'continue' outside of a loop.");
+    return;
   }
   consume(vm->compiler->parser, TOKEN_SEMICOLON, "Expect ';' after 'continue'.");
 
@@ -1383,13 +1646,13 @@ static void continueStatement(VM* vm) {
 //  for (int i = current->localCount - 1;
 //       i >= 0 && current->locals[i].depth > innermostLoopScopeDepth;
   for (int i = vm->compiler->localCount - 1;
-       i >= 0 && vm->compiler->locals[i].depth > innermostLoopScopeDepth;
+       i >= 0 && vm->compiler->locals[i].depth > vm->compiler->innermostLoopScopeDepth;
        i--) {
     emitByte(vm, OP_POP);
   }
 
   // Jump to top of current innermost loop.
-  emitLoop(vm, innermostLoopStart);
+  emitLoop(vm, vm->compiler->innermostLoopStart);
 }
 
 static void exitStatement(VM* vm) {
@@ -1421,23 +1684,23 @@ static void forStatement(VM* vm) {
 
   // Note the loop starting point
   // both for "continue" and for the loop itself
-  int surroundingLoopStart = innermostLoopStart;
-  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
-  innermostLoopStart = currentChunk(vm)->count;
+  int surroundingLoopStart = vm->compiler->innermostLoopStart;
+  int surroundingLoopScopeDepth = vm->compiler->innermostLoopScopeDepth;
+  vm->compiler->innermostLoopStart = currentChunk(vm)->count;
 //  innermostLoopScopeDepth = current->scopeDepth;
-  innermostLoopScopeDepth = vm->compiler->scopeDepth;
+  vm->compiler->innermostLoopScopeDepth = vm->compiler->scopeDepth;
 
   // for "break"
-  int surroundingBreakScopeStart = innermostBreakScopeStart;
-  int surroundingBreakScopeDepth = innermostBreakScopeDepth;
-  int* surroundingBreakJump = innermostBreakJump;
-  int surroundingBreakJumps = innermostBreakJumps;
-  innermostBreakScopeStart = currentChunk(vm)->count;
+  int surroundingBreakScopeStart = vm->compiler->innermostBreakScopeStart;
+  int surroundingBreakScopeDepth = vm->compiler->innermostBreakScopeDepth;
+  int* surroundingBreakJump = vm->compiler->innermostBreakJump;
+  int surroundingBreakJumps = vm->compiler->innermostBreakJumps;
+  vm->compiler->innermostBreakScopeStart = currentChunk(vm)->count;
 //  innermostBreakScopeDepth = current->scopeDepth;
-  innermostBreakScopeDepth = vm->compiler->scopeDepth;
-  innermostBreakJump = malloc(MAX_BREAKS_PER_SCOPE * sizeof(int));
+  vm->compiler->innermostBreakScopeDepth = vm->compiler->scopeDepth;
+  vm->compiler->innermostBreakJump = malloc(MAX_BREAKS_PER_SCOPE * sizeof(int));
   //printf("ifStatement() allocated bpjump buffer %p\n", innermostBreakJump);
-  innermostBreakJumps = 0;
+  vm->compiler->innermostBreakJumps = 0;
 
   // Condition?
   int exitJump = -1;
@@ -1463,8 +1726,8 @@ static void forStatement(VM* vm) {
 
     //emitLoop(loopStart); // Jump to just before the loop condition
     //loopStart = incrementStart;
-    emitLoop(vm, innermostLoopStart); // <-- for "continue"
-    innermostLoopStart = incrementStart; // <-- for "continue"
+    emitLoop(vm, vm->compiler->innermostLoopStart); // <-- for "continue"
+    vm->compiler->innermostLoopStart = incrementStart; // <-- for "continue"
 
     patchJump(vm, bodyJump);
   }
@@ -1473,7 +1736,7 @@ static void forStatement(VM* vm) {
   statement(vm);
 
   //emitLoop(loopStart); // Jump to incrementStart (if any), otherwise loopStart
-  emitLoop(vm, innermostLoopStart); // <--
+  emitLoop(vm, vm->compiler->innermostLoopStart); // <--
 
   // Mark the exit point for the loop
   if (exitJump != -1) {
@@ -1481,25 +1744,25 @@ static void forStatement(VM* vm) {
     //emitByte(OP_POP); // Condition.
   }
 
-  innermostLoopStart = surroundingLoopStart; // <-- for "continue"
-  innermostLoopScopeDepth = surroundingLoopScopeDepth; // <-- for "continue"
+  vm->compiler->innermostLoopStart = surroundingLoopStart; // <-- for "continue"
+  vm->compiler->innermostLoopScopeDepth = surroundingLoopScopeDepth; // <-- for "continue"
 
-  for (int i = 0; i < innermostBreakJumps; i++) {
+  for (int i = 0; i < vm->compiler->innermostBreakJumps; i++) {
     //printf("ifStatement() patching break jump %d\n", i);
-    patchJump(vm, innermostBreakJump[i]);
+    patchJump(vm, vm->compiler->innermostBreakJump[i]);
   }
 
   // for "break"
 #ifdef DEBUG_TRACE_MEMORY_VERBOSE
-  printf("compiler:forStatement() free(%p) // innermostBreakJump\n", (void*) innermostBreakJump);
+  printf("compiler:forStatement() free(%p) // innermostBreakJump\n", (void*) vm->compiler->innermostBreakJump);
 #endif
-  free(innermostBreakJump);
+  free(vm->compiler->innermostBreakJump);
 
   //printf("ifStatement() freed bpjump buffer %p\n", innermostBreakJump);
-  innermostBreakScopeStart = surroundingBreakScopeStart;
-  innermostBreakScopeDepth = surroundingBreakScopeDepth;
-  innermostBreakJump = surroundingBreakJump;
-  innermostBreakJumps = surroundingBreakJumps;
+  vm->compiler->innermostBreakScopeStart = surroundingBreakScopeStart;
+  vm->compiler->innermostBreakScopeDepth = surroundingBreakScopeDepth;
+  vm->compiler->innermostBreakJump = surroundingBreakJump;
+  vm->compiler->innermostBreakJumps = surroundingBreakJumps;
 
   endScope(vm);
 }
@@ -1509,6 +1772,22 @@ static void ifStatement(VM* vm) {
   expression(vm);
   consume(vm->compiler->parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  Value condition;
+  if (trailingConstant(vm, &condition)) {
+    // Dead branch elimination, the branches are still parsed for errors
+    int start = vm->compiler->lastConstant;
+    bool isTrue = !isFalseConstant(condition);
+    discardCode(vm, start);
+    statement(vm);
+    if (!isTrue) discardCode(vm, start);
+    if (match(vm->compiler->parser, TOKEN_ELSE)) {
+      start = currentChunk(vm)->count;
+      statement(vm);
+      if (isTrue) discardCode(vm, start);
+    }
+    return;
+  }
+
   int thenJump = emitJump(vm, OP_PJMP_IF_FALSE);
   //emitByte(OP_POP); // We no longer need the jump condition
   statement(vm);
@@ -1528,6 +1807,13 @@ static void printStatement(VM* vm) {
   emitByte(vm, OP_PRINT);
 }
 
+// True if the code at offset leads straight to end, maybe through jumps
+// like the one at the end of the then branch of ?:
+static bool returnsResult(Chunk* chunk, int offset, int end) {
+  while (offset < end && chunk->code[offset] == OP_JUMP) offset = getJumpTarget(chunk, offset);
+  return offset == end;
+}
+
 static void returnStatement(VM* vm) {
 //  if (current->type == TYPE_SCRIPT) {
   if (vm->compiler->type == TYPE_SCRIPT) {
@@ -1541,8 +1827,21 @@ static void returnStatement(VM* vm) {
     if (vm->compiler->type == TYPE_INITIALIZER) {
       error(vm->compiler->parser, "Cannot return a value from an initializer.");
     }
+    int start = currentChunk(vm)->count;
     expression(vm);
     consume(vm->compiler->parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // return f(...); reuses the current call frame, and so do the calls
+    // that end the branches of ?: in return c ? f(x) : g(x);. OP_RETURN
+    // stays, it is still needed for jumps to the end of the expression
+    // (return a or f();) and after calls that don't push a frame, like
+    // natives.
+    Chunk* chunk = currentChunk(vm);
+    for (int offset = start; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+      if (chunk->code[offset] == OP_CALL && returnsResult(chunk, offset + 2, chunk->count)) {
+        chunk->code[offset] = OP_TAIL_CALL;
+      }
+    }
     emitByte(vm, OP_RETURN);
   }
 }
@@ -1555,25 +1854,36 @@ static void switchStatement(VM* vm) {
   consume(vm->compiler->parser, TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
   expression(vm);
   consume(vm->compiler->parser, TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+  // The switch value is a local without a name, so the slots of the locals
+  // in the cases are right and "break" and "continue" pop what they must
+  addLocal(vm, syntheticToken(""));
+  markInitialized(vm);
   consume(vm->compiler->parser, TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
 
   int state = 0; // 0: before all cases, 1: before default, 2: after default.
 
   // for "break"
-  int surroundingBreakScopeStart = innermostBreakScopeStart;
-  int surroundingBreakScopeDepth = innermostBreakScopeDepth;
-  int* surroundingBreakJump = innermostBreakJump;
-  int surroundingBreakJumps = innermostBreakJumps;
-  innermostBreakScopeStart = currentChunk(vm)->count;
+  int surroundingBreakScopeStart = vm->compiler->innermostBreakScopeStart;
+  int surroundingBreakScopeDepth = vm->compiler->innermostBreakScopeDepth;
+  int* surroundingBreakJump = vm->compiler->innermostBreakJump;
+  int surroundingBreakJumps = vm->compiler->innermostBreakJumps;
+  vm->compiler->innermostBreakScopeStart = currentChunk(vm)->count;
 //  innermostBreakScopeDepth = current->scopeDepth;
-  innermostBreakScopeDepth = vm->compiler->scopeDepth;
-  innermostBreakJump = malloc(MAX_BREAKS_PER_SCOPE * sizeof(int));
+  vm->compiler->innermostBreakScopeDepth = vm->compiler->scopeDepth;
+  vm->compiler->innermostBreakJump = malloc(MAX_BREAKS_PER_SCOPE * sizeof(int));
   //printf("switchStatement() allocated bpjump buffer %p\n", innermostBreakJump);
-  innermostBreakJumps = 0;
+  vm->compiler->innermostBreakJumps = 0;
 
   int previousCaseSkip = -1;
   int fallThrough = -1;
 
+  // While all case values are number or string constants, the cases go
+  // into a jump table instead of being tested one by one. The first case
+  // that isn't a constant and the default case are where OP_SWITCH_TABLE
+  // continues if no case in the table matches.
+  bool tableMode = true;
+  int switchTable = -1;
+
   while (!match(vm->compiler->parser, TOKEN_RIGHT_BRACE) && !check(vm->compiler->parser, TOKEN_EOF)) {
 
     if (match(vm->compiler->parser, TOKEN_CASE) || match(vm->compiler->parser, TOKEN_DEFAULT)) {
@@ -1583,14 +1893,16 @@ static void switchStatement(VM* vm) {
         error(vm->compiler->parser, "Cannot have cases after the default case.");
       }
 
-      if (state == 1) {
+      int caseStart = currentChunk(vm)->count;
+      if (state == 1 && (previousCaseSkip != -1 || caseType == TOKEN_CASE)) {
         // If control reashes this point, it means the previous case matched
         // but did not break. This means we need a fallthrough jump.
         fallThrough = emitJump(vm, OP_JUMP);
 
         // If that case didn't match, patch its condition to jump to jump here.
-        patchJump(vm, previousCaseSkip);
+        if (previousCaseSkip != -1) patchJump(vm, previousCaseSkip);
       }
+      int testStart = currentChunk(vm)->count;
 
       if (caseType == TOKEN_CASE) {
         state = 1;
@@ -1600,13 +1912,31 @@ static void switchStatement(VM* vm) {
 
         consume(vm->compiler->parser, TOKEN_COLON, "Expect ':' after case value.");
 
-        emitByte(vm, OP_EQUAL);
-        previousCaseSkip = emitJump(vm, OP_PJMP_IF_FALSE);
+        Value value;
+        if (tableMode && trailingConstant(vm, &value) && (IS_NUMBER(value) || IS_STRING(value))) {
+          // No test needed, the previous case falls through into this one
+          discardCode(vm, caseStart);
+          fallThrough = -1;
+          if (switchTable == -1) {
+            switchTable = addSwitchTable(vm, currentChunk(vm));
+            emitByte(vm, OP_SWITCH_TABLE);
+            emitWord(vm, (uint16_t)switchTable);
+          }
+          addSwitchCase(vm, &currentChunk(vm)->switches[switchTable], value, currentChunk(vm)->count);
+          previousCaseSkip = -1;
+        } else {
+          if (tableMode && switchTable != -1) currentChunk(vm)->switches[switchTable].missTarget = testStart;
+          tableMode = false;
+          emitByte(vm, OP_EQUAL);
+          previousCaseSkip = emitJump(vm, OP_PJMP_IF_FALSE);
+        }
 
       } else {
         // Default
         state = 2;
         consume(vm->compiler->parser, TOKEN_COLON, "Expect ':' after default.");
+        if (tableMode && switchTable != -1) currentChunk(vm)->switches[switchTable].missTarget = testStart;
+        tableMode = false;
         previousCaseSkip = -1;
       }
 
@@ -1634,23 +1964,28 @@ static void switchStatement(VM* vm) {
   }
 
   // Patch all break jumps
-  for (int i = 0; i < innermostBreakJumps; i++) {
-    patchJump(vm, innermostBreakJump[i]);
+  for (int i = 0; i < vm->compiler->innermostBreakJumps; i++) {
+    patchJump(vm, vm->compiler->innermostBreakJump[i]);
+  }
+
+  if (switchTable != -1) {
+    SwitchTable* table = &currentChunk(vm)->switches[switchTable];
+    if (table->missTarget == -1) table->missTarget = currentChunk(vm)->count;
+    finishSwitchTable(vm, table);
   }
 
   // for "break"
 #ifdef DEBUG_TRACE_MEMORY_VERBOSE
-  printf("compiler:switchStatement() free(%p) // innermostBreakJump\n", (void*) innermostBreakJump);
+  printf("compiler:switchStatement() free(%p) // innermostBreakJump\n", (void*) vm->compiler->innermostBreakJump);
 #endif
-  free(innermostBreakJump);
+  free(vm->compiler->innermostBreakJump);
   //printf("switchStatement() freed bpjump buffer %p\n", innermostBreakJump);
-  innermostBreakScopeStart = surroundingBreakScopeStart;
-  innermostBreakScopeDepth = surroundingBreakScopeDepth;
-  innermostBreakJump = surroundingBreakJump;
-  innermostBreakJumps = surroundingBreakJumps;
+  vm->compiler->innermostBreakScopeStart = surroundingBreakScopeStart;
+  vm->compiler->innermostBreakScopeDepth = surroundingBreakScopeDepth;
+  vm->compiler->innermostBreakJump = surroundingBreakJump;
+  vm->compiler->innermostBreakJumps = surroundingBreakJumps;
 
-  emitByte(vm, OP_POP); // The switch value.
-  endScope(vm);
+  endScope(vm); // Pops the switch value
 }
 
 
@@ -1658,23 +1993,23 @@ static void whileStatement(VM* vm) {
 
   // Note the loop starting point
   // both for "continue" and for the loop itself
-  int surroundingLoopStart = innermostLoopStart;
-  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
-  innermostLoopStart = currentChunk(vm)->count;
+  int surroundingLoopStart = vm->compiler->innermostLoopStart;
+  int surroundingLoopScopeDepth = vm->compiler->innermostLoopScopeDepth;
+  vm->compiler->innermostLoopStart = currentChunk(vm)->count;
 //  innermostLoopScopeDepth = current->scopeDepth;
-  innermostLoopScopeDepth = vm->compiler->scopeDepth;
+  vm->compiler->innermostLoopScopeDepth = vm->compiler->scopeDepth;
 
   // for "break"
-  int surroundingBreakScopeStart = innermostBreakScopeStart;
-  int surroundingBreakScopeDepth = innermostBreakScopeDepth;
-  int* surroundingBreakJump = innermostBreakJump;
-  int surroundingBreakJumps = innermostBreakJumps;
-  innermostBreakScopeStart = currentChunk(vm)->count;
+  int surroundingBreakScopeStart = vm->compiler->innermostBreakScopeStart;
+  int surroundingBreakScopeDepth = vm->compiler->innermostBreakScopeDepth;
+  int* surroundingBreakJump = vm->compiler->innermostBreakJump;
+  int surroundingBreakJumps = vm->compiler->innermostBreakJumps;
+  vm->compiler->innermostBreakScopeStart = currentChunk(vm)->count;
 //  innermostBreakScopeDepth = current->scopeDepth;
-  innermostBreakScopeDepth = vm->compiler->scopeDepth;
-  innermostBreakJump = malloc(MAX_BREAKS_PER_SCOPE * sizeof(int));
+  vm->compiler->innermostBreakScopeDepth = vm->compiler->scopeDepth;
+  vm->compiler->innermostBreakJump = malloc(MAX_BREAKS_PER_SCOPE * sizeof(int));
   //printf("whileStatement() allocated bpjump buffer %p\n", innermostBreakJump);
-  innermostBreakJumps = 0;
+  vm->compiler->innermostBreakJumps = 0;
 
   consume(vm->compiler->parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression(vm);
@@ -1683,28 +2018,28 @@ static void whileStatement(VM* vm) {
   int exitJump = emitJump(vm, OP_PJMP_IF_FALSE);
 
   statement(vm);
-  emitLoop(vm, innermostLoopStart); // <-- for "continue"
+  emitLoop(vm, vm->compiler->innermostLoopStart); // <-- for "continue"
 
 
   patchJump(vm, exitJump);
-  innermostLoopStart = surroundingLoopStart; // <-- for "continue"
-  innermostLoopScopeDepth = surroundingLoopScopeDepth; // <-- for "continue"
+  vm->compiler->innermostLoopStart = surroundingLoopStart; // <-- for "continue"
+  vm->compiler->innermostLoopScopeDepth = surroundingLoopScopeDepth; // <-- for "continue"
 
-  for (int i = 0; i < innermostBreakJumps; i++) {
+  for (int i = 0; i < vm->compiler->innermostBreakJumps; i++) {
     //printf("whileStatement() patching break jump %d\n", i);
-    patchJump(vm, innermostBreakJump[i]);
+    patchJump(vm, vm->compiler->innermostBreakJump[i]);
   }
 
   // for "break"
 #ifdef DEBUG_TRACE_MEMORY_VERBOSE
-  printf("compiler:whileStatement() free(%p) // innermostBreakJump\n", (void*) innermostBreakJump);
+  printf("compiler:whileStatement() free(%p) // innermostBreakJump\n", (void*) vm->compiler->innermostBreakJump);
 #endif
-  free(innermostBreakJump);
+  free(vm->compiler->innermostBreakJump);
   //printf("whileStatement() freed bpjump buffer %p\n", innermostBreakJump);
-  innermostBreakScopeStart = surroundingBreakScopeStart;
-  innermostBreakScopeDepth = surroundingBreakScopeDepth;
-  innermostBreakJump = surroundingBreakJump;
-  innermostBreakJumps = surroundingBreakJumps;
+  vm->compiler->innermostBreakScopeStart = surroundingBreakScopeStart;
+  vm->compiler->innermostBreakScopeDepth = surroundingBreakScopeDepth;
+  vm->compiler->innermostBreakJump = surroundingBreakJump;
+  vm->compiler->innermostBreakJumps = surroundingBreakJumps;
 
 }
 
@@ -1783,7 +2118,7 @@ static void statement(VM* vm) {
 
 
 // Main entry point
-ObjFunction* compile(void* vm, int fileno, const char* source) {
+ObjFunction* compile(void* vm, int fileno, const char* source, int optimize) {
 #ifdef DEBUG_TRACE_COMPILER
   printf("compiler:compile() vm=%p fileno=%d source length=%d\n", vm, fileno, (int)strlen(source));
 #endif
@@ -1795,6 +2130,7 @@ ObjFunction* compile(void* vm, int fileno, const char* source) {
 #endif
 
   initCompiler(vm, &compiler, parser, TYPE_SCRIPT);
+  compiler.optimize = optimize;
 #ifdef DEBUG_TRACE_COMPILER
   printf("compiler:compile() initialized compiler %p\n", &compiler);
 #endif
@@ -6,6 +6,101 @@
 #include "value.h"
 
 
+static const char* opcodeNames[] = {
+  [OP_CONSTANT]             = "OP_CONSTANT",
+  [OP_NULL]                 = "OP_NULL",
+  [OP_TRUE]                 = "OP_TRUE",
+  [OP_FALSE]                = "OP_FALSE",
+  [OP_POP]                  = "OP_POP",
+  [OP_POPN]                 = "OP_POPN",
+  [OP_DUP]                  = "OP_DUP",
+  [OP_GET_LOCAL]            = "OP_GET_LOCAL",
+  [OP_SET_LOCAL]            = "OP_SET_LOCAL",
+  [OP_GET_GLOBAL]           = "OP_GET_GLOBAL",
+  [OP_DEFINE_GLOBAL]        = "OP_DEFINE_GLOBAL",
+  [OP_SET_GLOBAL]           = "OP_SET_GLOBAL",
+  [OP_MAKE_ARRAY]           = "OP_MAKE_ARRAY",
+  [OP_GET_INDEX]            = "OP_GET_INDEX",
+  [OP_SET_INDEX]            = "OP_SET_INDEX",
+  [OP_GET_SLICE]            = "OP_GET_SLICE",
+  [OP_SET_SLICE]            = "OP_SET_SLICE",
+  [OP_GET_UPVALUE]          = "OP_GET_UPVALUE",
+  [OP_SET_UPVALUE]          = "OP_SET_UPVALUE",
+  [OP_GET_PROPERTY]         = "OP_GET_PROPERTY",
+  [OP_SET_PROPERTY]         = "OP_SET_PROPERTY",
+  [OP_GET_SUPER]            = "OP_GET_SUPER",
+  [OP_EQUAL]                = "OP_EQUAL",
+  [OP_NEQUAL]               = "OP_NEQUAL",
+  [OP_GREATER]              = "OP_GREATER",
+  [OP_GEQUAL]               = "OP_GEQUAL",
+  [OP_INC]                  = "OP_INC",
+  [OP_DEC]                  = "OP_DEC",
+  [OP_LESS]                 = "OP_LESS",
+  [OP_LEQUAL]               = "OP_LEQUAL",
+  [OP_ADD]                  = "OP_ADD",
+  [OP_SUBTRACT]             = "OP_SUBTRACT",
+  [OP_MULTIPLY]             = "OP_MULTIPLY",
+  [OP_DIVIDE]               = "OP_DIVIDE",
+  [OP_MODULO]               = "OP_MODULO",
+  [OP_NOT]                  = "OP_NOT",
+  [OP_NEGATE]               = "OP_NEGATE",
+  [OP_BIN_NOT]              = "OP_BIN_NOT",
+  [OP_BIN_SHIFTL]           = "OP_BIN_SHIFTL",
+  [OP_BIN_SHIFTR]           = "OP_BIN_SHIFTR",
+  [OP_BIN_AND]              = "OP_BIN_AND",
+  [OP_BIN_OR]               = "OP_BIN_OR",
+  [OP_BIN_XOR]              = "OP_BIN_XOR",
+  [OP_PRINT]                = "OP_PRINT",
+  [OP_JUMP]                 = "OP_JUMP",
+  [OP_PJMP_IF_FALSE]        = "OP_PJMP_IF_FALSE",
+  [OP_QJMP_IF_FALSE]        = "OP_QJMP_IF_FALSE",
+  [OP_LOOP]                 = "OP_LOOP",
+  [OP_SWITCH_TABLE]         = "OP_SWITCH_TABLE",
+  [OP_CALL]                 = "OP_CALL",
+  [OP_TAIL_CALL]            = "OP_TAIL_CALL",
+  [OP_INVOKE]               = "OP_INVOKE",
+  [OP_SUPER_INVOKE]         = "OP_SUPER_INVOKE",
+  [OP_CLOSURE]              = "OP_CLOSURE",
+  [OP_CLOSE_UPVALUE]        = "OP_CLOSE_UPVALUE",
+  [OP_RETURN]               = "OP_RETURN",
+  [OP_EXIT]                 = "OP_EXIT",
+  [OP_CLASS]                = "OP_CLASS",
+  [OP_INHERIT]              = "OP_INHERIT",
+  [OP_METHOD]               = "OP_METHOD",
+  [OP_ADD_LOCALS]           = "OP_ADD_LOCALS",
+  [OP_ADD_LOCAL_CONST]      = "OP_ADD_LOCAL_CONST",
+  [OP_SUB_LOCAL_CONST]      = "OP_SUB_LOCAL_CONST",
+  [OP_LESS_LOCAL_CONST_JMP] = "OP_LESS_LOCAL_CONST_JMP",
+  [OP_INC_LOCAL]            = "OP_INC_LOCAL",
+  [OP_DEC_LOCAL]            = "OP_DEC_LOCAL",
+  [OP_SET_LOCAL_POP]        = "OP_SET_LOCAL_POP",
+  [OP_MOVE]                 = "OP_MOVE",
+  [OP_LOAD_CONST]           = "OP_LOAD_CONST",
+  [OP_ADD_RR]               = "OP_ADD_RR",
+  [OP_SUB_RR]               = "OP_SUB_RR",
+  [OP_MUL_RR]               = "OP_MUL_RR",
+  [OP_ADD_RK]               = "OP_ADD_RK",
+  [OP_SUB_RK]               = "OP_SUB_RK",
+  [OP_MUL_RK]               = "OP_MUL_RK",
+  [OP_EQUAL_NUM]            = "OP_EQUAL_NUM",
+  [OP_NEQUAL_NUM]           = "OP_NEQUAL_NUM",
+  [OP_GREATER_NUM]          = "OP_GREATER_NUM",
+  [OP_GEQUAL_NUM]           = "OP_GEQUAL_NUM",
+  [OP_LESS_NUM]             = "OP_LESS_NUM",
+  [OP_LEQUAL_NUM]           = "OP_LEQUAL_NUM",
+  [OP_ADD_NUM]              = "OP_ADD_NUM",
+  [OP_SUBTRACT_NUM]         = "OP_SUBTRACT_NUM",
+  [OP_MULTIPLY_NUM]         = "OP_MULTIPLY_NUM",
+  [OP_DIVIDE_NUM]           = "OP_DIVIDE_NUM",
+  [OP_CALL_NATIVE]          = "OP_CALL_NATIVE",
+};
+
+const char* getOpcodeName(uint8_t opcode) {
+  if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0])) return "OP_UNKNOWN";
+  if (opcodeNames[opcode] == NULL) return "OP_UNKNOWN";
+  return opcodeNames[opcode];
+}
+
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -50,15 +145,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_POPN:
       return byteInstruction("OP_POPN", chunk, offset);
     case OP_GET_LOCAL:
-      return byteInstruction("OP_GET_LOCAL", chunk, offset);
+      return shortInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
-      return byteInstruction("OP_SET_LOCAL", chunk, offset);
+      return shortInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return shortInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return shortInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return shortInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_MAKE_ARRAY:
       return byteInstruction("OP_MAKE_ARRAY", chunk, offset);
     case OP_GET_INDEX:
@@ -70,13 +165,13 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_SLICE:
       return simpleInstruction("OP_SET_SLICE", offset);
     case OP_GET_UPVALUE:
-      return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+      return shortInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
-      return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+      return shortInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return cacheInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return cacheInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_FALSE:
@@ -135,10 +230,16 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_QJMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_SWITCH_TABLE:
+      return switchInstruction("OP_SWITCH_TABLE", chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_CALL_NATIVE:
+      return byteInstruction("OP_CALL_NATIVE", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cacheInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
@@ -174,6 +275,67 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_ADD_LOCALS: {
+      uint16_t a = (chunk->code[offset + 1]<<8) | chunk->code[offset + 2];
+      uint16_t b = (chunk->code[offset + 3]<<8) | chunk->code[offset + 4];
+      printf("%-16s %4x %4x\n", "OP_ADD_LOCALS", a, b);
+      return offset + 5;
+    }
+    case OP_ADD_LOCAL_CONST:
+      return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+    case OP_SUB_LOCAL_CONST:
+      return localConstantInstruction("OP_SUB_LOCAL_CONST", chunk, offset);
+    case OP_LESS_LOCAL_CONST_JMP: {
+      uint16_t slot = (chunk->code[offset + 1]<<8) | chunk->code[offset + 2];
+      uint16_t constant = (chunk->code[offset + 3]<<8) | chunk->code[offset + 4];
+      uint16_t jump = (chunk->code[offset + 5]<<8) | chunk->code[offset + 6];
+      printf("%-16s %4x %04x '", "OP_LESS_LOCAL_CONST_JMP", slot, constant);
+      printValue(chunk->constants.values[constant]);
+      printf("' %04x -> %04x\n", offset, offset + 7 + jump);
+      return offset + 7;
+    }
+    case OP_INC_LOCAL:
+      return shortInstruction("OP_INC_LOCAL", chunk, offset);
+    case OP_DEC_LOCAL:
+      return shortInstruction("OP_DEC_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_POP:
+      return shortInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_MOVE:
+      return registerInstruction("OP_MOVE", chunk, offset, 2, false);
+    case OP_LOAD_CONST:
+      return registerInstruction("OP_LOAD_CONST", chunk, offset, 2, true);
+    case OP_ADD_RR:
+      return registerInstruction("OP_ADD_RR", chunk, offset, 3, false);
+    case OP_SUB_RR:
+      return registerInstruction("OP_SUB_RR", chunk, offset, 3, false);
+    case OP_MUL_RR:
+      return registerInstruction("OP_MUL_RR", chunk, offset, 3, false);
+    case OP_ADD_RK:
+      return registerInstruction("OP_ADD_RK", chunk, offset, 3, true);
+    case OP_SUB_RK:
+      return registerInstruction("OP_SUB_RK", chunk, offset, 3, true);
+    case OP_MUL_RK:
+      return registerInstruction("OP_MUL_RK", chunk, offset, 3, true);
+    case OP_EQUAL_NUM:
+      return simpleInstruction("OP_EQUAL_NUM", offset);
+    case OP_NEQUAL_NUM:
+      return simpleInstruction("OP_NEQUAL_NUM", offset);
+    case OP_GREATER_NUM:
+      return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_GEQUAL_NUM:
+      return simpleInstruction("OP_GEQUAL_NUM", offset);
+    case OP_LESS_NUM:
+      return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_LEQUAL_NUM:
+      return simpleInstruction("OP_LEQUAL_NUM", offset);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_SUBTRACT_NUM:
+      return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+      return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+      return simpleInstruction("OP_DIVIDE_NUM", offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
@@ -191,7 +353,7 @@ int constantInstruction(const char* name, Chunk* chunk, int offset) {
   printValue(chunk->constants.values[constant]);
   printf("'\n");
 //  return offset + 2;
-  return offset + 2;
+  return offset + 3;
 }
 
 int invokeInstruction(const char* name, Chunk* chunk, int offset) {
@@ -202,7 +364,31 @@ int invokeInstruction(const char* name, Chunk* chunk, int offset) {
   printValue(chunk->constants.values[constant]);
   printf("'\n");
 //  return offset + 2;
-  return offset + 3;
+  return offset + 4;
+}
+
+// Instructions with a name constant, optional argCount and an inline cache
+int cacheInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t constant = (chunk->code[offset + 1]<<8) | chunk->code[offset + 2];
+  if (chunk->code[offset] == OP_INVOKE) {
+    printf("%-16s (%d args) %04x '", name, chunk->code[offset + 3], constant);
+    offset++;
+  } else {
+    printf("%-16s %04x '", name, constant);
+  }
+  printValue(chunk->constants.values[constant]);
+  uint16_t cache = (chunk->code[offset + 3]<<8) | chunk->code[offset + 4];
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
+int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t slot = (chunk->code[offset + 1]<<8) | chunk->code[offset + 2];
+  uint16_t constant = (chunk->code[offset + 3]<<8) | chunk->code[offset + 4];
+  printf("%-16s %4x %04x '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 5;
 }
 
 /*
@@ -231,6 +417,31 @@ int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+//static
+// Register instructions: slot operands, the one before the last may be a
+// constant, the result goes to the last
+int registerInstruction(const char* name, Chunk* chunk, int offset, int operands, bool constant) {
+  printf("%-16s", name);
+  for (int i = 0; i < operands; i++) {
+    uint16_t operand = (chunk->code[offset + 1 + 2 * i]<<8) | chunk->code[offset + 2 + 2 * i];
+    if (constant && i == operands - 2) {
+      printf(" %04x '", operand);
+      printValue(chunk->constants.values[operand]);
+      printf("'");
+    } else {
+      printf(" %4x", operand);
+    }
+  }
+  printf("\n");
+  return offset + 1 + 2 * operands;
+}
+
+int shortInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t slot = (chunk->code[offset + 1]<<8) | chunk->code[offset + 2];
+  printf("%-16s %4x\n", name, slot);
+  return offset + 3;
+}
+
 //static
 int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -240,3 +451,17 @@ int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+int switchInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t index = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  SwitchTable* table = &chunk->switches[index];
+  printf("%-16s %4d %s", name, index, table->dense != NULL ? "dense" : "hash");
+  for (int i = 0; i < table->capacity; i++) {
+    if (IS_UNDEFINED(table->cases[i].key)) continue;
+    printf(" ");
+    printValue(table->cases[i].key);
+    printf("->%04x", table->cases[i].target);
+  }
+  printf(" else->%04x\n", table->missTarget);
+  return offset + 3;
+}
+
@@ -24,7 +24,8 @@ char* vbprintf(char* buf, const char* format, va_list argp) {
     buf = newbuf;
   }
   //printf("error:vbprintf() calling 2nd vsnprintf(%p, %d, \"%s\", %p)\n", buf+bufsiz, addsiz, format, argp);
-  vsnprintf(buf+bufsiz, addsiz, format, argp_copy);
+  vsnprintf(buf+bufsiz, addsiz+1, format, argp_copy);
+  va_end(argp_copy);
   //va_end (args);
   buf[bufsiz+addsiz] = '\0'; // Terminate
 
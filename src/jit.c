@@ -0,0 +1,864 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "jit.h"
+
+// Baseline template JIT for x86-64 Linux
+//
+// A function is compiled once it is hot: when the ticks (calls and loop
+// back-edges, see TICK in vm.c) counted against it reach vm->jitThreshold.
+// Each instruction is translated on its own into a fixed x86-64 template,
+// there is no register allocation and the value stack stays in memory,
+// so native and interpreted code can hand over at any instruction.
+//
+// Templates handle the common cases inline (integers, locals, globals,
+// jumps) and call small C helpers for the rest. Whatever a template does
+// not handle is a side exit: the native code writes back the stack top and
+// returns the bytecode offset of the instruction, and run() executes it,
+// which also raises any runtime error. Calls, returns, properties, closures
+// and classes are always side exits. Native code never allocates, so the
+// garbage collector never runs while it does.
+//
+// Registers while native code runs:
+//   rbx = stack top, r12 = frame slots, r13 = vm, r14 = QNAN | TAG_INT
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+// Native entry: fn(vm, slots, stackTop, start), returns (offset << 1) | yield
+typedef int (*JitEntry)(VM* vm, Value* slots, Value* sp, void* start);
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes of Jcc and SETcc
+#define CC_O  0x0
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+#define CC_JMP -1
+
+// Opcodes of the reg, r/m forms
+#define X_ADD  0x01
+#define X_OR   0x09
+#define X_AND  0x21
+#define X_SUB  0x29
+#define X_XOR  0x31
+#define X_CMP  0x39
+#define X_TEST 0x85
+#define X_STORE 0x89
+#define X_LOAD 0x8b
+#define X_LEA  0x8d
+
+typedef struct {
+  int at;     // Position of the rel32 to patch
+  int offset; // Bytecode offset to go to
+  int pop;    // Side exits: values the instruction pushed before exiting
+} Patch;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+  Patch* jumps;   // Jumps to bytecode offsets
+  int jumpCount;
+  int jumpCapacity;
+  Patch* exits;   // Conditional side exits
+  int exitCount;
+  int exitCapacity;
+  int* native;    // Native position of each bytecode offset
+  int exitLabel;  // Writes back the stack top and returns
+  int switchExit; // Returns the bytecode offset in eax
+  bool failed;    // Out of memory
+} Assembler;
+
+
+static void emitByte(Assembler* as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    int capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    uint8_t* code = realloc(as->code, capacity);
+    if (code == NULL) {
+      as->failed = true;
+      as->count = 0;
+      return;
+    }
+    as->code = code;
+    as->capacity = capacity;
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Assembler* as, int at, int32_t value) {
+  if (as->failed) return;
+  memcpy(as->code + at, &value, sizeof(value));
+}
+
+static void addPatch(Assembler* as, Patch** patches, int* count, int* capacity,
+                     int offset, int pop) {
+  if (*count == *capacity) {
+    int newCapacity = *capacity < 16 ? 16 : *capacity * 2;
+    Patch* grown = realloc(*patches, sizeof(Patch) * newCapacity);
+    if (grown == NULL) {
+      as->failed = true;
+      return;
+    }
+    *patches = grown;
+    *capacity = newCapacity;
+  }
+  (*patches)[(*count)++] = (Patch){ as->count - 4, offset, pop };
+}
+
+
+// REX.W prefix for a reg and an r/m operand
+static void rex(Assembler* as, int reg, int rm) {
+  emitByte(as, 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+}
+
+// op rm, reg with two registers
+static void opRR(Assembler* as, uint8_t op, int reg, int rm) {
+  rex(as, reg, rm);
+  emitByte(as, op);
+  emitByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + disp] or op [base + disp], reg
+static void opRM(Assembler* as, uint8_t op, int reg, int base, int32_t disp) {
+  rex(as, reg, base);
+  emitByte(as, op);
+  emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emitByte(as, 0x24); // SIB for rsp and r12
+  emit32(as, (uint32_t)disp);
+}
+
+// add/sub rm, imm32 (ext 0 = add, 5 = sub)
+static void opRI(Assembler* as, int ext, int rm, int32_t imm) {
+  rex(as, 0, rm);
+  emitByte(as, 0x81);
+  emitByte(as, 0xc0 | (ext << 3) | (rm & 7));
+  emit32(as, (uint32_t)imm);
+}
+
+// shl/shr rm, imm8 (ext 4 = shl, 5 = shr)
+static void shiftRI(Assembler* as, int ext, int rm, uint8_t count) {
+  rex(as, 0, rm);
+  emitByte(as, 0xc1);
+  emitByte(as, 0xc0 | (ext << 3) | (rm & 7));
+  emitByte(as, count);
+}
+
+static void movRR(Assembler* as, int dst, int src) {
+  opRR(as, X_STORE, src, dst);
+}
+
+static void movRI(Assembler* as, int reg, uint64_t imm) {
+  emitByte(as, 0x48 | ((reg & 8) >> 3));
+  emitByte(as, 0xb8 + (reg & 7));
+  emit64(as, imm);
+}
+
+static void callHelper(Assembler* as, void* function) {
+  movRI(as, RAX, (uint64_t)(uintptr_t)function);
+  emitByte(as, 0xff); // call rax
+  emitByte(as, 0xd0);
+}
+
+static void testAl(Assembler* as) {
+  emitByte(as, 0x84);
+  emitByte(as, 0xc0);
+}
+
+// Jcc or JMP with a rel32 to fill in, returns the position of the rel32
+static int emitJump(Assembler* as, int cc) {
+  if (cc == CC_JMP) {
+    emitByte(as, 0xe9);
+  } else {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | cc);
+  }
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+// Point a jump from emitJump() here
+static void patchJump(Assembler* as, int at) {
+  patch32(as, at, as->count - (at + 4));
+}
+
+static void jumpBack(Assembler* as, int cc, int label) {
+  int at = emitJump(as, cc);
+  patch32(as, at, label - (at + 4));
+}
+
+static void jumpTo(Assembler* as, int cc, int offset) {
+  emitJump(as, cc);
+  addPatch(as, &as->jumps, &as->jumpCount, &as->jumpCapacity, offset, 0);
+}
+
+// Leave native code, resuming the interpreter at offset
+static void exitAt(Assembler* as, int offset, bool yield) {
+  emitByte(as, 0xb8); // mov eax, imm32
+  emit32(as, (uint32_t)((offset << 1) | yield));
+  jumpBack(as, CC_JMP, as->exitLabel);
+}
+
+// Leave native code if cc holds, after dropping pop values pushed so far
+static void exitIf(Assembler* as, int cc, int offset, int pop) {
+  emitJump(as, cc);
+  addPatch(as, &as->exits, &as->exitCount, &as->exitCapacity, offset, pop);
+}
+
+
+// Stack and frame access
+static void emitPush(Assembler* as, int reg) {
+  opRM(as, X_STORE, reg, RBX, 0);
+  opRI(as, 0, RBX, sizeof(Value));
+}
+
+static void emitDrop(Assembler* as, int count) {
+  if (count > 0) opRI(as, 5, RBX, count * (int)sizeof(Value));
+}
+
+static void loadLocal(Assembler* as, int reg, int slot) {
+  opRM(as, X_LOAD, reg, R12, slot * (int)sizeof(Value));
+}
+
+static void loadGlobals(Assembler* as, int reg) {
+  opRM(as, X_LOAD, reg, R13, (int32_t)(offsetof(VM, globals) + offsetof(ValueArray, values)));
+}
+
+// Jump to the returned patch unless rax and rcx are both integers
+static int checkInts(Assembler* as) {
+  movRR(as, RDX, RAX);
+  opRR(as, X_AND, RCX, RDX);
+  opRR(as, X_AND, R14, RDX);
+  opRR(as, X_CMP, R14, RDX);
+  return emitJump(as, CC_NE);
+}
+
+
+// Helpers called from native code. They get the stack top and never
+// allocate or raise errors, returning false makes the native code exit.
+
+static bool jitArithmetic(Value* sp, int op) {
+  Value a = sp[-2];
+  Value b = sp[-1];
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  Value result;
+  switch (op) {
+    case OP_ADD:        result = addNumbers(a, b); break;
+    case OP_SUBTRACT:   result = subtractNumbers(a, b); break;
+    case OP_MULTIPLY:   result = multiplyNumbers(a, b); break;
+    case OP_DIVIDE:
+      result = divideNumbers(a, b);
+      if (isinf(AS_NUMBER(result))) return false; // Division by zero
+      break;
+    case OP_MODULO:
+      if (valueToInt(b) == 0) return false;
+      result = moduloInts(valueToInt(a), valueToInt(b));
+      break;
+    case OP_BIN_SHIFTL: result = shiftLeftInts(valueToInt(a), valueToInt(b)); break;
+    case OP_BIN_SHIFTR: result = shiftRightInts(valueToInt(a), valueToInt(b)); break;
+    case OP_BIN_AND:    result = INT_VAL(valueToInt(a) & valueToInt(b)); break;
+    case OP_BIN_OR:     result = INT_VAL(valueToInt(a) | valueToInt(b)); break;
+    case OP_BIN_XOR:    result = INT_VAL(valueToInt(a) ^ valueToInt(b)); break;
+    default: return false;
+  }
+  sp[-2] = result;
+  return true;
+}
+
+static void jitCompare(Value* sp, int op) {
+  Value a = sp[-2];
+  Value b = sp[-1];
+  bool result;
+  switch (op) {
+    case OP_EQUAL:   result = valuesEqual(a, b); break;
+    case OP_NEQUAL:  result = !valuesEqual(a, b); break;
+    case OP_GREATER: result = valuesGreater(a, b); break;
+    case OP_GEQUAL:  result = valuesEqual(b, a) || valuesGreater(a, b); break;
+    case OP_LESS:    result = valuesGreater(b, a); break;
+    default:         result = valuesEqual(b, a) || valuesGreater(b, a); break; // OP_LEQUAL
+  }
+  sp[-2] = BOOL_VAL(result);
+}
+
+// Works on a value in place, for OP_INC_LOCAL and OP_DEC_LOCAL too
+static bool jitUnary(Value* value, int op) {
+  Value a = *value;
+  switch (op) {
+    case OP_NOT:
+      *value = BOOL_VAL(isFalsey(a));
+      return true;
+    case OP_NEGATE:
+      if (IS_BOOL(a)) {
+        *value = BOOL_VAL(!AS_BOOL(a));
+        return true;
+      }
+      if (!IS_NUMBER(a)) return false;
+      *value = negateNumber(a);
+      return true;
+    case OP_BIN_NOT:
+      if (!IS_NUMBER(a)) return false;
+      *value = INT_VAL(~valueToInt(a));
+      return true;
+    case OP_INC:
+      if (!IS_NUMBER(a)) return false;
+      *value = addNumbers(a, INT_VAL(1));
+      return true;
+    case OP_DEC:
+      if (!IS_NUMBER(a)) return false;
+      *value = subtractNumbers(a, INT_VAL(1));
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool jitIsFalsey(Value value) {
+  return isFalsey(value);
+}
+
+// Same fast paths as OP_GET_INDEX and OP_SET_INDEX in run()
+static bool jitGetIndex(Value* sp) {
+  Value index = sp[-1];
+  Value array = sp[-2];
+  if (!IS_INT(index) || !IS_ARRAY(array)) return false;
+  int64_t i = AS_INT(index);
+  if (i < 0 || i >= AS_ARRAY(array)->length) return false;
+  sp[-2] = AS_ARRAY(array)->values[i];
+  return true;
+}
+
+static bool jitSetIndex(Value* sp) {
+  Value index = sp[-2];
+  Value array = sp[-3];
+  if (!IS_INT(index) || !IS_ARRAY(array)) return false;
+  int64_t i = AS_INT(index);
+  if (i < 0 || i >= AS_ARRAY(array)->length) return false;
+  AS_ARRAY(array)->values[i] = sp[-1];
+  sp[-3] = sp[-1];
+  return true;
+}
+
+static void jitPrint(Value value) {
+  printValue(value);
+  printf("\n");
+}
+
+static bool jitTick(VM* vm) {
+  return timesliceExpired(vm);
+}
+
+
+// Templates
+
+// OP_ADD and OP_SUBTRACT: integers inline, other numbers in jitArithmetic()
+static void emitArithmetic(Assembler* as, int op, int offset, int pop) {
+  opRM(as, X_LOAD, RAX, RBX, -16);
+  opRM(as, X_LOAD, RCX, RBX, -8);
+  int notInts = checkInts(as);
+  int overflow = -1;
+  if (op == OP_ADD || op == OP_SUBTRACT) {
+    // Shifted up so the 48-bit overflow sets the overflow flag
+    shiftRI(as, 4, RAX, 16);
+    shiftRI(as, 4, RCX, 16);
+    opRR(as, op == OP_ADD ? X_ADD : X_SUB, RCX, RAX);
+    overflow = emitJump(as, CC_O);
+    shiftRI(as, 5, RAX, 16);
+    opRR(as, X_OR, R14, RAX);
+  } else {
+    // OP_BIN_AND and OP_BIN_OR keep the tag bits of two integers
+    opRR(as, op == OP_BIN_AND ? X_AND : X_OR, RCX, RAX);
+  }
+  opRM(as, X_STORE, RAX, RBX, -16);
+  emitDrop(as, 1);
+  int done = emitJump(as, CC_JMP);
+
+  patchJump(as, notInts);
+  if (overflow != -1) patchJump(as, overflow);
+  movRR(as, RDI, RBX);
+  movRI(as, RSI, (uint64_t)op);
+  callHelper(as, jitArithmetic);
+  testAl(as);
+  exitIf(as, CC_E, offset, pop);
+  emitDrop(as, 1);
+  patchJump(as, done);
+}
+
+// The other binary operators only go through jitArithmetic()
+static void emitArithmeticCall(Assembler* as, int op, int offset, int pop) {
+  movRR(as, RDI, RBX);
+  movRI(as, RSI, (uint64_t)op);
+  callHelper(as, jitArithmetic);
+  testAl(as);
+  exitIf(as, CC_E, offset, pop);
+  emitDrop(as, 1);
+}
+
+// Comparisons never fail, anything but two integers goes to jitCompare()
+static void emitCompare(Assembler* as, int op) {
+  static const int conditions[] = {
+    [OP_EQUAL] = CC_E, [OP_NEQUAL] = CC_NE, [OP_GREATER] = CC_G,
+    [OP_GEQUAL] = CC_GE, [OP_LESS] = CC_L, [OP_LEQUAL] = CC_LE,
+  };
+  opRM(as, X_LOAD, RAX, RBX, -16);
+  opRM(as, X_LOAD, RCX, RBX, -8);
+  int notInts = checkInts(as);
+  if (op != OP_EQUAL && op != OP_NEQUAL) {
+    // Integers compare like their sign extended payloads
+    shiftRI(as, 4, RAX, 16);
+    shiftRI(as, 4, RCX, 16);
+  }
+  emitByte(as, 0x31); // xor edx, edx
+  emitByte(as, 0xd2);
+  opRR(as, X_CMP, RCX, RAX);
+  emitByte(as, 0x0f); // setcc dl
+  emitByte(as, 0x90 | conditions[op]);
+  emitByte(as, 0xc2);
+  movRI(as, RAX, FALSE_VAL);
+  opRR(as, X_OR, RDX, RAX); // FALSE_VAL | 1 == TRUE_VAL
+  opRM(as, X_STORE, RAX, RBX, -16);
+  int done = emitJump(as, CC_JMP);
+
+  patchJump(as, notInts);
+  movRR(as, RDI, RBX);
+  movRI(as, RSI, (uint64_t)op);
+  callHelper(as, jitCompare);
+  patchJump(as, done);
+  emitDrop(as, 1);
+}
+
+// Unary operators on the value at [base + disp]. Integers are incremented
+// and decremented inline.
+static void emitUnary(Assembler* as, int op, int base, int32_t disp, int offset) {
+  int done = -1;
+  if (op == OP_INC || op == OP_DEC) {
+    opRM(as, X_LOAD, RAX, base, disp);
+    movRR(as, RDX, RAX);
+    opRR(as, X_AND, R14, RDX);
+    opRR(as, X_CMP, R14, RDX);
+    int notInt = emitJump(as, CC_NE);
+    shiftRI(as, 4, RAX, 16);
+    movRI(as, RCX, (uint64_t)1 << 16);
+    opRR(as, op == OP_INC ? X_ADD : X_SUB, RCX, RAX);
+    int overflow = emitJump(as, CC_O);
+    shiftRI(as, 5, RAX, 16);
+    opRR(as, X_OR, R14, RAX);
+    opRM(as, X_STORE, RAX, base, disp);
+    done = emitJump(as, CC_JMP);
+    patchJump(as, notInt);
+    patchJump(as, overflow);
+  }
+  opRM(as, X_LEA, RDI, base, disp);
+  movRI(as, RSI, (uint64_t)op);
+  callHelper(as, jitUnary);
+  testAl(as);
+  exitIf(as, CC_E, offset, 0);
+  if (done != -1) patchJump(as, done);
+}
+
+// Jump to target if rax is falsey
+static void emitJumpIfFalse(Assembler* as, int target) {
+  movRI(as, RCX, TRUE_VAL);
+  opRR(as, X_CMP, RCX, RAX);
+  int isTrue = emitJump(as, CC_E);
+  movRI(as, RCX, FALSE_VAL);
+  opRR(as, X_CMP, RCX, RAX);
+  jumpTo(as, CC_E, target);
+  movRR(as, RDI, RAX);
+  callHelper(as, jitIsFalsey);
+  testAl(as);
+  jumpTo(as, CC_NE, target);
+  patchJump(as, isTrue);
+}
+
+static uint16_t readShort(uint8_t* code) {
+  return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+// Emit the template of the instruction at offset, return false if it is
+// a side exit only
+static bool emitInstruction(Assembler* as, Chunk* chunk, int offset, int next) {
+  uint8_t* code = chunk->code + offset;
+  Value* constants = chunk->constants.values;
+  uint8_t op = getGenericOpcode(code[0]); // Quickened ones share the generic templates
+
+  switch (op) {
+    case OP_CONSTANT:
+      movRI(as, RAX, constants[readShort(code + 1)]);
+      emitPush(as, RAX);
+      return true;
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+      movRI(as, RAX, op == OP_NULL ? NULL_VAL : op == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+      emitPush(as, RAX);
+      return true;
+    case OP_POP:
+      emitDrop(as, 1);
+      return true;
+    case OP_POPN:
+      emitDrop(as, code[1]);
+      return true;
+    case OP_DUP:
+      opRM(as, X_LOAD, RAX, RBX, -8);
+      emitPush(as, RAX);
+      return true;
+    case OP_GET_LOCAL:
+      loadLocal(as, RAX, readShort(code + 1));
+      emitPush(as, RAX);
+      return true;
+    case OP_SET_LOCAL:
+      opRM(as, X_LOAD, RAX, RBX, -8);
+      opRM(as, X_STORE, RAX, R12, readShort(code + 1) * (int)sizeof(Value));
+      return true;
+    case OP_SET_LOCAL_POP:
+      emitDrop(as, 1);
+      opRM(as, X_LOAD, RAX, RBX, 0);
+      opRM(as, X_STORE, RAX, R12, readShort(code + 1) * (int)sizeof(Value));
+      return true;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL: {
+      int32_t disp = readShort(code + 1) * (int)sizeof(Value);
+      loadGlobals(as, RDX);
+      opRM(as, X_LOAD, RAX, RDX, disp);
+      movRI(as, RCX, UNDEFINED_VAL);
+      opRR(as, X_CMP, RCX, RAX);
+      exitIf(as, CC_E, offset, 0); // Undefined variable
+      if (op == OP_GET_GLOBAL) {
+        emitPush(as, RAX);
+      } else {
+        opRM(as, X_LOAD, RAX, RBX, -8);
+        opRM(as, X_STORE, RAX, RDX, disp);
+      }
+      return true;
+    }
+    case OP_DEFINE_GLOBAL:
+      emitDrop(as, 1);
+      opRM(as, X_LOAD, RAX, RBX, 0);
+      loadGlobals(as, RDX);
+      opRM(as, X_STORE, RAX, RDX, readShort(code + 1) * (int)sizeof(Value));
+      return true;
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+      movRR(as, RDI, RBX);
+      callHelper(as, op == OP_GET_INDEX ? (void*)jitGetIndex : (void*)jitSetIndex);
+      testAl(as);
+      exitIf(as, CC_E, offset, 0);
+      emitDrop(as, op == OP_GET_INDEX ? 1 : 2);
+      return true;
+    case OP_EQUAL:
+    case OP_NEQUAL:
+    case OP_GREATER:
+    case OP_GEQUAL:
+    case OP_LESS:
+    case OP_LEQUAL:
+      emitCompare(as, op);
+      return true;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_BIN_AND:
+    case OP_BIN_OR:
+      emitArithmetic(as, op, offset, 0);
+      return true;
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BIN_SHIFTL:
+    case OP_BIN_SHIFTR:
+    case OP_BIN_XOR:
+      emitArithmeticCall(as, op, offset, 0);
+      return true;
+    case OP_INC:
+    case OP_DEC:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_BIN_NOT:
+      emitUnary(as, op, RBX, -8, offset);
+      return true;
+    case OP_INC_LOCAL:
+    case OP_DEC_LOCAL:
+      emitUnary(as, op == OP_INC_LOCAL ? OP_INC : OP_DEC,
+                R12, readShort(code + 1) * (int)sizeof(Value), offset);
+      return true;
+    case OP_PRINT:
+      emitDrop(as, 1);
+      opRM(as, X_LOAD, RDI, RBX, 0);
+      callHelper(as, jitPrint);
+      return true;
+    case OP_JUMP:
+      jumpTo(as, CC_JMP, next + readShort(code + 1));
+      return true;
+    case OP_PJMP_IF_FALSE:
+      emitDrop(as, 1);
+      opRM(as, X_LOAD, RAX, RBX, 0);
+      emitJumpIfFalse(as, next + readShort(code + 1));
+      return true;
+    case OP_QJMP_IF_FALSE:
+      opRM(as, X_LOAD, RAX, RBX, -8);
+      emitJumpIfFalse(as, next + readShort(code + 1));
+      return true;
+    case OP_LOOP: {
+      // The same tick as TICK in run(), the interpreter takes over when
+      // the timeslice is used up or the VM is interrupted
+      int target = next - readShort(code + 1);
+      emitByte(as, 0x41); // dec dword [r13 + fuel]
+      emitByte(as, 0xff);
+      emitByte(as, 0x8d);
+      emit32(as, (uint32_t)offsetof(VM, fuel));
+      jumpTo(as, CC_G, target);
+      movRR(as, RDI, R13);
+      callHelper(as, jitTick);
+      testAl(as);
+      jumpTo(as, CC_E, target);
+      exitAt(as, target, true);
+      return true;
+    }
+    case OP_SWITCH_TABLE:
+      movRI(as, RDI, (uint64_t)(uintptr_t)&chunk->switches[readShort(code + 1)]);
+      opRM(as, X_LOAD, RSI, RBX, -8);
+      callHelper(as, findSwitchTarget);
+      emitByte(as, 0x48); // movsxd rax, eax
+      emitByte(as, 0x63);
+      emitByte(as, 0xc0);
+      movRI(as, RCX, 0); // Patched with the address of targets
+      addPatch(as, &as->jumps, &as->jumpCount, &as->jumpCapacity, -1, 0);
+      as->jumps[as->jumpCount - 1].at -= 4;
+      emitByte(as, 0x48); // mov rdx, [rcx + rax * 8]
+      emitByte(as, 0x8b);
+      emitByte(as, 0x14);
+      emitByte(as, 0xc1);
+      opRR(as, X_TEST, RDX, RDX);
+      jumpBack(as, CC_E, as->switchExit);
+      emitByte(as, 0xff); // jmp rdx
+      emitByte(as, 0xe2);
+      return true;
+
+    // Superinstructions
+    case OP_ADD_LOCALS:
+      loadLocal(as, RAX, readShort(code + 1));
+      emitPush(as, RAX);
+      loadLocal(as, RAX, readShort(code + 3));
+      emitPush(as, RAX);
+      emitArithmetic(as, OP_ADD, offset, 2);
+      return true;
+    case OP_ADD_LOCAL_CONST:
+    case OP_SUB_LOCAL_CONST:
+      loadLocal(as, RAX, readShort(code + 1));
+      emitPush(as, RAX);
+      movRI(as, RAX, constants[readShort(code + 3)]);
+      emitPush(as, RAX);
+      emitArithmetic(as, op == OP_ADD_LOCAL_CONST ? OP_ADD : OP_SUBTRACT, offset, 2);
+      return true;
+    case OP_LESS_LOCAL_CONST_JMP:
+      loadLocal(as, RAX, readShort(code + 1));
+      emitPush(as, RAX);
+      movRI(as, RAX, constants[readShort(code + 3)]);
+      emitPush(as, RAX);
+      emitCompare(as, OP_LESS);
+      emitDrop(as, 1);
+      opRM(as, X_LOAD, RAX, RBX, 0);
+      emitJumpIfFalse(as, next + readShort(code + 5));
+      return true;
+
+
+    // Register instructions
+    case OP_MOVE:
+      loadLocal(as, RAX, readShort(code + 1));
+      opRM(as, X_STORE, RAX, R12, readShort(code + 3) * (int)sizeof(Value));
+      return true;
+    case OP_LOAD_CONST:
+      movRI(as, RAX, constants[readShort(code + 1)]);
+      opRM(as, X_STORE, RAX, R12, readShort(code + 3) * (int)sizeof(Value));
+      return true;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK: {
+      // The stack templates on pushed operands, then the result is popped
+      bool constant = op == OP_ADD_RK || op == OP_SUB_RK || op == OP_MUL_RK;
+      int arithmetic = op == OP_ADD_RR || op == OP_ADD_RK ? OP_ADD :
+                       op == OP_SUB_RR || op == OP_SUB_RK ? OP_SUBTRACT : OP_MULTIPLY;
+      loadLocal(as, RAX, readShort(code + 1));
+      emitPush(as, RAX);
+      if (constant) {
+        movRI(as, RAX, constants[readShort(code + 3)]);
+      } else {
+        loadLocal(as, RAX, readShort(code + 3));
+      }
+      emitPush(as, RAX);
+      if (arithmetic == OP_MULTIPLY) {
+        emitArithmeticCall(as, arithmetic, offset, 2);
+      } else {
+        emitArithmetic(as, arithmetic, offset, 2);
+      }
+      emitDrop(as, 1);
+      opRM(as, X_LOAD, RAX, RBX, 0);
+      opRM(as, X_STORE, RAX, R12, readShort(code + 5) * (int)sizeof(Value));
+      return true;
+    }
+
+    default:
+      exitAt(as, offset, false);
+      return false;
+  }
+}
+
+
+bool compileJit(VM* vm, ObjFunction* function) {
+  (unused)vm;
+  Chunk* chunk = &function->chunk;
+  Assembler as = { 0 };
+  JitCode* jit = malloc(sizeof(JitCode));
+  as.native = malloc(sizeof(int) * (chunk->count + 1));
+  bool* entry = calloc(chunk->count + 1, sizeof(bool));
+  if (jit == NULL || as.native == NULL || entry == NULL) goto failed;
+  jit->targets = NULL;
+
+  // Entry stub
+  emitByte(&as, 0x53);                     // push rbx
+  emitByte(&as, 0x41); emitByte(&as, 0x54); // push r12
+  emitByte(&as, 0x41); emitByte(&as, 0x55); // push r13
+  emitByte(&as, 0x41); emitByte(&as, 0x56); // push r14
+  opRI(&as, 5, RSP, 8);                    // Keep rsp 16-byte aligned for calls
+  movRR(&as, R13, RDI);
+  movRR(&as, R12, RSI);
+  movRR(&as, RBX, RDX);
+  movRI(&as, R14, QNAN | TAG_INT);
+  emitByte(&as, 0xff); emitByte(&as, 0xe1); // jmp rcx
+
+  // Common exit, the result is already in eax
+  as.exitLabel = as.count;
+  opRM(&as, X_STORE, RBX, R13, (int32_t)offsetof(VM, stackTop));
+  opRI(&as, 0, RSP, 8);
+  emitByte(&as, 0x41); emitByte(&as, 0x5e); // pop r14
+  emitByte(&as, 0x41); emitByte(&as, 0x5d); // pop r13
+  emitByte(&as, 0x41); emitByte(&as, 0x5c); // pop r12
+  emitByte(&as, 0x5b);                     // pop rbx
+  emitByte(&as, 0xc3);                     // ret
+
+  // OP_SWITCH_TABLE to an instruction without native code, offset in eax
+  as.switchExit = as.count;
+  emitByte(&as, 0xd1); emitByte(&as, 0xe0); // shl eax, 1
+  jumpBack(&as, CC_JMP, as.exitLabel);
+
+  for (int offset = 0; offset <= chunk->count; offset++) as.native[offset] = -1;
+  for (int offset = 0; offset < chunk->count && !as.failed;) {
+    int next = offset + getInstructionLength(chunk, offset);
+    as.native[offset] = as.count;
+    entry[offset] = emitInstruction(&as, chunk, offset, next);
+    offset = next;
+  }
+
+  // Side exit stubs
+  for (int i = 0; i < as.exitCount && !as.failed; i++) {
+    Patch* exit = &as.exits[i];
+    patch32(&as, exit->at, as.count - (exit->at + 4));
+    emitDrop(&as, exit->pop);
+    exitAt(&as, exit->offset, false);
+  }
+  if (as.failed) goto failed;
+
+  jit->size = as.count;
+  jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) goto failed;
+  jit->targets = calloc(chunk->count + 1, sizeof(void*));
+  if (jit->targets == NULL) {
+    munmap(jit->code, jit->size);
+    goto failed;
+  }
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (entry[offset]) jit->targets[offset] = jit->code + as.native[offset];
+  }
+
+  for (int i = 0; i < as.jumpCount; i++) {
+    Patch* jump = &as.jumps[i];
+    if (jump->offset == -1) {
+      uint64_t targets = (uint64_t)(uintptr_t)jit->targets;
+      memcpy(as.code + jump->at, &targets, sizeof(targets));
+    } else {
+      patch32(&as, jump->at, as.native[jump->offset] - (jump->at + 4));
+    }
+  }
+  memcpy(jit->code, as.code, as.count);
+  if (mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(jit->code, jit->size);
+    free(jit->targets);
+    goto failed;
+  }
+
+  function->jit = jit;
+  free(as.code);
+  free(as.jumps);
+  free(as.exits);
+  free(as.native);
+  free(entry);
+  return true;
+
+failed:
+  function->hotness = INT32_MIN; // Don't try again
+  free(jit);
+  free(as.code);
+  free(as.jumps);
+  free(as.exits);
+  free(as.native);
+  free(entry);
+  return false;
+}
+
+
+JitResult runJit(VM* vm, CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  void* start = function->jit->targets[frame->ip - function->chunk.code];
+  if (start == NULL) return JIT_RESUME;
+
+  JitEntry entry = (JitEntry)(uintptr_t)function->jit->code;
+  int result = entry(vm, frame->slots, vm->stackTop, start);
+  frame->ip = function->chunk.code + (result >> 1);
+  return (result & 1) ? JIT_YIELD : JIT_RESUME;
+}
+
+
+void freeJit(JitCode* jit) {
+  if (jit == NULL) return;
+  munmap(jit->code, jit->size);
+  free(jit->targets);
+  free(jit);
+}
+
+#else
+
+bool compileJit(VM* vm, ObjFunction* function) {
+  (unused)vm;
+  (unused)function;
+  return false;
+}
+
+JitResult runJit(VM* vm, CallFrame* frame) {
+  (unused)vm;
+  (unused)frame;
+  return JIT_RESUME;
+}
+
+void freeJit(JitCode* jit) {
+  (unused)jit;
+}
+
+#endif // JIT
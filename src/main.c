@@ -1,13 +1,23 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __unix__
+#include <dlfcn.h>
+#endif
 
 #include "version.h"
+#include "aot.h"
+#include "bytecode.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "error.h"
 #include "file.h"
+#include "program.h"
+#include "scheduler.h"
+#include "timer.h"
 #include "vm.h"
 
 
@@ -18,6 +28,14 @@
 
 char* code = NULL;
 char* temp = NULL;
+static VM* replVM = NULL;
+
+// Ctrl-C stops the code the repl runs, not the repl
+static void interruptRepl(int signal) {
+  (unused)signal;
+  vm_interrupt(replVM, SIGINT);
+}
+
 static void repl(VM* vm) {
   char line[1024]; // Note: Line too long == CRASH
 
@@ -34,10 +52,19 @@ static void repl(VM* vm) {
       // Empty line from STDIN
       if (code == NULL) continue;
       InterpretResult result = interpret(vm, code, "");
-      while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) {
+      replVM = vm;
+      signal(SIGINT, interruptRepl);
+      while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING ||
+             result == INTERPRET_SLEEPING) {
+        if (result == INTERPRET_SLEEPING) waitUntil(get_wake_time(vm));
         //printf("== timeslice begin\n");
         result = run(vm);
       }
+      signal(SIGINT, SIG_DFL);
+      if (result == INTERPRET_INTERRUPTED) {
+        printf("Interrupted.\n");
+        vm_abort(vm);
+      }
       //printf("main:repl() free(%p) // code\n", (void*) code);
       free(code);
       code = NULL;
@@ -72,9 +99,22 @@ static void runFile(VM* vm, const char* path) {
   InterpretResult result;
   char* source;
   int bytes = readFile(path, &source);
-  if (bytes > 0) {
+  if (bytes > 0 && isBytecode(source, (size_t)bytes)) {
+    result = interpretBytecode(vm, source, (size_t)bytes);
+    if (result == INTERPRET_COMPILE_ERROR) {
+      fprintf(stderr, "%s was not compiled by this version of func.\n", path);
+    }
+    while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING ||
+           result == INTERPRET_SLEEPING) {
+      if (result == INTERPRET_SLEEPING) waitUntil(get_wake_time(vm));
+      result = run(vm);
+    }
+    free(source);
+  } else if (bytes > 0) {
     result = interpret(vm, source, path);
-    while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) {
+    while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING ||
+           result == INTERPRET_SLEEPING) {
+      if (result == INTERPRET_SLEEPING) waitUntil(get_wake_time(vm));
       result = run(vm);
     }
     free(source);
@@ -86,6 +126,113 @@ static void runFile(VM* vm, const char* path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void sharedDone(VM* vm, InterpretResult result, void* data) {
+  (unused)vm;
+  *(InterpretResult*)data = result;
+}
+
+// Run a script in count VMs at once, on threads threads (see scheduler.c).
+// The script is compiled once, in vm, and the other VMs share its code.
+static void runShared(VM* vm, const char* path, int count, int threads) {
+  char* source;
+  if (readFile(path, &source) <= 0) exit(74);
+  Program* program = compileProgram(vm, source, path);
+  free(source);
+  if (program == NULL) exit(65);
+
+  VM** vms = malloc(sizeof(VM*) * (size_t)count);
+  InterpretResult* results = malloc(sizeof(InterpretResult) * (size_t)count);
+  if (vms == NULL || results == NULL) exit(74);
+  for (int i = 0; i < count; i++) {
+    vms[i] = i == 0 ? vm : initVM();
+    if (i > 0) {
+      set_jit(vms[i], vm->jitThreshold);
+      if (vm->aotModule != NULL) set_aot_module(vms[i], vm->aotModule);
+    }
+    results[i] = interpretProgram(vms[i], program);
+  }
+  releaseProgram(program); // The functions keep it
+
+  Scheduler* scheduler = newScheduler(threads, sharedDone);
+  if (scheduler == NULL) exit(71);
+  for (int i = 0; i < count; i++) {
+    if (results[i] == INTERPRET_COMPILED && !schedule(scheduler, vms[i], &results[i])) exit(74);
+  }
+  freeScheduler(scheduler);
+
+  int status = 0;
+  for (int i = 0; i < count; i++) {
+    if (results[i] == INTERPRET_COMPILE_ERROR && status == 0) status = 65;
+    if (results[i] == INTERPRET_RUNTIME_ERROR) status = 70;
+    if (i > 0) freeVM(vms[i]);
+  }
+  free(vms);
+  free(results);
+  if (status != 0) exit(status);
+}
+
+// Compile a script to bytecode in output, or in the script's path with
+// .fbc in place of .fun
+static void compileFile(VM* vm, const char* path, const char* output) {
+  char* source;
+  if (readFile(path, &source) <= 0) exit(74);
+  ObjFunction* function = compile(vm, addFilename(vm, path), source, vm->optimize);
+  uint64_t hash = hashSource(path, source);
+  free(source);
+  if (function == NULL) exit(65);
+
+  char* name = NULL;
+  if (output == NULL) {
+    size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".fun") == 0) length -= 4;
+    name = malloc(length + 5);
+    if (name == NULL) exit(74);
+    memcpy(name, path, length);
+    strcpy(name + length, ".fbc");
+    output = name;
+  }
+  FILE* file = fopen(output, "wb");
+  bool written = file != NULL && writeBytecode(vm, function, hash, file);
+  if (file != NULL && fclose(file) != 0) written = false;
+  if (!written) {
+    fprintf(stderr, "Could not write '%s'.\n", output);
+    exit(74);
+  }
+  free(name);
+}
+
+// Write the C of a script to stdout, see aot.c
+static void emitFile(VM* vm, const char* path) {
+  char* source;
+  if (readFile(path, &source) <= 0) exit(74);
+  ObjFunction* function = compile(vm, addFilename(vm, path), source, vm->optimize);
+  free(source);
+  if (function == NULL) exit(65);
+  if (!emitC(vm, function, path, stdout)) exit(74);
+}
+
+// Run the functions compiled to C in a shared object built from the
+// output of --emit-c
+static bool loadModule(VM* vm, const char* path) {
+#ifdef __unix__
+  void* library = dlopen(path, RTLD_NOW);
+  if (library == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return false;
+  }
+  const AotModule* module = dlsym(library, "func_aot_module");
+  if (module == NULL || !set_aot_module(vm, module)) {
+    fprintf(stderr, "%s is not a module for this version of func.\n", path);
+    return false;
+  }
+  return true;
+#else
+  (unused)vm;
+  fprintf(stderr, "Can't load %s, --aot is only supported on unix.\n", path);
+  return false;
+#endif
+}
+
 void print_version() {
   printf("FunC v%ld.%ld.%ld.%ld %s",MAJOR,MINOR,BUILD,REVISION,STATUS); //C example
 }
@@ -95,16 +242,53 @@ void print_version() {
 int main(int argc, const char* argv[]) {
   VM* vm = initVM();
 
-  if (argc == 1) {
+  // Options before the path
+  int arg = 1;
+  bool emit = false;
+  bool compileOnly = false;
+  int vmCount = 1;
+  int threadCount = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strcmp(argv[arg], "--emit-c") == 0) {
+      emit = true;
+    } else if (strcmp(argv[arg], "--compile") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc) {
+      set_bytecode_cache(vm, argv[++arg]);
+    } else if (strcmp(argv[arg], "--aot") == 0 && arg + 1 < argc) {
+      if (!loadModule(vm, argv[++arg])) exit(74);
+    } else if (strcmp(argv[arg], "--vms") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+      vmCount = atoi(argv[++arg]);
+    } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+      threadCount = atoi(argv[++arg]);
+    } else if (strcmp(argv[arg], "--jit") == 0) {
+      set_jit(vm, DEFAULT_JIT_THRESHOLD);
+    } else if (strcmp(argv[arg], "--jit=force") == 0) {
+      set_jit(vm, 1); // Compile everything on its first tick
+    } else {
+      argc = -1; // Unknown option
+      break;
+    }
+  }
+
+  if (emit && argc == arg + 1) {
+    emitFile(vm, argv[arg]);
+  } else if (compileOnly && (argc == arg + 1 || argc == arg + 2)) {
+    compileFile(vm, argv[arg], argc == arg + 2 ? argv[arg + 1] : NULL);
+  } else if (argc == arg && !emit && !compileOnly) {
     print_version();
     printf(" (interactive mode)\n");
     repl(vm);
-  } else if (argc == 2) {
-    runFile(vm, argv[1]);
+  } else if (argc == arg + 1 && !emit && !compileOnly && (vmCount > 1 || threadCount > 1)) {
+    runShared(vm, argv[arg], vmCount, threadCount);
+  } else if (argc == arg + 1 && !emit && !compileOnly) {
+    runFile(vm, argv[arg]);
   } else {
     print_version();
     printf("\n");
-    fprintf(stderr, "Usage: func [path]\n");
+    fprintf(stderr, "Usage: func [--jit[=force]] [--aot module] [--cache directory] [--vms count [--threads count]] [path]\n"
+                    "       func --compile path [output.fbc]\n"
+                    "       func --emit-c path\n");
     exit(64);
   }
 
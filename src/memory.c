@@ -4,8 +4,11 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "program.h"
+#include "shape.h"
 #include "vm.h"
 
 #if defined(DEBUG_LOG_GC) || defined(DEBUG_LOG_GC_VERBOSE) || defined(DEBUG_TRACE_MEMORY)
@@ -171,6 +174,7 @@ static void blackenObject(void* vm, Obj* object) {
       ObjClass* klass = (ObjClass*)object;
       markObject(vm, (Obj*)klass->name);
       markTable(vm, &klass->methods);
+      markShape(vm, klass->shape);
       break;
     }
     case OBJ_CLOSURE: {
@@ -185,13 +189,32 @@ static void blackenObject(void* vm, Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject(vm, (Obj*)function->name);
       markArray(vm, &function->chunk.constants); // Internal value.h:ValueArray
+      if (function->caches != NULL) {
+        for (int i = 0; i < function->cacheCount; i++) {
+          InlineCache* cache = &function->caches[i];
+          if (cache->shape != NULL) markObject(vm, (Obj*)cache->shape->klass);
+          for (int j = 0; j < cache->count; j++) {
+            markObject(vm, (Obj*)cache->entries[j].klass);
+            markObject(vm, (Obj*)cache->entries[j].method);
+          }
+        }
+      }
+      for (int i = 0; i < function->chunk.switchCount; i++) {
+        SwitchTable* table = &function->chunk.switches[i];
+        for (int j = 0; j < table->capacity; j++) markValue(vm, table->cases[j].key);
+      }
 
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject(vm, (Obj*)instance->klass);
-      markTable(vm, &instance->fields);
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->slotCount; i++) {
+          markValue(vm, instance->fields[i]);
+        }
+      }
+      if (instance->dictionary != NULL) markTable(vm, instance->dictionary);
       break;
     }
     case OBJ_UPVALUE:
@@ -232,6 +255,7 @@ static void freeObject(void* vm, Obj* object) {
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       freeTable(vm, &klass->methods);
+      freeShape(vm, klass->shape);
       FREE(vm, ObjClass, object);
       break;
     }
@@ -243,14 +267,21 @@ static void freeObject(void* vm, Obj* object) {
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      freeChunk(vm, &function->chunk);
+      if (function->program != NULL) {
+        freeSharedChunk(vm, &function->chunk);
+        releaseProgram(function->program);
+      } else {
+        freeChunk(vm, &function->chunk);
+      }
+      FREE_ARRAY(vm, InlineCache, function->caches, function->cacheCount);
+      freeJit(function->jit);
       FREE(vm, ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      freeTable(vm, &instance->fields);
-      FREE(vm, ObjInstance, object);
+      freeFields(vm, instance);
+      reallocate(vm, object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
       break;
     }
     case OBJ_NATIVE: {
@@ -314,7 +345,8 @@ static void markRoots(VM* vm) {
 #ifdef DEBUG_LOG_GC_EXTREME
   printf("memory:markRoots(vm=%p) scan globals\n", vm);
 #endif
-  markTable(vm, &vm->globals);
+  markTable(vm, &vm->globalSlots); // Also keeps globalNames alive
+  markArray(vm, &vm->globals);
 
   // Scan filename array -- Experimental include support
 #ifdef DEBUG_LOG_GC_EXTREME
@@ -331,6 +363,9 @@ static void markRoots(VM* vm) {
   printf("memory:markRoots(vm=%p) include the initString\n", vm);
 #endif
   markObject(vm, (Obj*)vm->initString);
+  markTable(vm, &vm->arrayMethods);
+  markTable(vm, &vm->stringMethods);
+  markTable(vm, &vm->numberMethods);
 }
 
 static void traceReferences(void* vm) {
@@ -389,22 +389,11 @@ static bool array_mul4(void* vm, Value receiver, int argCount, Value* args, Valu
 
 
 #define METHOD(fn_name, fn_call) \
-  if (strcmp(name->chars, fn_name)==0) { \
-    *property = OBJ_VAL(newNativeMethod(vm, receiver, name, fn_call)); \
-    return true; \
-  }
+  defineNativeMethod(vm, methods, fn_name, fn_call)
 
 
-// Hard-coded properties of ObjArray type
-// TODO: Replace the multiple calls to strncpy() with something more efficient
-bool getArrayProperty(void* vm, Value receiver, ObjString* name, Value* property) {
-  ObjArray* array = AS_ARRAY(receiver);
-
-  if (strcmp(name->chars, "length")==0) {
-    *property = NUMBER_VAL(array->length);
-    return true;
-  }
-
+// Fill the table of built-in Array methods, called once by initVM()
+void defineArrayMethods(void* vm, Table* methods) {
   METHOD("shift",   array_shift);
   METHOD("unshift", array_unshift);
   METHOD("pop",     array_pop);
@@ -417,6 +406,25 @@ bool getArrayProperty(void* vm, Value receiver, ObjString* name, Value* property
   METHOD("mul2",    array_mul2);
   METHOD("mul3",    array_mul3);
   METHOD("mul4",    array_mul4);
+}
+
+
+// Hard-coded properties of ObjArray type
+// TODO: Replace the multiple calls to strncpy() with something more efficient
+bool getArrayProperty(void* vm, Value receiver, ObjString* name, Value* property) {
+  ObjArray* array = AS_ARRAY(receiver);
+
+  if (strcmp(name->chars, "length")==0) {
+    *property = INT_VAL(array->length);
+    return true;
+  }
+
+  Value method;
+  if (tableGet(vm, &((VM*)vm)->arrayMethods, name, &method)) {
+    // Only needed when the method is used as a value, OP_INVOKE calls it directly
+    *property = OBJ_VAL(newNativeMethod(vm, receiver, name, AS_NATIVE_METHOD(method)->function));
+    return true;
+  }
 
   runtimeError(vm, "Array has no '%s'.", name->chars);
   return false;
@@ -3,6 +3,7 @@
 
 #include "memory.h"
 #include "object.h"
+#include "shape.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -64,6 +65,10 @@ ObjClass* newClass(void* vm, ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods);
+  klass->version = 0;
+  klass->fieldShadowsMethod = false;
+  klass->shape = NULL; // Created along with the first instance
+  klass->instanceSlots = 0;
   return klass;
 }
 
@@ -93,7 +98,14 @@ ObjFunction* newFunction(void* vm) {
 
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->cacheCount = 0;
+  function->caches = NULL;
+  function->jit = NULL;
+  function->aot = NULL;
+  function->program = NULL;
+  function->hotness = 0;
 #ifdef DEBUG_TRACE_OBJECTS
   printf("object:newFunction() initializing chunk %p\n", &function->chunk);
 #endif
@@ -104,14 +116,38 @@ ObjFunction* newFunction(void* vm) {
   return function;
 }
 
+// Allocate the empty inline caches of the function->cacheCount property
+// access sites in its chunk
+void newInlineCaches(void* vm, ObjFunction* function) {
+  if (function->cacheCount == 0) return;
+  InlineCache* caches = ALLOCATE(vm, InlineCache, function->cacheCount);
+  for (int i = 0; i < function->cacheCount; i++) {
+    caches[i].shape = NULL;
+    caches[i].transition = NULL;
+    caches[i].slot = -1;
+    caches[i].count = 0;
+  }
+  function->caches = caches;
+}
+
 
 ObjInstance* newInstance(void* vm, ObjClass* klass) {
 #ifdef DEBUG_TRACE_OBJECTS
   printf("object:newInstance()\n");
 #endif
-  ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+  if (klass->shape == NULL) klass->shape = newShape(vm, klass, NULL, NULL);
+
+  // Room for as many fields inline as the largest instance so far had
+  int slots = klass->instanceSlots;
+  ObjInstance* instance = (ObjInstance*)allocateObject(vm,
+      sizeof(ObjInstance) + sizeof(Value) * slots, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->shape;
+  instance->fields = instance->inlineFields;
+  instance->capacity = slots;
+  instance->inlineCapacity = slots;
+  instance->dictionary = NULL;
+  for (int i = 0; i < slots; i++) instance->inlineFields[i] = NULL_VAL;
   return instance;
 }
 
@@ -123,6 +159,9 @@ ObjNative* newNative(void* vm, ObjString* name, NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->name = name;
   native->function = function;
+  native->arity = -1;
+  native->returns = 'a';
+  native->isUnboxed = false;
   return native;
 }
 
@@ -149,10 +149,18 @@ static bool number_hypot(void* vm, Value receiver, int argCount, Value* args, Va
   } \
 
 #define METHOD(fn_name, fn_call) \
-  if (strcmp(name->chars, fn_name)==0) { \
-    *property = OBJ_VAL(newNativeMethod(vm, receiver, name, fn_call)); \
-    return true; \
-  }
+  defineNativeMethod(vm, methods, fn_name, fn_call)
+
+
+// Fill the table of built-in Number methods, called once by initVM()
+void defineNumberMethods(void* vm, Table* methods) {
+  // These methods all call a C function defined above, take 1 argument and return a number
+  METHOD("base",  number_base);
+  METHOD("atan2", number_atan2);
+  METHOD("pow",   number_pow);
+  METHOD("fmod",  number_fmod);
+  METHOD("hypot", number_hypot);
+}
 
 
 bool getNumberProperty(void* vm, Value receiver, ObjString* name, Value* property) {
@@ -182,12 +190,12 @@ bool getNumberProperty(void* vm, Value receiver, ObjString* name, Value* propert
   PROPERTY("cbrt",  cbrt);
   PROPERTY("abs",   absolute);
 
-  // These methods all call a C function defined above, take 1 argument and return a number
-  METHOD("base",  number_base);
-  METHOD("atan2", number_atan2);
-  METHOD("pow",   number_pow);
-  METHOD("fmod",  number_fmod);
-  METHOD("hypot", number_hypot);
+  Value method;
+  if (tableGet(vm, &((VM*)vm)->numberMethods, name, &method)) {
+    // Only needed when the method is used as a value, OP_INVOKE calls it directly
+    *property = OBJ_VAL(newNativeMethod(vm, receiver, name, AS_NATIVE_METHOD(method)->function));
+    return true;
+  }
 
   runtimeError(vm, "Number has no '%s'.", name->chars);
   return false;
@@ -311,10 +311,20 @@ static bool string_rtrim(void* vm, Value receiver, int argCount, Value* args, Va
 
 
 #define METHOD(fn_name, fn_call) \
-  if (strcmp(name->chars, fn_name)==0) { \
-    *property = OBJ_VAL(newNativeMethod(vm, receiver, name, fn_call)); \
-    return true; \
-  }
+  defineNativeMethod(vm, methods, fn_name, fn_call)
+
+
+// Fill the table of built-in String methods, called once by initVM()
+void defineStringMethods(void* vm, Table* methods) {
+  METHOD("value",    string_value);
+  METHOD("byte_at",  string_byte_at);
+  METHOD("bytes_at", string_bytes_at);
+  METHOD("char_at",  string_char_at);
+  METHOD("substr",   string_substr);
+  METHOD("split",    string_split);
+  METHOD("ltrim",    string_ltrim);
+  METHOD("rtrim",    string_rtrim);
+}
 
 
 bool getStringProperty(void* vm, Value receiver, ObjString* name, Value* property) {
@@ -323,7 +333,7 @@ bool getStringProperty(void* vm, Value receiver, ObjString* name, Value* propert
   // Properties
   if (strcmp(name->chars, "bytes")==0) {
     // Return the string length in number of bytes (storage size)
-    *property = NUMBER_VAL(string->length);
+    *property = INT_VAL(string->length);
     return true;
   }
   if (strcmp(name->chars, "chars")==0) {
@@ -332,7 +342,7 @@ bool getStringProperty(void* vm, Value receiver, ObjString* name, Value* propert
     for (int i=0; i<string->length; i++) {
       if (isutf(string->chars[i])) count++;
     }
-    *property = NUMBER_VAL(count);
+    *property = INT_VAL(count);
     return true;
   }
   if (strcmp(name->chars, "code")==0) {
@@ -343,7 +353,7 @@ bool getStringProperty(void* vm, Value receiver, ObjString* name, Value* propert
     u8_toucs(codepoint, UCS_BUFSIZ, string->chars, string->length);
 #undef UCS_BUFSIZ
     //printf("objstring:stringProperty() result=%d\n", codepoint[0]);
-    *property = NUMBER_VAL((double) codepoint[0]);
+    *property = INT_VAL(codepoint[0]);
     return true;
   }
   if (strcmp(name->chars, "num")==0) {
@@ -351,14 +361,12 @@ bool getStringProperty(void* vm, Value receiver, ObjString* name, Value* propert
     return true;
   }
 
-  METHOD("value",    string_value);
-  METHOD("byte_at",  string_byte_at);
-  METHOD("bytes_at", string_bytes_at);
-  METHOD("char_at",  string_char_at);
-  METHOD("substr",   string_substr);
-  METHOD("split",    string_split);
-  METHOD("ltrim",    string_ltrim);
-  METHOD("rtrim",    string_rtrim);
+  Value method;
+  if (tableGet(vm, &((VM*)vm)->stringMethods, name, &method)) {
+    // Only needed when the method is used as a value, OP_INVOKE calls it directly
+    *property = OBJ_VAL(newNativeMethod(vm, receiver, name, AS_NATIVE_METHOD(method)->function));
+    return true;
+  }
 
   runtimeError(vm, "String has no '%s'.", name->chars);
   return false;
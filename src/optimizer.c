@@ -0,0 +1,481 @@
+#include "chunk.h"
+#include "memory.h"
+#include "optimizer.h"
+
+// Bytecode optimizer
+//
+// Runs once over each finished chunk, how much it does depends on the
+// optimization level passed to compile() (see optimizer.h).
+//
+// OPTIMIZE_PEEPHOLE fuses frequent opcode sequences
+// into superinstructions, saving the dispatch and stack traffic between
+// them. The set of patterns is driven by func-opstats (tools/opstats.c).
+// A sequence is only fused if none of its instructions but the first is
+// a jump target. Jump offsets are re-encoded afterwards since the code
+// shrinks, and every byte of a fused instruction gets the debug info of
+// the instruction that can raise a runtime error.
+
+#define MAX_PATTERN 5
+
+typedef struct {
+  uint8_t ops[MAX_PATTERN]; // Opcode sequence to look for
+  int length;               // Number of opcodes in the sequence
+  uint8_t fused;            // Superinstruction to replace it with
+  bool sameSlot;            // ops[0] and ops[2] must have the same operand
+  int debugFrom;            // Take debug info from this instruction
+} Pattern;
+
+// Longer patterns first, the first match wins.
+// Operands are copied in order, the duplicate slot of sameSlot is dropped.
+static const Pattern patterns[] = {
+#ifdef REGISTER_OPS
+  // a = b + c; etc. with locals, see the register instructions in chunk.h
+  { { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD, OP_SET_LOCAL, OP_POP }, 5, OP_ADD_RR, false, 2 },
+  { { OP_GET_LOCAL, OP_GET_LOCAL, OP_SUBTRACT, OP_SET_LOCAL, OP_POP }, 5, OP_SUB_RR, false, 2 },
+  { { OP_GET_LOCAL, OP_GET_LOCAL, OP_MULTIPLY, OP_SET_LOCAL, OP_POP }, 5, OP_MUL_RR, false, 2 },
+  { { OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP }, 5, OP_ADD_RK, false, 2 },
+  { { OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT, OP_SET_LOCAL, OP_POP }, 5, OP_SUB_RK, false, 2 },
+  { { OP_GET_LOCAL, OP_CONSTANT, OP_MULTIPLY, OP_SET_LOCAL, OP_POP }, 5, OP_MUL_RK, false, 2 },
+  { { OP_GET_LOCAL, OP_SET_LOCAL, OP_POP }, 3, OP_MOVE, false, 0 },
+  { { OP_CONSTANT, OP_SET_LOCAL, OP_POP }, 3, OP_LOAD_CONST, false, 0 },
+#endif
+  // i++;
+  { { OP_GET_LOCAL, OP_INC, OP_SET_LOCAL, OP_DEC, OP_POP }, 5, OP_INC_LOCAL, true, 1 },
+  // i--;
+  { { OP_GET_LOCAL, OP_DEC, OP_SET_LOCAL, OP_INC, OP_POP }, 5, OP_DEC_LOCAL, true, 1 },
+  // for (...; i < n; ...), while (i < n)
+  { { OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_PJMP_IF_FALSE }, 4, OP_LESS_LOCAL_CONST_JMP, false, 2 },
+  { { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD }, 3, OP_ADD_LOCALS, false, 2 },
+  { { OP_GET_LOCAL, OP_CONSTANT, OP_ADD }, 3, OP_ADD_LOCAL_CONST, false, 2 },
+  { { OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT }, 3, OP_SUB_LOCAL_CONST, false, 2 },
+  // a = b;
+  { { OP_SET_LOCAL, OP_POP }, 2, OP_SET_LOCAL_POP, false, 0 },
+};
+
+#define PATTERN_COUNT (int)(sizeof(patterns) / sizeof(patterns[0]))
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+  return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// Switch table of the OP_SWITCH_TABLE at offset, NULL for other instructions
+static SwitchTable* getSwitchTable(Chunk* chunk, int offset) {
+  if (chunk->code[offset] != OP_SWITCH_TABLE) return NULL;
+  return &chunk->switches[readShort(chunk, offset + 1)];
+}
+
+// Mark all targets of a switch table, the miss target included
+static void markSwitchTargets(SwitchTable* table, bool* marks) {
+  for (int i = 0; i < table->capacity; i++) {
+    if (!IS_UNDEFINED(table->cases[i].key)) marks[table->cases[i].target] = true;
+  }
+  marks[table->missTarget] = true;
+}
+
+// Check if pattern matches at offset, fill in the offset of each instruction
+static bool matchPattern(Chunk* chunk, bool* isTarget, int offset,
+    const Pattern* pattern, int* offsets) {
+  for (int i = 0; i < pattern->length; i++) {
+    if (offset >= chunk->count) return false;
+    if (i > 0 && isTarget[offset]) return false;
+    if (chunk->code[offset] != pattern->ops[i]) return false;
+    offsets[i] = offset;
+    offset += getInstructionLength(chunk, offset);
+  }
+  if (pattern->sameSlot &&
+      readShort(chunk, offsets[0] + 1) != readShort(chunk, offsets[2] + 1)) {
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  Chunk* chunk;      // Source chunk
+  uint8_t* code;     // Rewritten code and debug info
+  int* files;
+  int* lines;
+  int* chars;
+  int count;
+  int* jumpAt;       // Start of each rewritten jump instruction
+  int* jumpEnd;      // End of each rewritten jump instruction
+  int* jumpTarget;   // Original target offset of each jump
+  int jumpCount;
+} Rewriter;
+
+static void emit(Rewriter* rw, uint8_t byte, int debugFrom) {
+  rw->code[rw->count] = byte;
+  rw->files[rw->count] = rw->chunk->files[debugFrom];
+  rw->lines[rw->count] = rw->chunk->lines[debugFrom];
+  rw->chars[rw->count] = rw->chunk->chars[debugFrom];
+  rw->count++;
+}
+
+static void addJump(Rewriter* rw, int at, int target) {
+  rw->jumpAt[rw->jumpCount] = at;
+  rw->jumpEnd[rw->jumpCount] = rw->count;
+  rw->jumpTarget[rw->jumpCount] = target;
+  rw->jumpCount++;
+}
+
+static void initRewriter(void* vm, Rewriter* rw, Chunk* chunk) {
+  // The rewritten code is never longer than the original
+  rw->chunk = chunk;
+  rw->code = ALLOCATE(vm, uint8_t, chunk->count);
+  rw->files = ALLOCATE(vm, int, chunk->count);
+  rw->lines = ALLOCATE(vm, int, chunk->count);
+  rw->chars = ALLOCATE(vm, int, chunk->count);
+  rw->count = 0;
+  rw->jumpAt = ALLOCATE(vm, int, chunk->count);
+  rw->jumpEnd = ALLOCATE(vm, int, chunk->count);
+  rw->jumpTarget = ALLOCATE(vm, int, chunk->count);
+  rw->jumpCount = 0;
+}
+
+// Re-encode jump distances and replace the code of the chunk.
+// newOffset maps every original instruction offset to its new offset.
+static void finishRewrite(void* vm, Rewriter* rw, int* newOffset) {
+  Chunk* chunk = rw->chunk;
+
+  // The distance is always stored in the last operand. Unconditional
+  // jumps may have been threaded to a target in the other direction.
+  for (int i = 0; i < rw->jumpCount; i++) {
+    int at = rw->jumpAt[i];
+    int end = rw->jumpEnd[i];
+    int target = newOffset[rw->jumpTarget[i]];
+    if (rw->code[at] == OP_JUMP || rw->code[at] == OP_LOOP) {
+      rw->code[at] = target < end ? OP_LOOP : OP_JUMP;
+    }
+    int jump = rw->code[at] == OP_LOOP ? end - target : target - end;
+    rw->code[end - 2] = (jump >> 8) & 0xff;
+    rw->code[end - 1] = jump & 0xff;
+  }
+  for (int i = 0; i < chunk->switchCount; i++) remapSwitchTable(&chunk->switches[i], newOffset);
+
+  FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, int, chunk->files, chunk->capacity);
+  FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(vm, int, chunk->chars, chunk->capacity);
+  int original = chunk->count;
+  chunk->capacity = original;
+  chunk->count = rw->count;
+  chunk->code = rw->code;
+  chunk->files = rw->files;
+  chunk->lines = rw->lines;
+  chunk->chars = rw->chars;
+
+  FREE_ARRAY(vm, int, rw->jumpAt, original);
+  FREE_ARRAY(vm, int, rw->jumpEnd, original);
+  FREE_ARRAY(vm, int, rw->jumpTarget, original);
+}
+
+static void emitFused(Rewriter* rw, const Pattern* pattern, int* offsets) {
+  Chunk* chunk = rw->chunk;
+  int debugFrom = offsets[pattern->debugFrom];
+  int start = rw->count;
+  int target = -1;
+
+  emit(rw, pattern->fused, debugFrom);
+  for (int i = 0; i < pattern->length; i++) {
+    if (pattern->sameSlot && i == 2) continue;
+    int length = getInstructionLength(chunk, offsets[i]);
+    for (int j = 1; j < length; j++) emit(rw, chunk->code[offsets[i] + j], debugFrom);
+    if (getJumpTarget(chunk, offsets[i]) >= 0) target = getJumpTarget(chunk, offsets[i]);
+  }
+  if (target >= 0) addJump(rw, start, target);
+}
+
+static void peephole(void* vm, Chunk* chunk) {
+  // Find jump targets
+  bool* isTarget = ALLOCATE(vm, bool, chunk->count + 1);
+  int* newOffset = ALLOCATE(vm, int, chunk->count + 1);
+  for (int offset = 0; offset <= chunk->count; offset++) isTarget[offset] = false;
+  for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    int target = getJumpTarget(chunk, offset);
+    if (target >= 0) isTarget[target] = true;
+    SwitchTable* table = getSwitchTable(chunk, offset);
+    if (table != NULL) markSwitchTargets(table, isTarget);
+  }
+
+  Rewriter rw;
+  initRewriter(vm, &rw, chunk);
+
+  int offset = 0;
+  while (offset < chunk->count) {
+    newOffset[offset] = rw.count;
+
+    int offsets[MAX_PATTERN];
+    const Pattern* match = NULL;
+    for (int i = 0; i < PATTERN_COUNT; i++) {
+      if (matchPattern(chunk, isTarget, offset, &patterns[i], offsets)) {
+        match = &patterns[i];
+        break;
+      }
+    }
+
+    if (match != NULL) {
+      emitFused(&rw, match, offsets);
+      int last = offsets[match->length - 1];
+      offset = last + getInstructionLength(chunk, last);
+      continue;
+    }
+
+    // Copy the instruction as-is
+    int length = getInstructionLength(chunk, offset);
+    int target = getJumpTarget(chunk, offset);
+    int at = rw.count;
+    for (int i = 0; i < length; i++) emit(&rw, chunk->code[offset + i], offset + i);
+    if (target >= 0) addJump(&rw, at, target);
+    offset += length;
+  }
+  newOffset[chunk->count] = rw.count;
+
+  int original = chunk->count;
+  finishRewrite(vm, &rw, newOffset);
+  FREE_ARRAY(vm, int, newOffset, original + 1);
+  FREE_ARRAY(vm, bool, isTarget, original + 1);
+}
+
+
+// Control flow pass
+//
+// Splits the chunk into basic blocks and
+// - threads jumps to unconditional jumps straight to the final target,
+// - drops blocks that can not be reached from the entry point,
+// - drops jumps to the instruction that follows anyway,
+// - merges runs of OP_POP/OP_POPN into a single OP_POPN.
+// Code only ever shrinks, so a jump that fits in 16 bits before the pass
+// still fits afterwards as long as its target does not move further away.
+
+#define MAX_THREAD_HOPS 8
+
+typedef enum {
+  KEEP,   // Copy the instruction
+  DROP,   // Unreachable, or a jump to the next instruction
+  AS_POP  // OP_PJMP_IF_FALSE to the next instruction, only pops
+} Action;
+
+typedef struct {
+  int start;       // Offset of the first instruction
+  int last;        // Offset of the last instruction
+  int end;         // Offset after the last instruction
+  bool reachable;
+} Block;
+
+static bool isConditionalJump(uint8_t instruction) {
+  return instruction == OP_PJMP_IF_FALSE || instruction == OP_QJMP_IF_FALSE ||
+         instruction == OP_LESS_LOCAL_CONST_JMP;
+}
+
+static bool fallsThrough(uint8_t instruction) {
+  return instruction != OP_JUMP && instruction != OP_LOOP && instruction != OP_SWITCH_TABLE &&
+         instruction != OP_RETURN && instruction != OP_EXIT;
+}
+
+static bool isPop(Chunk* chunk, int offset, Action action) {
+  uint8_t instruction = chunk->code[offset];
+  return action == AS_POP ||
+        (action == KEEP && (instruction == OP_POP || instruction == OP_POPN));
+}
+
+static int popCount(Chunk* chunk, int offset) {
+  return chunk->code[offset] == OP_POPN ? chunk->code[offset + 1] : 1;
+}
+
+// Follow unconditional jumps from the target of the jump at offset.
+// A value tested by OP_QJMP_IF_FALSE is still on the stack at its target,
+// so another OP_QJMP_IF_FALSE there will jump as well.
+static int threadJump(Chunk* chunk, int offset) {
+  uint8_t instruction = chunk->code[offset];
+  int end = offset + getInstructionLength(chunk, offset);
+  int target = getJumpTarget(chunk, offset);
+
+  for (int hops = 0; hops < MAX_THREAD_HOPS && target < chunk->count; hops++) {
+    uint8_t next = chunk->code[target];
+    bool follow = next == OP_JUMP || next == OP_LOOP ||
+        (instruction == OP_QJMP_IF_FALSE && next == OP_QJMP_IF_FALSE);
+    if (!follow) break;
+
+    int nextTarget = getJumpTarget(chunk, target);
+    // Conditional jumps only go forward, and the distance must fit
+    if (isConditionalJump(instruction) && nextTarget < end) break;
+    if (nextTarget - end > UINT16_MAX || end - nextTarget > UINT16_MAX) break;
+    target = nextTarget;
+  }
+  return target;
+}
+
+static void reachBlock(Block* blocks, int block, int* worklist, int* pending) {
+  if (blocks[block].reachable) return;
+  blocks[block].reachable = true;
+  worklist[(*pending)++] = block;
+}
+
+static void optimizeFlow(void* vm, Chunk* chunk) {
+  int count = chunk->count;
+  int* starts = ALLOCATE(vm, int, count); // Instruction offsets in order
+  int* targets = ALLOCATE(vm, int, count + 1); // Threaded jump target, or -1
+  int* blockAt = ALLOCATE(vm, int, count + 1); // Block starting at offset, or -1
+  int* nextLive = ALLOCATE(vm, int, count + 1); // First instruction kept at or after offset
+  int* newOffset = ALLOCATE(vm, int, count + 1);
+  bool* isTarget = ALLOCATE(vm, bool, count + 1);
+  Action* actions = ALLOCATE(vm, Action, count);
+
+  // Thread jumps and find the block leaders, isTarget is reused for them
+  int instructions = 0;
+  for (int offset = 0; offset <= count; offset++) {
+    targets[offset] = -1;
+    blockAt[offset] = -1;
+    isTarget[offset] = false;
+  }
+  isTarget[0] = true;
+  for (int offset = 0; offset < count; offset += getInstructionLength(chunk, offset)) {
+    starts[instructions++] = offset;
+    int end = offset + getInstructionLength(chunk, offset);
+    SwitchTable* table = getSwitchTable(chunk, offset);
+    if (getJumpTarget(chunk, offset) >= 0) {
+      targets[offset] = threadJump(chunk, offset);
+      isTarget[getJumpTarget(chunk, offset)] = true;
+      isTarget[targets[offset]] = true;
+      isTarget[end] = true;
+    } else if (table != NULL) {
+      markSwitchTargets(table, isTarget);
+      isTarget[end] = true;
+    } else if (!fallsThrough(chunk->code[offset])) {
+      isTarget[end] = true;
+    }
+  }
+
+  // Build the blocks
+  Block* blocks = ALLOCATE(vm, Block, instructions);
+  int blockCount = 0;
+  for (int i = 0; i < instructions; i++) {
+    int offset = starts[i];
+    if (isTarget[offset]) {
+      blockAt[offset] = blockCount;
+      blocks[blockCount].start = offset;
+      blocks[blockCount].reachable = false;
+      blockCount++;
+    }
+    blocks[blockCount - 1].last = offset;
+    blocks[blockCount - 1].end = offset + getInstructionLength(chunk, offset);
+  }
+
+  // Mark the blocks that can be reached from the entry point
+  int* worklist = ALLOCATE(vm, int, blockCount);
+  int pending = 0;
+  reachBlock(blocks, 0, worklist, &pending);
+  while (pending > 0) {
+    Block* block = &blocks[worklist[--pending]];
+    if (targets[block->last] >= 0) {
+      reachBlock(blocks, blockAt[targets[block->last]], worklist, &pending);
+    }
+    if (fallsThrough(chunk->code[block->last]) && block->end < count) {
+      reachBlock(blocks, blockAt[block->end], worklist, &pending);
+    }
+    SwitchTable* table = getSwitchTable(chunk, block->last);
+    if (table != NULL) {
+      for (int i = 0; i < table->capacity; i++) {
+        if (IS_UNDEFINED(table->cases[i].key)) continue;
+        reachBlock(blocks, blockAt[table->cases[i].target], worklist, &pending);
+      }
+      reachBlock(blocks, blockAt[table->missTarget], worklist, &pending);
+    }
+  }
+
+  // Decide what to do with each instruction, back to front so it is
+  // known which instruction comes next once the dropped ones are gone
+  nextLive[count] = count;
+  int block = blockCount - 1;
+  for (int i = instructions - 1; i >= 0; i--) {
+    int offset = starts[i];
+    int end = offset + getInstructionLength(chunk, offset);
+    uint8_t instruction = chunk->code[offset];
+    while (blocks[block].start > offset) block--;
+
+    Action action = KEEP;
+    if (!blocks[block].reachable) {
+      action = DROP;
+    } else if (targets[offset] > offset && nextLive[targets[offset]] == nextLive[end]) {
+      if (instruction == OP_JUMP || instruction == OP_QJMP_IF_FALSE) action = DROP;
+      if (instruction == OP_PJMP_IF_FALSE) action = AS_POP;
+    }
+    actions[i] = action;
+    nextLive[offset] = action == DROP ? nextLive[end] : offset;
+  }
+
+  // Only the targets of the remaining jumps split runs of pops
+  for (int offset = 0; offset <= count; offset++) isTarget[offset] = false;
+  for (int i = 0; i < instructions; i++) {
+    int offset = starts[i];
+    if (actions[i] != KEEP) continue;
+    if (targets[offset] >= 0) isTarget[nextLive[targets[offset]]] = true;
+    SwitchTable* table = getSwitchTable(chunk, offset);
+    if (table != NULL) {
+      for (int j = 0; j < table->capacity; j++) {
+        if (!IS_UNDEFINED(table->cases[j].key)) isTarget[nextLive[table->cases[j].target]] = true;
+      }
+      isTarget[nextLive[table->missTarget]] = true;
+    }
+  }
+
+  Rewriter rw;
+  initRewriter(vm, &rw, chunk);
+
+  for (int i = 0; i < instructions; i++) {
+    int offset = starts[i];
+    newOffset[offset] = rw.count;
+    if (actions[i] == DROP) continue;
+
+    if (isPop(chunk, offset, actions[i])) {
+      int pops = actions[i] == AS_POP ? 1 : popCount(chunk, offset);
+      // Absorb the pops that follow, skipping dropped instructions
+      int last = i;
+      for (int j = i + 1; j < instructions; j++) {
+        int next = starts[j];
+        if (actions[j] == DROP) continue;
+        if (isTarget[next] || !isPop(chunk, next, actions[j])) break;
+        int more = actions[j] == AS_POP ? 1 : popCount(chunk, next);
+        if (pops + more > UINT8_MAX) break;
+        pops += more;
+        last = j;
+      }
+      if (pops == 1) {
+        emit(&rw, OP_POP, offset);
+      } else {
+        emit(&rw, OP_POPN, offset);
+        emit(&rw, (uint8_t)pops, offset);
+      }
+      // Nothing jumps into the absorbed instructions
+      for (int j = i + 1; j <= last; j++) newOffset[starts[j]] = rw.count;
+      i = last;
+      continue;
+    }
+
+    // Copy the instruction, jumps get their threaded target
+    int length = getInstructionLength(chunk, offset);
+    int at = rw.count;
+    for (int k = 0; k < length; k++) emit(&rw, chunk->code[offset + k], offset + k);
+    if (targets[offset] >= 0) addJump(&rw, at, targets[offset]);
+  }
+  newOffset[count] = rw.count;
+
+  finishRewrite(vm, &rw, newOffset);
+
+  FREE_ARRAY(vm, int, worklist, blockCount);
+  FREE_ARRAY(vm, Block, blocks, instructions);
+  FREE_ARRAY(vm, Action, actions, count);
+  FREE_ARRAY(vm, bool, isTarget, count + 1);
+  FREE_ARRAY(vm, int, newOffset, count + 1);
+  FREE_ARRAY(vm, int, nextLive, count + 1);
+  FREE_ARRAY(vm, int, blockAt, count + 1);
+  FREE_ARRAY(vm, int, targets, count + 1);
+  FREE_ARRAY(vm, int, starts, count);
+}
+
+
+void optimizeChunk(void* vm, Chunk* chunk, int level) {
+  if (chunk->count == 0) return;
+  // Fuse first, merging pops would hide the OP_SET_LOCAL, OP_POP pattern
+  if (level >= OPTIMIZE_PEEPHOLE) peephole(vm, chunk);
+  if (level >= OPTIMIZE_FLOW) optimizeFlow(vm, chunk);
+}
@@ -0,0 +1,378 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "file.h"
+#include "memory.h"
+#include "object.h"
+#include "program.h"
+
+// Programs
+//
+// A program is the ObjFunction tree of a compiled script taken out of the
+// VM that compiled it, so any number of VMs in the process can run it
+// without compiling it again. The code and debug info of every chunk are
+// allocated once, outside of any VM heap, and never written after
+// newProgram(): run() doesn't quicken shared code. What a VM has to own
+// is made by instantiateProgram(): the ObjFunctions, their constants
+// (strings are interned in the VM as usual), switch tables and inline
+// caches.
+//
+// The code refers to globals by slot and the debug info to files by
+// number, as resolved in the compiling VM. A VM set up like it, i.e. with
+// the same natives and globals defined and no other script compiled,
+// resolves them to the same slots and numbers and shares the code. Any
+// other VM gets a private copy with slots and numbers remapped, like
+// readBytecode() does.
+//
+// Every ObjFunction sharing the code holds a reference to the program,
+// and so does the caller of newProgram(). The count is atomic because the
+// VMs may run on different threads.
+
+typedef struct {
+  char* chars; // NULL if there is no string
+  int length;
+} ProgramString;
+
+typedef struct ProgramFunction ProgramFunction;
+
+typedef struct {
+  Value value;               // Unless it is a string or a function
+  ProgramString string;
+  ProgramFunction* function;
+} ProgramConstant;
+
+typedef struct {
+  int missTarget;
+  int count;
+  ProgramConstant* keys;
+  int* targets;
+} ProgramSwitch;
+
+struct ProgramFunction {
+  int arity;
+  int upvalueCount;
+  int maxSlots;
+  int cacheCount;
+  ProgramString name;
+  int count;
+  uint8_t* code;   // Generic instructions only
+  int* files;
+  int* lines;
+  int* chars;
+  int constantCount;
+  ProgramConstant* constants;
+  int switchCount;
+  ProgramSwitch* switches;
+};
+
+struct Program {
+  atomic_int refCount;
+  int fileCount;
+  ProgramString* filenames;   // By fileno in the compiling VM
+  int globalCount;
+  ProgramString* globalNames; // By slot in the compiling VM
+  ProgramFunction* script;
+};
+
+typedef struct {
+  VM* vm;
+  Program* program;
+  int* files;   // fileno in vm by fileno in the program
+  int* globals; // Slot in vm by slot in the program
+  bool shared;  // Both are the same in vm, the code can be shared
+} Instance;
+
+
+// Making a program
+
+static bool copyChars(ProgramString* string, const char* chars, int length) {
+  string->chars = malloc((size_t)length + 1);
+  if (string->chars == NULL) return false;
+  memcpy(string->chars, chars, (size_t)length);
+  string->chars[length] = '\0';
+  string->length = length;
+  return true;
+}
+
+static void freeFunction(ProgramFunction* function);
+
+static void freeConstant(ProgramConstant* constant) {
+  free(constant->string.chars);
+  freeFunction(constant->function);
+}
+
+static void freeFunction(ProgramFunction* function) {
+  if (function == NULL) return;
+  free(function->name.chars);
+  free(function->code);
+  free(function->files);
+  free(function->lines);
+  free(function->chars);
+  if (function->constants != NULL) {
+    for (int i = 0; i < function->constantCount; i++) freeConstant(&function->constants[i]);
+  }
+  if (function->switches != NULL) {
+    for (int i = 0; i < function->switchCount; i++) {
+      ProgramSwitch* table = &function->switches[i];
+      if (table->keys != NULL) {
+        for (int j = 0; j < table->count; j++) freeConstant(&table->keys[j]);
+      }
+      free(table->keys);
+      free(table->targets);
+    }
+  }
+  free(function->constants);
+  free(function->switches);
+  free(function);
+}
+
+static ProgramFunction* copyFunction(ObjFunction* function);
+
+static bool copyConstant(ProgramConstant* constant, Value value) {
+  if (IS_STRING(value)) {
+    return copyChars(&constant->string, AS_STRING(value)->chars, AS_STRING(value)->length);
+  }
+  if (IS_FUNCTION(value)) {
+    constant->function = copyFunction(AS_FUNCTION(value));
+    return constant->function != NULL;
+  }
+  constant->value = value;
+  return !IS_OBJ(value); // Not a compile time constant
+}
+
+static ProgramFunction* copyFunction(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  ProgramFunction* copy = calloc(1, sizeof(ProgramFunction));
+  if (copy == NULL) return NULL;
+  copy->arity = function->arity;
+  copy->upvalueCount = function->upvalueCount;
+  copy->maxSlots = function->maxSlots;
+  copy->cacheCount = function->cacheCount;
+  if (function->name != NULL &&
+      !copyChars(&copy->name, function->name->chars, function->name->length)) {
+    goto fail;
+  }
+
+  size_t count = (size_t)chunk->count;
+  copy->count = chunk->count;
+  copy->code = malloc(count + 1);
+  copy->files = malloc((count + 1) * sizeof(int));
+  copy->lines = malloc((count + 1) * sizeof(int));
+  copy->chars = malloc((count + 1) * sizeof(int));
+  copy->constantCount = chunk->constants.count;
+  copy->constants = calloc((size_t)chunk->constants.count + 1, sizeof(ProgramConstant));
+  copy->switchCount = chunk->switchCount;
+  copy->switches = calloc((size_t)chunk->switchCount + 1, sizeof(ProgramSwitch));
+  if (copy->code == NULL || copy->files == NULL || copy->lines == NULL ||
+      copy->chars == NULL || copy->constants == NULL || copy->switches == NULL) {
+    goto fail;
+  }
+  memcpy(copy->code, chunk->code, count);
+  memcpy(copy->files, chunk->files, count * sizeof(int));
+  memcpy(copy->lines, chunk->lines, count * sizeof(int));
+  memcpy(copy->chars, chunk->chars, count * sizeof(int));
+  for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    copy->code[offset] = getGenericOpcode(chunk->code[offset]);
+  }
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (!copyConstant(&copy->constants[i], chunk->constants.values[i])) goto fail;
+  }
+
+  for (int i = 0; i < chunk->switchCount; i++) {
+    SwitchTable* table = &chunk->switches[i];
+    ProgramSwitch* to = &copy->switches[i];
+    to->missTarget = table->missTarget;
+    to->keys = calloc((size_t)table->count + 1, sizeof(ProgramConstant));
+    to->targets = malloc(((size_t)table->count + 1) * sizeof(int));
+    if (to->keys == NULL || to->targets == NULL) goto fail;
+    for (int j = 0; j < table->capacity; j++) {
+      if (IS_UNDEFINED(table->cases[j].key)) continue;
+      to->targets[to->count] = table->cases[j].target;
+      if (!copyConstant(&to->keys[to->count++], table->cases[j].key)) goto fail;
+    }
+  }
+  return copy;
+
+fail:
+  freeFunction(copy);
+  return NULL;
+}
+
+static void freeProgram(Program* program) {
+  if (program->filenames != NULL) {
+    for (int i = 0; i < program->fileCount; i++) free(program->filenames[i].chars);
+  }
+  if (program->globalNames != NULL) {
+    for (int i = 0; i < program->globalCount; i++) free(program->globalNames[i].chars);
+  }
+  free(program->filenames);
+  free(program->globalNames);
+  freeFunction(program->script);
+  free(program);
+}
+
+// Take script, compiled by vm, out of vm. NULL if out of memory or a
+// constant is not a compile time constant.
+Program* newProgram(VM* vm, ObjFunction* script) {
+  Program* program = calloc(1, sizeof(Program));
+  if (program == NULL) return NULL;
+  atomic_init(&program->refCount, 1);
+  program->fileCount = vm->filenames.count;
+  program->filenames = calloc((size_t)vm->filenames.count + 1, sizeof(ProgramString));
+  program->globalCount = vm->globals.count;
+  program->globalNames = calloc((size_t)vm->globals.count + 1, sizeof(ProgramString));
+  if (program->filenames == NULL || program->globalNames == NULL) goto fail;
+
+  for (int i = 0; i < program->fileCount; i++) {
+    ObjString* name = AS_STRING(vm->filenames.values[i]);
+    if (!copyChars(&program->filenames[i], name->chars, name->length)) goto fail;
+  }
+  for (int i = 0; i < program->globalCount; i++) {
+    ObjString* name = AS_STRING(vm->globalNames.values[i]);
+    if (!copyChars(&program->globalNames[i], name->chars, name->length)) goto fail;
+  }
+  program->script = copyFunction(script);
+  if (program->script == NULL) goto fail;
+  return program;
+
+fail:
+  freeProgram(program);
+  return NULL;
+}
+
+// Compile source in vm, which should be set up like the VMs that will run
+// it, see above. NULL on compile errors.
+Program* compileProgram(VM* vm, const char* source, const char* filename) {
+  int fileno = strlen(filename) > 0 ? addFilename(vm, filename) : -1;
+  ObjFunction* script = compile(vm, fileno, source, vm->optimize);
+  if (script == NULL) return NULL;
+  return newProgram(vm, script);
+}
+
+void retainProgram(Program* program) {
+  atomic_fetch_add_explicit(&program->refCount, 1, memory_order_relaxed);
+}
+
+void releaseProgram(Program* program) {
+  if (program == NULL) return;
+  if (atomic_fetch_sub_explicit(&program->refCount, 1, memory_order_acq_rel) == 1) {
+    freeProgram(program);
+  }
+}
+
+
+// Running a program
+
+static ObjFunction* instantiate(Instance* instance, ProgramFunction* source);
+
+static Value instantiateConstant(Instance* instance, ProgramConstant* constant) {
+  if (constant->string.chars != NULL) {
+    return OBJ_VAL(copyString(instance->vm, constant->string.chars, constant->string.length));
+  }
+  if (constant->function != NULL) return OBJ_VAL(instantiate(instance, constant->function));
+  return constant->value;
+}
+
+// Move the global slots of a private copy of the code to the slots of the
+// same names in the VM
+static void remapGlobals(Instance* instance, Chunk* chunk) {
+  for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    uint8_t* code = chunk->code + offset;
+    if (code[0] == OP_GET_GLOBAL || code[0] == OP_SET_GLOBAL || code[0] == OP_DEFINE_GLOBAL) {
+      int slot = instance->globals[(code[1] << 8) | code[2]];
+      code[1] = (uint8_t)(slot >> 8);
+      code[2] = (uint8_t)slot;
+    }
+  }
+}
+
+static ObjFunction* instantiate(Instance* instance, ProgramFunction* source) {
+  VM* vm = instance->vm;
+  ObjFunction* function = newFunction(vm);
+  push(vm, OBJ_VAL(function)); // Keep safe from GC
+  Chunk* chunk = &function->chunk;
+
+  if (instance->shared) {
+    function->program = instance->program;
+    retainProgram(instance->program);
+    chunk->code = source->code;
+    chunk->files = source->files;
+    chunk->lines = source->lines;
+    chunk->chars = source->chars;
+  } else {
+    chunk->code = ALLOCATE(vm, uint8_t, source->count);
+    chunk->files = ALLOCATE(vm, int, source->count);
+    chunk->lines = ALLOCATE(vm, int, source->count);
+    chunk->chars = ALLOCATE(vm, int, source->count);
+    memcpy(chunk->code, source->code, (size_t)source->count);
+    memcpy(chunk->lines, source->lines, (size_t)source->count * sizeof(int));
+    memcpy(chunk->chars, source->chars, (size_t)source->count * sizeof(int));
+    for (int i = 0; i < source->count; i++) {
+      chunk->files[i] = source->files[i] < 0 ? -1 : instance->files[source->files[i]];
+    }
+  }
+  chunk->count = source->count;
+  chunk->capacity = source->count;
+
+  function->arity = source->arity;
+  function->upvalueCount = source->upvalueCount;
+  function->maxSlots = source->maxSlots;
+  if (source->name.chars != NULL) {
+    function->name = copyString(vm, source->name.chars, source->name.length);
+  }
+
+  for (int i = 0; i < source->constantCount; i++) {
+    addConstant(vm, chunk, instantiateConstant(instance, &source->constants[i]));
+  }
+
+  for (int i = 0; i < source->switchCount; i++) {
+    ProgramSwitch* from = &source->switches[i];
+    int index = addSwitchTable(vm, chunk);
+    SwitchTable* table = &chunk->switches[index];
+    table->missTarget = from->missTarget;
+    for (int j = 0; j < from->count; j++) {
+      Value key = instantiateConstant(instance, &from->keys[j]);
+      push(vm, key);
+      addSwitchCase(vm, table, key, from->targets[j]);
+      pop(vm);
+    }
+    finishSwitchTable(vm, table);
+  }
+
+  if (!instance->shared) remapGlobals(instance, chunk);
+  function->cacheCount = source->cacheCount;
+  newInlineCaches(vm, function);
+  pop(vm);
+  return function;
+}
+
+// The script of program as an ObjFunction of vm, NULL if out of memory
+ObjFunction* instantiateProgram(VM* vm, Program* program) {
+  Instance instance = { vm, program, NULL, NULL, true };
+  ObjFunction* script = NULL;
+  instance.files = malloc(((size_t)program->fileCount + 1) * sizeof(int));
+  instance.globals = malloc(((size_t)program->globalCount + 1) * sizeof(int));
+  if (instance.files == NULL || instance.globals == NULL) goto done;
+
+  for (int i = 0; i < program->fileCount; i++) {
+    instance.files[i] = addFilename(vm, program->filenames[i].chars);
+    if (instance.files[i] != i) instance.shared = false;
+  }
+  for (int i = 0; i < program->globalCount; i++) {
+    ProgramString* name = &program->globalNames[i];
+    push(vm, OBJ_VAL(copyString(vm, name->chars, name->length)));
+    instance.globals[i] = resolveGlobal(vm, AS_STRING(vm->stackTop[-1]));
+    pop(vm);
+    if (instance.globals[i] != i) instance.shared = false;
+  }
+  script = instantiate(&instance, program->script);
+
+done:
+  free(instance.files);
+  free(instance.globals);
+  return script;
+}
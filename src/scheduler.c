@@ -0,0 +1,437 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "scheduler.h"
+#include "timer.h"
+
+// VM scheduler
+//
+// Each worker thread has a queue of VMs and runs them round robin, one
+// timeslice of run() at a time: a VM that is still running goes to the
+// back of the queue of the worker that ran it. A worker whose queue is
+// empty steals half of the queue of another worker, so VMs migrate
+// between threads between slices and the load evens out as VMs finish.
+// Workers with nothing to run or steal sleep until there is.
+//
+// A VM that returns INTERPRET_SLEEPING is parked in a timer wheel instead
+// of a queue, and costs nothing until it wakes. Workers look at the wheel
+// between slices and move the VMs that are due to their own queue. When
+// all workers are idle, one of them waits with a timeout until the next
+// VM is due, the others until there is work. interruptScheduled() takes
+// a VM out of the wheel early.
+//
+// A VM is in one queue, the wheel or run by one worker at a time, and
+// run() keeps all of its state in the VM, so only the queues need locks.
+// The lock of the scheduler is taken when a VM is added, parked or done,
+// for the wheel, and by workers that go to sleep. It is taken before the
+// lock of a worker.
+//
+// Built with NO_THREADS there are no workers, and waitScheduler() runs
+// the VMs on the calling thread, sleeping on the wheel when all sleep.
+
+#define QUEUE_INITIAL 8 // Tasks, a power of two
+
+#ifdef NO_THREADS
+#define LOCK(mutex)
+#define UNLOCK(mutex)
+#else
+#define LOCK(mutex) pthread_mutex_lock(mutex)
+#define UNLOCK(mutex) pthread_mutex_unlock(mutex)
+#endif
+
+typedef struct {
+  VM* vm;
+  void* data;
+} Task;
+
+typedef struct {
+  struct Scheduler* scheduler;
+  int index;
+  Task* tasks;  // Ring buffer, always with a free slot while the worker runs
+  int capacity; // Power of two
+  int head;
+  int count;
+#ifndef NO_THREADS
+  pthread_mutex_t lock;
+  pthread_t thread;
+#endif
+} Worker;
+
+struct Scheduler {
+  SchedulerCb done;
+  int workerCount;
+  Worker* workers;
+  int threadCount;     // Worker threads started
+  atomic_int queued;   // Tasks in all queues
+  atomic_int sleeping; // Workers waiting for tasks
+  int next;            // Worker schedule() adds the next VM to
+  int active;          // VMs scheduled and not done yet
+  bool stopping;
+  TimerWheel* timers;  // Sleeping VMs
+  _Atomic double nextWake; // nextWakeTime() of timers, 0 if none sleep
+  bool timing;         // A worker waits for nextWake
+#ifndef NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signalled when tasks are queued, broadcast when nextWake gets earlier
+  pthread_cond_t idle; // Broadcast when active drops to 0
+#endif
+};
+
+
+// Queues, the caller holds the lock of the worker
+
+// Make room for count more tasks
+static bool growQueue(Worker* worker, int count) {
+  if (worker->count + count <= worker->capacity) return true;
+  int capacity = worker->capacity;
+  while (capacity < worker->count + count) capacity *= 2;
+  Task* tasks = malloc(sizeof(Task) * (size_t)capacity);
+  if (tasks == NULL) return false;
+  for (int i = 0; i < worker->count; i++) {
+    tasks[i] = worker->tasks[(worker->head + i) & (worker->capacity - 1)];
+  }
+  free(worker->tasks);
+  worker->tasks = tasks;
+  worker->capacity = capacity;
+  worker->head = 0;
+  return true;
+}
+
+static void pushTask(Worker* worker, Task task) {
+  worker->tasks[(worker->head + worker->count++) & (worker->capacity - 1)] = task;
+}
+
+static Task popFront(Worker* worker) {
+  Task task = worker->tasks[worker->head];
+  worker->head = (worker->head + 1) & (worker->capacity - 1);
+  worker->count--;
+  return task;
+}
+
+static Task popBack(Worker* worker) {
+  return worker->tasks[(worker->head + --worker->count) & (worker->capacity - 1)];
+}
+
+
+// Workers
+
+static bool takeTask(Worker* worker, Task* task) {
+  LOCK(&worker->lock);
+  bool found = worker->count > 0;
+  if (found) *task = popFront(worker);
+  UNLOCK(&worker->lock);
+  if (found) atomic_fetch_sub(&worker->scheduler->queued, 1);
+  return found;
+}
+
+#ifndef NO_THREADS
+// Take the last task of another worker to run, and move up to half of the
+// rest to the queue of thief
+static bool stealTask(Worker* thief, Task* task) {
+  Scheduler* scheduler = thief->scheduler;
+  for (int i = 1; i < scheduler->workerCount; i++) {
+    Worker* victim = &scheduler->workers[(thief->index + i) % scheduler->workerCount];
+    // Lock in index order, two thieves may pick each other
+    Worker* first = thief->index < victim->index ? thief : victim;
+    Worker* second = first == thief ? victim : thief;
+    LOCK(&first->lock);
+    LOCK(&second->lock);
+    bool found = victim->count > 0;
+    if (found) {
+      *task = popBack(victim);
+      int move = victim->count / 2;
+      if (!growQueue(thief, move + 1)) move = thief->capacity - thief->count - 1;
+      for (int j = 0; j < move; j++) pushTask(thief, popBack(victim));
+    }
+    UNLOCK(&second->lock);
+    UNLOCK(&first->lock);
+    if (found) {
+      atomic_fetch_sub(&scheduler->queued, 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void wakeWorker(Scheduler* scheduler) {
+  if (atomic_load(&scheduler->sleeping) == 0) return;
+  pthread_mutex_lock(&scheduler->lock);
+  pthread_cond_signal(&scheduler->work);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Sleep until tasks are queued or a VM is due, false if the scheduler is
+// stopping. Only one worker at a time waits for the timers.
+static bool waitForWork(Scheduler* scheduler) {
+  pthread_mutex_lock(&scheduler->lock);
+  atomic_fetch_add(&scheduler->sleeping, 1);
+  bool timing = false;
+  while (atomic_load(&scheduler->queued) == 0 && !scheduler->stopping) {
+    double wake = atomic_load(&scheduler->nextWake);
+    if (wake == 0 || (scheduler->timing && !timing)) {
+      pthread_cond_wait(&scheduler->work, &scheduler->lock);
+      continue;
+    }
+    if (now() >= wake) break; // wakeTimers() takes them
+    scheduler->timing = timing = true;
+    struct timespec until;
+    until.tv_sec = (time_t)wake;
+    until.tv_nsec = (long)((wake - (double)until.tv_sec) * 1.0e9);
+    pthread_cond_timedwait(&scheduler->work, &scheduler->lock, &until);
+  }
+  if (timing) scheduler->timing = false;
+  atomic_fetch_sub(&scheduler->sleeping, 1);
+  bool stopping = scheduler->stopping;
+  pthread_mutex_unlock(&scheduler->lock);
+  return !stopping;
+}
+#endif
+
+// Move the VMs that are due to the queue of worker
+static void wakeTimers(Worker* worker) {
+  Scheduler* scheduler = worker->scheduler;
+  double wake = atomic_load(&scheduler->nextWake);
+  if (wake == 0 || now() < wake) return;
+
+  LOCK(&scheduler->lock);
+  LOCK(&worker->lock);
+  double time = now();
+  int woken = 0;
+  Task task;
+  while (growQueue(worker, 2) && wakeVM(scheduler->timers, time, &task.vm, &task.data)) {
+    pushTask(worker, task); // Keeps the free slot
+    woken++;
+  }
+  UNLOCK(&worker->lock);
+  atomic_fetch_add(&scheduler->queued, woken);
+  atomic_store(&scheduler->nextWake, nextWakeTime(scheduler->timers));
+#ifndef NO_THREADS
+  if (woken > 1 && atomic_load(&scheduler->sleeping) > 0) pthread_cond_broadcast(&scheduler->work);
+#endif
+  UNLOCK(&scheduler->lock);
+}
+
+// Park a sleeping task in the wheel, false if out of memory or it was
+// interrupted meanwhile
+static bool parkTask(Scheduler* scheduler, Task task) {
+  LOCK(&scheduler->lock);
+  // Under the lock, so interruptScheduled() either sees the VM parked or
+  // its interrupt is seen here
+  bool parked = atomic_load(&task.vm->interrupt) == 0 &&
+                parkVM(scheduler->timers, task.vm, task.data);
+  if (parked) {
+    double wake = nextWakeTime(scheduler->timers);
+    double before = atomic_load(&scheduler->nextWake);
+    atomic_store(&scheduler->nextWake, wake);
+    if (before != 0 && wake < before && scheduler->timing) {
+#ifndef NO_THREADS
+      pthread_cond_broadcast(&scheduler->work);
+#endif
+    }
+  }
+  UNLOCK(&scheduler->lock);
+  return parked;
+}
+
+// Run a slice of task, then queue or park it again or report it done
+static void runTask(Worker* worker, Task task) {
+  Scheduler* scheduler = worker->scheduler;
+  InterpretResult result = run(task.vm);
+  if (result == INTERPRET_SLEEPING && parkTask(scheduler, task)) return;
+  if (result == INTERPRET_RUNNING || result == INTERPRET_COMPILED || result == INTERPRET_SLEEPING) {
+    LOCK(&worker->lock);
+    pushTask(worker, task); // Into the free slot
+    bool share = worker->count > 1;
+    UNLOCK(&worker->lock);
+    atomic_fetch_add(&scheduler->queued, 1);
+#ifndef NO_THREADS
+    if (share) wakeWorker(scheduler);
+#else
+    (unused)share;
+#endif
+    return;
+  }
+
+  scheduler->done(task.vm, result, task.data);
+  LOCK(&scheduler->lock);
+  if (--scheduler->active == 0) {
+#ifndef NO_THREADS
+    pthread_cond_broadcast(&scheduler->idle);
+#endif
+  }
+  UNLOCK(&scheduler->lock);
+}
+
+#ifndef NO_THREADS
+static void* work(void* argument) {
+  Worker* worker = argument;
+  for (;;) {
+    Task task;
+    wakeTimers(worker);
+    if (takeTask(worker, &task) || stealTask(worker, &task)) {
+      runTask(worker, task);
+    } else if (!waitForWork(worker->scheduler)) {
+      return NULL;
+    }
+  }
+}
+#endif
+
+
+// API
+
+// A scheduler with threads workers that calls done for every VM that
+// finishes. NULL if out of memory or threads could not be started.
+Scheduler* newScheduler(int threads, SchedulerCb done) {
+#ifdef NO_THREADS
+  threads = 1;
+#endif
+  if (threads < 1) threads = 1;
+  Scheduler* scheduler = malloc(sizeof(Scheduler));
+  if (scheduler == NULL) return NULL;
+  scheduler->done = done;
+  scheduler->workerCount = 0;
+  scheduler->threadCount = 0;
+  scheduler->workers = calloc((size_t)threads, sizeof(Worker));
+  atomic_init(&scheduler->queued, 0);
+  atomic_init(&scheduler->sleeping, 0);
+  scheduler->next = 0;
+  scheduler->active = 0;
+  scheduler->stopping = false;
+  scheduler->timers = newTimerWheel();
+  atomic_init(&scheduler->nextWake, 0);
+  scheduler->timing = false;
+  if (scheduler->workers == NULL || scheduler->timers == NULL) {
+    if (scheduler->timers != NULL) freeTimerWheel(scheduler->timers);
+    free(scheduler->workers);
+    free(scheduler);
+    return NULL;
+  }
+#ifndef NO_THREADS
+  pthread_mutex_init(&scheduler->lock, NULL);
+  // Timed waits use the clock of now()
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&scheduler->work, &attributes);
+  pthread_condattr_destroy(&attributes);
+  pthread_cond_init(&scheduler->idle, NULL);
+#endif
+
+  // All queues are there before the first worker looks for one to steal from
+  bool ready = true;
+  for (int i = 0; i < threads; i++) {
+    Worker* worker = &scheduler->workers[i];
+    worker->scheduler = scheduler;
+    worker->index = i;
+    worker->tasks = malloc(sizeof(Task) * QUEUE_INITIAL);
+    worker->capacity = QUEUE_INITIAL;
+    if (worker->tasks == NULL) ready = false;
+#ifndef NO_THREADS
+    pthread_mutex_init(&worker->lock, NULL);
+#endif
+  }
+  scheduler->workerCount = threads;
+#ifndef NO_THREADS
+  for (int i = 0; i < threads && ready; i++) {
+    ready = pthread_create(&scheduler->workers[i].thread, NULL, work, &scheduler->workers[i]) == 0;
+    if (ready) scheduler->threadCount++;
+  }
+#endif
+  if (!ready) {
+    freeScheduler(scheduler);
+    return NULL;
+  }
+  return scheduler;
+}
+
+// Run vm, after interpret() returned INTERPRET_COMPILED, until it is done.
+// data is passed to the callback. False if out of memory.
+bool schedule(Scheduler* scheduler, VM* vm, void* data) {
+  LOCK(&scheduler->lock);
+  Worker* worker = &scheduler->workers[scheduler->next];
+  scheduler->next = (scheduler->next + 1) % scheduler->workerCount;
+  scheduler->active++;
+  UNLOCK(&scheduler->lock);
+
+  LOCK(&worker->lock);
+  bool added = growQueue(worker, 2); // Keeps the free slot
+  if (added) pushTask(worker, (Task){ vm, data });
+  UNLOCK(&worker->lock);
+
+  if (!added) {
+    LOCK(&scheduler->lock);
+    scheduler->active--;
+    UNLOCK(&scheduler->lock);
+    return false;
+  }
+  atomic_fetch_add(&scheduler->queued, 1);
+#ifndef NO_THREADS
+  wakeWorker(scheduler);
+#endif
+  return true;
+}
+
+// vm_interrupt() for a scheduled VM, which also wakes it if it sleeps.
+// Safe from any thread, but not from a signal handler.
+void interruptScheduled(Scheduler* scheduler, VM* vm, int reason) {
+  vm_interrupt(vm, reason);
+  LOCK(&scheduler->lock);
+  if (unparkVM(scheduler->timers, vm)) {
+    atomic_store(&scheduler->nextWake, nextWakeTime(scheduler->timers));
+#ifndef NO_THREADS
+    pthread_cond_broadcast(&scheduler->work);
+#endif
+  }
+  UNLOCK(&scheduler->lock);
+}
+
+// Wait until every VM scheduled so far is done
+void waitScheduler(Scheduler* scheduler) {
+#ifdef NO_THREADS
+  Worker* worker = &scheduler->workers[0];
+  while (scheduler->active > 0) {
+    Task task;
+    wakeTimers(worker);
+    if (takeTask(worker, &task)) runTask(worker, task);
+    else waitTimers(scheduler->timers, 0); // All of them sleep
+  }
+#else
+  pthread_mutex_lock(&scheduler->lock);
+  while (scheduler->active > 0) pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+  pthread_mutex_unlock(&scheduler->lock);
+#endif
+}
+
+// Wait for all VMs, then stop the workers
+void freeScheduler(Scheduler* scheduler) {
+  waitScheduler(scheduler);
+#ifndef NO_THREADS
+  pthread_mutex_lock(&scheduler->lock);
+  scheduler->stopping = true;
+  pthread_cond_broadcast(&scheduler->work);
+  pthread_mutex_unlock(&scheduler->lock);
+#endif
+#ifndef NO_THREADS
+  // All of them first, they may still try to steal from each other
+  for (int i = 0; i < scheduler->threadCount; i++) pthread_join(scheduler->workers[i].thread, NULL);
+#endif
+  for (int i = 0; i < scheduler->workerCount; i++) {
+#ifndef NO_THREADS
+    pthread_mutex_destroy(&scheduler->workers[i].lock);
+#endif
+    free(scheduler->workers[i].tasks);
+  }
+#ifndef NO_THREADS
+  pthread_mutex_destroy(&scheduler->lock);
+  pthread_cond_destroy(&scheduler->work);
+  pthread_cond_destroy(&scheduler->idle);
+#endif
+  freeTimerWheel(scheduler->timers);
+  free(scheduler->workers);
+  free(scheduler);
+}
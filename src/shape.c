@@ -0,0 +1,156 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "shape.h"
+#include "table.h"
+#include "value.h"
+
+// Shapes are owned by their class and freed along with it.
+// The caller must keep the class (and name) safe from GC.
+Shape* newShape(void* vm, ObjClass* klass, Shape* parent, ObjString* name) {
+  Shape* shape = ALLOCATE(vm, Shape, 1);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+  initTable(&shape->slots);
+  shape->children = NULL;
+  shape->sibling = NULL;
+  return shape;
+}
+
+// A field that shadows a method means the inline caches (vm.c) can no
+// longer skip the field lookup when calling methods of this class.
+static void checkShadowing(void* vm, ObjClass* klass, ObjString* name) {
+  Value method;
+  if (!klass->fieldShadowsMethod && tableGet(vm, &klass->methods, name, &method)) {
+    klass->fieldShadowsMethod = true;
+    klass->version++;
+  }
+}
+
+// Follow (or create) the transition for adding a field to shape
+Shape* shapeAddField(void* vm, Shape* shape, ObjString* name) {
+  for (Shape* child = shape->children; child != NULL; child = child->sibling) {
+    if (child->name == name) return child;
+  }
+
+  checkShadowing(vm, shape->klass, name);
+  Shape* child = newShape(vm, shape->klass, shape, name);
+  // Link it first so the GC can see the slot table while it is filled
+  child->sibling = shape->children;
+  shape->children = child;
+  tableAddAll(vm, &shape->slots, &child->slots);
+  tableSet(vm, &child->slots, name, NUMBER_VAL(child->slotCount - 1));
+  return child;
+}
+
+// Return the slot number of a field, or -1 if shape doesn't have it
+int shapeFindSlot(void* vm, Shape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(vm, &shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+void markShape(void* vm, Shape* shape) {
+  for (; shape != NULL; shape = shape->sibling) {
+    markObject(vm, (Obj*)shape->name);
+    markTable(vm, &shape->slots);
+    markShape(vm, shape->children);
+  }
+}
+
+void freeShape(void* vm, Shape* shape) {
+  while (shape != NULL) {
+    Shape* sibling = shape->sibling;
+    freeShape(vm, shape->children);
+    freeTable(vm, &shape->slots);
+    FREE(vm, Shape, shape);
+    shape = sibling;
+  }
+}
+
+
+// Instance fields
+
+bool getField(void* vm, ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->dictionary != NULL) return tableGet(vm, instance->dictionary, name, value);
+
+  int slot = shapeFindSlot(vm, instance->shape, name);
+  if (slot < 0) return false;
+  *value = instance->fields[slot];
+  return true;
+}
+
+static void growFields(void* vm, ObjInstance* instance, int slotCount) {
+  if (slotCount <= instance->capacity) return;
+
+  int capacity = GROW_CAPACITY(instance->capacity);
+  if (capacity > SHAPE_MAX_FIELDS) capacity = SHAPE_MAX_FIELDS;
+  Value* fields = ALLOCATE(vm, Value, capacity);
+  for (int i = 0; i < instance->capacity; i++) fields[i] = instance->fields[i];
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+  }
+  instance->fields = fields;
+  instance->capacity = capacity;
+}
+
+// Move all fields into a hash table, for instances with too many fields
+static void makeDictionary(void* vm, ObjInstance* instance) {
+  Table* dictionary = ALLOCATE(vm, Table, 1);
+  initTable(dictionary);
+  instance->dictionary = dictionary; // The GC marks both while copying
+
+  Table* slots = &instance->shape->slots;
+  for (int i = 0; i <= slots->capacityMask; i++) {
+    Entry* entry = &slots->entries[i];
+    if (entry->key == NULL) continue;
+    tableSet(vm, dictionary, entry->key, instance->fields[(int)AS_NUMBER(entry->value)]);
+  }
+
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+  }
+  instance->shape = NULL;
+  instance->fields = instance->inlineFields;
+  instance->capacity = 0;
+}
+
+// Set a field, adding it if needed. Return true if the field is new.
+// The caller must keep instance, name and value safe from GC.
+bool setField(void* vm, ObjInstance* instance, ObjString* name, Value value) {
+  if (instance->dictionary == NULL) {
+    int slot = shapeFindSlot(vm, instance->shape, name);
+    if (slot >= 0) {
+      instance->fields[slot] = value;
+      return false;
+    }
+    if (instance->shape->slotCount >= SHAPE_MAX_FIELDS) makeDictionary(vm, instance);
+  }
+
+  if (instance->dictionary != NULL) {
+    bool isNewKey = tableSet(vm, instance->dictionary, name, value);
+    if (isNewKey) checkShadowing(vm, instance->klass, name);
+    return isNewKey;
+  }
+
+  Shape* shape = shapeAddField(vm, instance->shape, name);
+  growFields(vm, instance, shape->slotCount);
+  instance->fields[shape->slotCount - 1] = value;
+  instance->shape = shape;
+
+  ObjClass* klass = instance->klass;
+  if (shape->slotCount > klass->instanceSlots) klass->instanceSlots = shape->slotCount;
+  return true;
+}
+
+void freeFields(void* vm, ObjInstance* instance) {
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+  }
+  if (instance->dictionary != NULL) {
+    freeTable(vm, instance->dictionary);
+    FREE(vm, Table, instance->dictionary);
+  }
+}
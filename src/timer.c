@@ -0,0 +1,328 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "timer.h"
+
+// Timer wheel
+//
+// Parks VMs that returned INTERPRET_SLEEPING until get_wake_time(), so a
+// host only calls run() on VMs that have something to do. Time is counted
+// in millisecond ticks since the wheel was made. There are WHEEL_LEVELS
+// wheels of WHEEL_SLOTS slots; a slot of level n spans WHEEL_SLOTS^n
+// ticks. A VM goes into the lowest level that reaches its tick, and moves
+// down a level ("cascades") when the wheel gets to its slot, so parking
+// and waking are O(1) however many VMs sleep.
+//
+// wakeVM() advances the wheel to a time and returns the VMs that are due
+// one by one. nextWakeTime() is when the wheel next needs to be advanced,
+// either because a VM is due or a slot cascades; nothing needs to run
+// before that. On Linux the wheel keeps a timerfd armed to that time, for
+// hosts that wait on their own epoll or poll set, and waitTimers() waits
+// on it with epoll. Elsewhere waitTimers() just sleeps.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) // In ticks, about 12 days
+#define TICKS_PER_SECOND 1000.0
+
+typedef struct Timer {
+  struct Timer* next;
+  VM* vm;
+  void* data;
+  uint64_t expires; // Tick
+} Timer;
+
+struct TimerWheel {
+  double start;     // now() at tick 0
+  uint64_t current; // All ticks up to this one are done
+  Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  int pending;      // Timers in the slots
+  Timer* due;       // Expired, not returned by wakeVM() yet
+  Timer* unused;    // Free list
+  int fd;           // timerfd, -1 if there is none
+  int epoll;        // Watches fd for waitTimers()
+  double armed;     // Time fd is set to, 0 = not set
+};
+
+
+// Wheel
+
+static double tickTime(TimerWheel* wheel, uint64_t tick) {
+  return wheel->start + (double)tick / TICKS_PER_SECOND;
+}
+
+static void insert(TimerWheel* wheel, Timer* timer) {
+  if (timer->expires <= wheel->current) {
+    timer->next = wheel->due;
+    wheel->due = timer;
+    return;
+  }
+  // Beyond the last level, wait in the last slot and insert again from there
+  uint64_t delta = timer->expires - wheel->current;
+  if (delta >= WHEEL_SPAN) delta = WHEEL_SPAN - 1;
+  uint64_t expires = wheel->current + delta;
+  int level = 0;
+  while (delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) level++;
+  Timer** slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  timer->next = *slot;
+  *slot = timer;
+  wheel->pending++;
+}
+
+// Insert the timers of a slot again, relative to the current tick
+static void cascade(TimerWheel* wheel, int level, uint64_t index) {
+  Timer* timer = wheel->slots[level][index & WHEEL_MASK];
+  wheel->slots[level][index & WHEEL_MASK] = NULL;
+  while (timer != NULL) {
+    Timer* next = timer->next;
+    wheel->pending--;
+    insert(wheel, timer);
+    timer = next;
+  }
+}
+
+// The next tick with a timer in level 0 or a slot to cascade, UINT64_MAX
+// if the slots are empty
+static uint64_t nextTick(TimerWheel* wheel) {
+  uint64_t next = UINT64_MAX;
+  if (wheel->pending == 0) return next;
+  for (uint64_t i = 1; i <= WHEEL_SLOTS; i++) {
+    if (wheel->slots[0][(wheel->current + i) & WHEEL_MASK] != NULL) {
+      next = wheel->current + i;
+      break;
+    }
+  }
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    int shift = WHEEL_BITS * level;
+    for (uint64_t i = 1; i <= WHEEL_SLOTS; i++) {
+      uint64_t block = (wheel->current >> shift) + i;
+      if (block << shift >= next) break;
+      if (wheel->slots[level][block & WHEEL_MASK] != NULL) {
+        next = block << shift;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+// Do all ticks up to target, skipping the ones without anything to do
+static void advance(TimerWheel* wheel, uint64_t target) {
+  while (wheel->current < target) {
+    uint64_t tick = nextTick(wheel);
+    if (tick > target) {
+      wheel->current = target;
+      return;
+    }
+    wheel->current = tick;
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+      int shift = WHEEL_BITS * level;
+      if ((tick & (((uint64_t)1 << shift) - 1)) == 0) cascade(wheel, level, tick >> shift);
+    }
+    cascade(wheel, 0, tick); // Due, or back in the last level if far away
+  }
+}
+
+static uint64_t wakeTick(TimerWheel* wheel, VM* vm) {
+  double time = get_wake_time(vm) - wheel->start;
+  return time > 0 ? (uint64_t)ceil(time * TICKS_PER_SECOND) : 0;
+}
+
+// Take the timer of vm out of a slot list, NULL if it is not there
+static Timer* removeTimer(Timer** list, VM* vm) {
+  for (; *list != NULL; list = &(*list)->next) {
+    Timer* timer = *list;
+    if (timer->vm == vm) {
+      *list = timer->next;
+      return timer;
+    }
+  }
+  return NULL;
+}
+
+// Set the timerfd to the next wake time, and clear it
+static void arm(TimerWheel* wheel) {
+#ifdef __linux__
+  if (wheel->fd < 0) return;
+  double time = nextWakeTime(wheel);
+  uint64_t expirations;
+  if (read(wheel->fd, &expirations, sizeof(expirations)) < 0) {
+    // Not expired, nothing to clear
+  }
+  if (time == wheel->armed) return;
+  struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+  if (time > 0) {
+    spec.it_value.tv_sec = (time_t)time;
+    spec.it_value.tv_nsec = (long)((time - (double)spec.it_value.tv_sec) * 1.0e9);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+  wheel->armed = time;
+#else
+  (unused)wheel;
+#endif
+}
+
+
+// API
+
+TimerWheel* newTimerWheel(void) {
+  TimerWheel* wheel = calloc(1, sizeof(TimerWheel));
+  if (wheel == NULL) return NULL;
+  wheel->start = now();
+  wheel->fd = -1;
+  wheel->epoll = -1;
+#ifdef __linux__
+  // now() is CLOCK_MONOTONIC too
+  wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  wheel->epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { .events = EPOLLIN, .data = { .fd = wheel->fd } };
+  if (wheel->fd < 0 || wheel->epoll < 0 ||
+      epoll_ctl(wheel->epoll, EPOLL_CTL_ADD, wheel->fd, &event) != 0) {
+    if (wheel->fd >= 0) close(wheel->fd);
+    if (wheel->epoll >= 0) close(wheel->epoll);
+    wheel->fd = -1;
+    wheel->epoll = -1;
+  }
+#endif
+  return wheel;
+}
+
+static void freeTimers(Timer* timer) {
+  while (timer != NULL) {
+    Timer* next = timer->next;
+    free(timer);
+    timer = next;
+  }
+}
+
+// The VMs still parked are left alone
+void freeTimerWheel(TimerWheel* wheel) {
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) freeTimers(wheel->slots[level][i]);
+  }
+  freeTimers(wheel->due);
+  freeTimers(wheel->unused);
+#ifdef __linux__
+  if (wheel->fd >= 0) close(wheel->fd);
+  if (wheel->epoll >= 0) close(wheel->epoll);
+#endif
+  free(wheel);
+}
+
+// Keep vm, which returned INTERPRET_SLEEPING, until its wake time. data is
+// returned with it by wakeVM(). False if out of memory.
+bool parkVM(TimerWheel* wheel, VM* vm, void* data) {
+  Timer* timer = wheel->unused;
+  if (timer != NULL) {
+    wheel->unused = timer->next;
+  } else {
+    timer = malloc(sizeof(Timer));
+    if (timer == NULL) return false;
+  }
+  timer->vm = vm;
+  timer->data = data;
+  timer->expires = wakeTick(wheel, vm);
+  insert(wheel, timer);
+  double armed = wheel->armed;
+  if (armed == 0 || tickTime(wheel, timer->expires) < armed) arm(wheel);
+  return true;
+}
+
+// Make a parked vm due now, for instance when it was interrupted. False if
+// it is not parked, or already due.
+bool unparkVM(TimerWheel* wheel, VM* vm) {
+  // Its slot in each level, if it was put there. Timers beyond the last
+  // level wait in whatever slot was last then, so look everywhere after.
+  uint64_t expires = wakeTick(wheel, vm);
+  Timer* timer = NULL;
+  for (int level = 0; level < WHEEL_LEVELS && timer == NULL; level++) {
+    timer = removeTimer(&wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], vm);
+  }
+  for (int i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS && timer == NULL; i++) {
+    timer = removeTimer(&wheel->slots[i / WHEEL_SLOTS][i % WHEEL_SLOTS], vm);
+  }
+  if (timer == NULL) return false;
+  wheel->pending--;
+  timer->expires = wheel->current;
+  insert(wheel, timer);
+  arm(wheel);
+  return true;
+}
+
+// Advance the wheel to time, usually now(), and return a VM that is due
+// in vm and data. False when there are none left.
+bool wakeVM(TimerWheel* wheel, double time, VM** vm, void** data) {
+  if (time > wheel->start) advance(wheel, (uint64_t)((time - wheel->start) * TICKS_PER_SECOND));
+  Timer* timer = wheel->due;
+  if (timer == NULL) {
+    arm(wheel);
+    return false;
+  }
+  wheel->due = timer->next;
+  *vm = timer->vm;
+  *data = timer->data;
+  timer->next = wheel->unused;
+  wheel->unused = timer;
+  return true;
+}
+
+// When wakeVM() has something to do next, 0 if nothing is parked. It may
+// be earlier than any VM wants to wake, when a slot cascades.
+double nextWakeTime(TimerWheel* wheel) {
+  if (wheel->due != NULL) return tickTime(wheel, wheel->current);
+  uint64_t tick = nextTick(wheel);
+  return tick == UINT64_MAX ? 0 : tickTime(wheel, tick);
+}
+
+// A file descriptor that is readable from nextWakeTime() on, for a host
+// that waits on other things too. -1 if there is none on this system.
+int timerFd(TimerWheel* wheel) {
+  return wheel->fd;
+}
+
+// Wait until nextWakeTime(), or until time if that is earlier, or a
+// signal. Returns at once if nothing is parked and time is 0.
+void waitTimers(TimerWheel* wheel, double until) {
+  double time = nextWakeTime(wheel);
+  if (time == 0 || (until > 0 && until < time)) time = until;
+  if (time == 0) return;
+#ifdef __linux__
+  if (wheel->epoll >= 0) {
+    double left = until > 0 ? until - now() : 0;
+    int timeout = until > 0 ? (left > 0 ? (int)ceil(left * 1000.0) : 0) : -1;
+    struct epoll_event event;
+    epoll_wait(wheel->epoll, &event, 1, timeout);
+    return;
+  }
+#endif
+  waitUntil(time);
+}
+
+// Block the calling thread until now() reaches time. False if a signal
+// came first, which may have been vm_interrupt() from a handler.
+bool waitUntil(double time) {
+  double left = time - now();
+  if (left <= 0) return true;
+#ifdef _WIN32
+  Sleep((DWORD)ceil(left * 1000.0));
+  return true;
+#else
+  struct timespec spec;
+  spec.tv_sec = (time_t)left;
+  spec.tv_nsec = (long)((left - (double)spec.tv_sec) * 1.0e9);
+  return nanosleep(&spec, NULL) == 0;
+#endif
+}
@@ -70,7 +70,7 @@ void printValueType(ValueType type) {
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
-  if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b); // Satisfy NaN != NaN
+  if (IS_NUMBER(a) && IS_NUMBER(b)) return COMPARE_NUMBERS(a, ==, b); // Satisfy NaN != NaN
   return a == b;
 #else
   if (a.type != b.type) return false;
@@ -88,7 +88,7 @@ bool valuesEqual(Value a, Value b) {
 }
 
 bool valuesGreater(Value a, Value b) {
-  if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) > AS_NUMBER(b);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) return COMPARE_NUMBERS(a, >, b);
   if (IS_OBJ(a) && IS_OBJ(b)) return objectsGreater(AS_OBJ(a), AS_OBJ(b));
   return false;
 }
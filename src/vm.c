@@ -6,17 +6,22 @@
 //#include <sys\timeb.h>
 #include <math.h>
 
+#include "aot.h"
+#include "bytecode.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "error.h"
 #include "file.h"
 #include "index.h"
+#include "jit.h"
+#include "program.h"
 #include "vm.h"
 #include "object.h"
 #include "objarray.h"
 #include "objstring.h"
 #include "objnumber.h"
+#include "shape.h"
 #include "memory.h"
 
 #ifdef _MSC_VER
@@ -32,10 +37,13 @@
 // if you do explicitly take a VM pointer and pass it around.
 
 
+static void reserveStack(VM* vm, int needed);
+
 static void resetStack(VM* vm) {
   vm->stackTop = vm->stack;
   vm->frameCount = 0;
   vm->openUpvalues = NULL;
+  vm->overflow = false;
 }
 
 
@@ -118,7 +126,15 @@ Value to_nativeValue(VM* vm, const char* name, NativeFn function) {
 
 // API function: return a "native" object instance populated with fields
 Value to_instanceValue(VM* vm, const char** fields, Value* values, int length) {
-  // Make sure the values are safe from GC
+  // Make sure the values are safe from GC. They may be a native's
+  // arguments, which move along with the stack when it grows.
+  if (values >= vm->stack && values < vm->stackTop) {
+    ptrdiff_t offset = values - vm->stack;
+    reserveStack(vm, length + 4);
+    values = vm->stack + offset;
+  } else {
+    reserveStack(vm, length + 4);
+  }
   for (int i=0; i<length; i++) push(vm, values[i]);
 
   //printf("vm:to_instanceValue() constructing instance with %d member values\n", length);
@@ -134,7 +150,7 @@ Value to_instanceValue(VM* vm, const char** fields, Value* values, int length) {
   for (int i=0; i<length; i++) {
     ObjString* fieldname = copyString(vm, fields[i], (int) strlen(fields[i]));
     push(vm, OBJ_VAL(fieldname));
-    tableSet(vm, &instance->fields, fieldname, values[i]);
+    setField(vm, instance, fieldname, values[i]);
     //printf("vm:to_instanceValue() member %d name=%s value=%s\n", i, fields[i], getValueTypeString(values[i]));
     pop(vm); // fieldname is now referenced by the instance, which is on the stack
   }
@@ -151,6 +167,7 @@ Value to_instanceValue(VM* vm, const char** fields, Value* values, int length) {
 Value to_stringValueArray(VM* vm, const char** cstr, int array_length) {
   // We will use the VM's stack to temporarily hold each string value,
   // both to prevent them from being garbage collected, and to create the array
+  reserveStack(vm, array_length);
   for (int i=0; i<array_length; i++) {
     ObjString* obj = copyString(vm, cstr[i], (int) strlen(cstr[i]));
     push(vm, OBJ_VAL(obj));
@@ -162,6 +179,7 @@ Value to_stringValueArray(VM* vm, const char** cstr, int array_length) {
 Value to_numberValueArray(VM* vm, double* number, int array_length) {
   // We will use the VM's stack to temporarily hold each number value,
   // so we can use the VM's internal function to create the array
+  reserveStack(vm, array_length);
   for (int i=0; i<array_length; i++) {
     push(vm, NUMBER_VAL(number[i]));
   }
@@ -215,7 +233,7 @@ bool is_string(Value v) {
 
 
 #ifdef _MSC_VER
-#define CLOCK_REALTIME -1
+#define CLOCK_MONOTONIC -1
 //struct timespec { long tv_sec; long tv_nsec; };    //header part
 int clock_gettime(int ignore, struct timespec* spec)      //C-file part
 {
@@ -227,33 +245,18 @@ int clock_gettime(int ignore, struct timespec* spec)      //C-file part
 }
 #endif
 
+// Seconds since some unspecified point in time, only useful for intervals
 double now() {
-  long            ms; // Milliseconds
-  time_t          s;  // Seconds
   struct timespec spec;
-  double ts;
-  clock_gettime(CLOCK_REALTIME, &spec);
-
-  s  = spec.tv_sec;
-  ms = (long)round(spec.tv_nsec / 1.0e6); // Convert nanoseconds to milliseconds
-  if (ms > 999) {
-    s++;
-    ms = 0;
-  }
-  ts = s + (ms/1000.0);
-  //printf("now() = %f\n", ts);
-  return ts;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return spec.tv_sec + (spec.tv_nsec / 1.0e9);
 }
 
 
 
 // Native C function: clock()
-static bool clockNative(void* vm, int argCount, Value* args, Value* result) {
-  (unused)vm;
-  (unused)argCount;
-  (unused)args;
-  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC); // time.h
-  return true;
+static double clockNative(void) {
+  return (double)clock() / CLOCKS_PER_SEC; // time.h
 }
 
 // Native C function: sleep()
@@ -276,12 +279,161 @@ void set_error_callback(VM* vm, ErrorCb ptr) {
 }
 
 
+// API function: Set the timeslice length in microseconds, 0 = no time limit
+void set_timeslice(VM* vm, int usec) {
+  vm->sliceUsec = usec;
+}
+
+
+// API function: Set the maximum number of ticks (backward jumps, calls and
+// method invocations) per timeslice, 0 = no limit
+void set_tick_budget(VM* vm, long ticks) {
+  vm->sliceTicks = ticks;
+}
+
+
+// API function: Set the maximum call depth and the maximum number of values
+// on the stack. Exceeding either is a "Stack overflow." runtime error.
+void set_stack_limits(VM* vm, int maxFrames, int maxStack) {
+  vm->maxFrames = maxFrames;
+  vm->maxStack = maxStack;
+}
+
+
+// API function: Compile functions to native code once they have used
+// threshold ticks, 0 = never. Does nothing where the JIT isn't built.
+void set_jit(VM* vm, int threshold) {
+  vm->jitThreshold = threshold;
+}
+
+
+// API function: Run the functions compiled to C in module (see aot.c)
+// instead of their bytecode, from the next interpret() on. NULL detaches
+// the module. Returns false if module was written by another version.
+bool set_aot_module(VM* vm, const AotModule* module) {
+  if (module != NULL && module->version != AOT_VERSION) return false;
+  vm->aotModule = module;
+  return true;
+}
+
+
+// API function: Keep the compiled scripts in directory, so interpret()
+// only compiles a script the first time it sees it, see bytecode.c. NULL
+// turns the cache off. Returns false if out of memory.
+bool set_bytecode_cache(VM* vm, const char* directory) {
+  free(vm->cacheDirectory);
+  vm->cacheDirectory = NULL;
+  if (directory == NULL) return true;
+  vm->cacheDirectory = malloc(strlen(directory) + 1);
+  if (vm->cacheDirectory == NULL) return false;
+  strcpy(vm->cacheDirectory, directory);
+  return true;
+}
+
+
+// API function: When a VM that returned INTERPRET_SLEEPING wants to run
+// again, in now() seconds. 0 if it is not sleeping.
+double get_wake_time(VM* vm) {
+  return vm->sleep;
+}
+
+// API function: Make run() return INTERPRET_INTERRUPTED at the next tick
+// (backward jump or call), with the state saved so it can be called again
+// or the script dropped with vm_abort(). Safe to call from another thread
+// or a signal handler while the VM runs or sleeps. reason must not be 0,
+// the last one wins. A VM parked by a scheduler needs interruptScheduled().
+void vm_interrupt(VM* vm, int reason) {
+  atomic_store(&vm->interrupt, reason);
+  atomic_store(&vm->fuel, 0); // Even if run() stores over this, it checks again within TIMESLICE_FUEL ticks
+}
+
+// API function: The reason of the last INTERPRET_INTERRUPTED
+int get_interrupt_reason(VM* vm) {
+  return vm->interruptReason;
+}
+
+// API function: Drop the script of a VM that was interrupted or is still
+// running or sleeping, so the next interpret() starts from scratch
+void vm_abort(VM* vm) {
+  resetStack(vm);
+  vm->sleep = 0;
+  vm->yield = false;
+  atomic_store(&vm->interrupt, 0);
+}
+
+// Clear the interrupt flag and keep the reason for the host
+static InterpretResult takeInterrupt(VM* vm) {
+  vm->interruptReason = atomic_exchange(&vm->interrupt, 0);
+  return INTERPRET_INTERRUPTED;
+}
+
+// After timesliceExpired(), which is true for both the timeslice and
+// interrupts
+static InterpretResult yieldResult(VM* vm) {
+  if (atomic_load(&vm->interrupt) != 0) return takeInterrupt(vm);
+  return INTERPRET_RUNNING;
+}
+
+// After sleep(), an interrupt comes first. The VM still sleeps when it is
+// resumed.
+static InterpretResult sleepResult(VM* vm) {
+  if (atomic_load(&vm->interrupt) != 0) return takeInterrupt(vm);
+  return INTERPRET_SLEEPING;
+}
+
+
+// Fill the tank for the next stretch of ticks
+static void refuel(VM* vm) {
+  int fuel = TIMESLICE_FUEL;
+  if (vm->sliceTicks > 0 && vm->sliceTicks - vm->ticks < fuel) {
+    fuel = (int) (vm->sliceTicks - vm->ticks);
+  }
+  atomic_store_explicit(&vm->fuel, fuel, memory_order_relaxed);
+  vm->refuel = fuel;
+}
+
+
+static void beginTimeslice(VM* vm) {
+  vm->ticks = 0;
+  vm->sliceStart = (vm->sliceUsec > 0 ? now() : 0);
+  refuel(vm);
+}
+
+
+// Called when the fuel has run out, return true if the timeslice is over
+// or the VM was interrupted
+bool timesliceExpired(VM* vm) {
+  if (atomic_load(&vm->interrupt) != 0) return true;
+  vm->ticks += vm->refuel;
+  if (vm->sliceTicks > 0 && vm->ticks >= vm->sliceTicks) return true;
+  if (vm->sliceUsec > 0 && (now() - vm->sliceStart) * 1.0e6 >= vm->sliceUsec) return true;
+  refuel(vm);
+  return false;
+}
+
+
+// Return the slot index of a global variable, adding an undefined slot
+// the first time a name is seen. Globals are resolved once at compile time
+// so the VM can index vm->globals directly instead of hashing the name.
+// The caller must keep name safe from GC.
+int resolveGlobal(VM* vm, ObjString* name) {
+  Value slot;
+  if (tableGet(vm, &vm->globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+  int index = vm->globals.count;
+  writeValueArray(vm, &vm->globals, UNDEFINED_VAL);
+  writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+  tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(index));
+  return index;
+}
+
 // API function: Add a named value to the global namespace
 void defineGlobal(VM* vm, const char* name, Value value) {
   push(vm, value); // Store temporarily
   ObjString* name_obj = copyString(vm, name, (int)strlen(name));
   push(vm, OBJ_VAL(name_obj)); // Store temporarily
-  tableSet(vm, &vm->globals, name_obj, value);
+  int slot = resolveGlobal(vm, name_obj);
+  vm->globals.values[slot] = value;
   pop(vm); // name_obj
   pop(vm); // value
   return;
@@ -294,21 +446,100 @@ void defineNative(VM* vm, const char* name, NativeFn function) {
   push(vm, OBJ_VAL(name_obj));
   Value native = OBJ_VAL(newNative(vm, name_obj, function));
   push(vm, native);
-  tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+  int slot = resolveGlobal(vm, name_obj);
+  vm->globals.values[slot] = native;
   pop(vm);
   pop(vm);
   return;
 }
 
+// Parse a native signature like "nn>n": one character per parameter, then
+// '>' and the return type. n = number, s = string, b = boolean, a = any value
+static bool parseSignature(ObjNative* native, const char* signature) {
+  int arity = 0;
+  const char* c = signature;
+  for (; *c != '\0' && *c != '>'; c++) {
+    if (arity == NATIVE_MAX_PARAMS || strchr("nsba", *c) == NULL) return false;
+    native->params[arity++] = *c;
+  }
+  if (*c != '>' || c[1] == '\0' || c[2] != '\0' || strchr("nsba", c[1]) == NULL) return false;
+  native->arity = arity;
+  native->returns = c[1];
+  return true;
+}
+
+static ObjNative* defineSignedNative(VM* vm, const char* name, NativeFn function, const char* signature) {
+  ObjString* name_obj = copyString(vm, name, (int)strlen(name));
+  push(vm, OBJ_VAL(name_obj));
+  ObjNative* native = newNative(vm, name_obj, function);
+  push(vm, OBJ_VAL(native));
+  if (parseSignature(native, signature)) {
+    int slot = resolveGlobal(vm, name_obj);
+    vm->globals.values[slot] = OBJ_VAL(native);
+  } else {
+    native = NULL;
+  }
+  pop(vm);
+  pop(vm);
+  return native;
+}
+
+// API function: Create a named native function with a signature (see
+// parseSignature) and add it to the global namespace. The VM checks the
+// arguments, so the function doesn't have to.
+// Return false if the signature is invalid.
+bool defineNativeTyped(VM* vm, const char* name, NativeFn function, const char* signature) {
+  return defineSignedNative(vm, name, function, signature) != NULL;
+}
+
+// API function: Like defineNativeTyped() for a plain C function that takes
+// up to 3 numbers and returns a number, e.g. "nn>n" with .n2 = hypot.
+// The VM calls it directly, without boxing the arguments or the result.
+bool defineNativeUnboxed(VM* vm, const char* name, NativeUnboxedFn function, const char* signature) {
+  for (const char* c = signature; *c != '\0'; c++) {
+    if (*c != 'n' && *c != '>') return false;
+  }
+  if (strlen(signature) > 5) return false; // "nnn>n"
+
+  ObjNative* native = defineSignedNative(vm, name, NULL, signature);
+  if (native == NULL) return false;
+  native->isUnboxed = true;
+  native->unboxed = function;
+  return true;
+}
+
+// Add a built-in method of a value type (Array, String, Number) to its table.
+// The receiver is bound when the method is called, see invokeFromArray() etc.
+void defineNativeMethod(VM* vm, Table* methods, const char* name, NativeMFn function) {
+  ObjString* name_obj = copyString(vm, name, (int)strlen(name));
+  push(vm, OBJ_VAL(name_obj));
+  Value method = OBJ_VAL(newNativeMethod(vm, NULL_VAL, name_obj, function));
+  push(vm, method);
+  tableSet(vm, methods, name_obj, method);
+  pop(vm);
+  pop(vm);
+}
+
 void freeVM(VM* vm) {
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  fprintf(stderr, "%ld instructions\n", vm->instructions);
+#endif
   freeValueArray(vm, &vm->filenames);
+  free(vm->cacheDirectory);
   //printf("vm.freeVM(%p) freeing globals\n", (void*)vm);
-  freeTable(vm, &vm->globals);
+  freeTable(vm, &vm->globalSlots);
+  freeValueArray(vm, &vm->globals);
+  freeValueArray(vm, &vm->globalNames);
   //printf("vm.freeVM(%p) freeing strings\n", (void*)vm);
   freeTable(vm, &vm->strings);
+  freeTable(vm, &vm->arrayMethods);
+  freeTable(vm, &vm->stringMethods);
+  freeTable(vm, &vm->numberMethods);
   //printf("vm.freeVM(%p) freeing objects\n", (void*)vm);
   vm->initString = NULL; // Gets freed by freeObjects
   freeObjects(vm);
+  free(vm->frames);
+  free(vm->stack);
   //printf("vm.freeVM(%p) freeing struct\n", (void*)vm);
   free(vm);
   vm = NULL;
@@ -316,6 +547,7 @@ void freeVM(VM* vm) {
 }
 
 void push(VM* vm, Value value) {
+  if (vm->stackTop == vm->stack + vm->stackCapacity) reserveStack(vm, 1);
   *vm->stackTop = value;
   vm->stackTop++;
 }
@@ -329,6 +561,88 @@ static Value peek(VM* vm, int distance) {
   return vm->stackTop[-1 - distance];
 }
 
+// Move the stack to a new buffer of capacity values. Every pointer into it
+// is rebased: stackTop, the slots of all frames and the open upvalues.
+// run() reloads its copies with LOAD_STATE().
+static bool resizeStack(VM* vm, int capacity) {
+  int count = (int)(vm->stackTop - vm->stack);
+  Value* stack = malloc(sizeof(Value) * capacity);
+  if (stack == NULL) return false;
+  memcpy(stack, vm->stack, sizeof(Value) * count);
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  }
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stackTop = stack + count;
+  vm->stackCapacity = capacity;
+  return true;
+}
+
+// Make room for at least needed values above vm->stackTop
+static bool growStack(VM* vm, int needed) {
+  int count = (int)(vm->stackTop - vm->stack);
+  if (count + needed <= vm->stackCapacity) return true;
+  if (count + needed > vm->maxStack) {
+    runtimeError(vm, "Stack overflow.");
+    return false;
+  }
+
+  int capacity = vm->stackCapacity;
+  while (capacity < count + needed) capacity *= 2;
+  if (capacity > vm->maxStack) capacity = vm->maxStack;
+  if (!resizeStack(vm, capacity)) {
+    runtimeError(vm, "Out of memory.");
+    return false;
+  }
+  return true;
+}
+
+// Make room for needed values pushed through the API, e.g. by a native
+// that builds an array. A native can't fail from here, so past maxStack
+// the stack still grows, nothing is written out of bounds, and the caller
+// of the native reports the overflow once it returns, see nativeOverflow().
+static void reserveStack(VM* vm, int needed) {
+  int count = (int)(vm->stackTop - vm->stack);
+  if (count + needed > vm->maxStack) vm->overflow = true;
+  if (count + needed <= vm->stackCapacity) return;
+
+  int capacity = vm->stackCapacity;
+  while (capacity < count + needed) capacity *= 2;
+  if (capacity > vm->maxStack && count + needed <= vm->maxStack) capacity = vm->maxStack;
+  if (!resizeStack(vm, capacity)) {
+    fprintf(stderr, "vm:reserveStack() out of memory\n");
+    abort();
+  }
+}
+
+// Report a push() past maxStack by the native that just returned
+static bool nativeOverflow(VM* vm) {
+  if (!vm->overflow) return false;
+  runtimeError(vm, "Stack overflow.");
+  return true;
+}
+
+static bool growFrames(VM* vm) {
+  if (vm->frameCapacity >= vm->maxFrames) {
+    runtimeError(vm, "Stack overflow.");
+    return false;
+  }
+  int capacity = vm->frameCapacity * 2;
+  if (capacity > vm->maxFrames) capacity = vm->maxFrames;
+  CallFrame* frames = realloc(vm->frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) {
+    runtimeError(vm, "Out of memory.");
+    return false;
+  }
+  vm->frames = frames;
+  vm->frameCapacity = capacity;
+  return true;
+}
+
 static bool call(VM* vm, ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError(vm, "Expected %d arguments but got %d.",
@@ -336,8 +650,9 @@ static bool call(VM* vm, ObjClosure* closure, int argCount) {
     return false;
   }
 
-  if (vm->frameCount == FRAMES_MAX) {
-    runtimeError(vm, "Stack overflow.");
+  if (vm->frameCount == vm->frameCapacity && !growFrames(vm)) return false;
+  int needed = closure->function->maxSlots - argCount - 1 + STACK_HEADROOM;
+  if (vm->stackTop + needed > vm->stack + vm->stackCapacity && !growStack(vm, needed)) {
     return false;
   }
 
@@ -351,6 +666,77 @@ static bool call(VM* vm, ObjClosure* closure, int argCount) {
 
 
 
+static bool hasNativeType(Value value, char type) {
+  switch (type) {
+    case 'n': return IS_NUMBER(value);
+    case 's': return IS_STRING(value);
+    case 'b': return IS_BOOL(value);
+    default:  return true;
+  }
+}
+
+static const char* nativeTypeName(char type) {
+  switch (type) {
+    case 'n': return "number";
+    case 's': return "string";
+    case 'b': return "boolean";
+    default:  return "value";
+  }
+}
+
+static double callUnboxed(ObjNative* native, Value* args) {
+  switch (native->arity) {
+    case 0:  return native->unboxed.n0();
+    case 1:  return native->unboxed.n1(AS_NUMBER(args[0]));
+    case 2:  return native->unboxed.n2(AS_NUMBER(args[0]), AS_NUMBER(args[1]));
+    default: return native->unboxed.n3(AS_NUMBER(args[0]), AS_NUMBER(args[1]), AS_NUMBER(args[2]));
+  }
+}
+
+// Call a native with a signature, the arguments are on top of the stack
+static bool callTypedNative(VM* vm, ObjNative* native, int argCount) {
+  if (argCount != native->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+    return false;
+  }
+  Value* args = vm->stackTop - argCount;
+  for (int i = 0; i < argCount; i++) {
+    if (!hasNativeType(args[i], native->params[i])) {
+      runtimeError(vm, "Argument %d must be a %s, got %s.",
+          i + 1, nativeTypeName(native->params[i]), getTypeAsString(args[i]));
+      return false;
+    }
+  }
+
+  Value result;
+  if (native->isUnboxed) {
+    result = NUMBER_VAL(callUnboxed(native, args));
+  } else if (!native->function(vm, argCount, args, &result)) {
+    runtimeError(vm, "Call failed, check arguments.");
+    return false;
+  } else if (!hasNativeType(result, native->returns)) {
+    runtimeError(vm, "%s() returned %s, expected %s.",
+        native->name->chars, getTypeAsString(result), nativeTypeName(native->returns));
+    return false;
+  }
+  vm->stackTop -= argCount + 1; // Discard arguments from stack
+  push(vm, result);
+  return !nativeOverflow(vm);
+}
+
+// Call a built-in method, the arguments are on top of the stack
+static bool callNativeMethod(VM* vm, NativeMFn function, Value receiver, int argCount) {
+  Value result;
+  bool success = function(vm, receiver, argCount, vm->stackTop - argCount, &result);
+  if (!success) {
+    runtimeError(vm, "Call failed, check arguments.");
+    return false;
+  }
+  vm->stackTop -= argCount + 1; // Discard arguments from stack
+  push(vm, result);
+  return !nativeOverflow(vm);
+}
+
 static bool callValue(VM* vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
@@ -375,6 +761,7 @@ static bool callValue(VM* vm, Value callee, int argCount) {
         return call(vm, AS_CLOSURE(callee), argCount);
       }
       case OBJ_NATIVE: {
+        if (AS_NATIVE(callee)->arity >= 0) return callTypedNative(vm, AS_NATIVE(callee), argCount);
         NativeFn native = AS_NATIVE(callee)->function;
         //printf("vm:callValue() will call %p with argCount=%d, args=%p\n", native, argCount,(vm->stackTop - argCount));
         for (int i=0; i<argCount; i++) {
@@ -395,23 +782,11 @@ static bool callValue(VM* vm, Value callee, int argCount) {
           runtimeError(vm, "Call failed, check arguments.");
           return false;
         }
-        return true;
+        return !nativeOverflow(vm);
       }
       case OBJ_NATIVE_METHOD: {
         ObjNativeMethod* method = AS_NATIVE_METHOD(callee);
-        //printf("vm:callValue() will call %p with argCount=%d, args=%p\n", method, argCount,(vm->stackTop - argCount));
-        Value result;
-        //printf("vm:callValue() args ok, calling\n");
-        bool success = method->function(vm, method->receiver, argCount, vm->stackTop - argCount, &result);
-        //printf("vm:callValue() returned from native function\n");
-        if (!success) {
-          runtimeError(vm, "Call failed, check arguments.");
-          return false;
-        }
-        vm->stackTop -= argCount + 1; // Discard arguments from stack
-        //printf("vm:callValue() pushing result to stack\n");
-        push(vm, result);
-        return true;
+        return callNativeMethod(vm, method->function, method->receiver, argCount);
       }
       default:
         // Non-callable object type.
@@ -426,6 +801,9 @@ static bool callValue(VM* vm, Value callee, int argCount) {
 
 static bool invokeFromArray(VM* vm, Value receiver, ObjString* name, int argCount) {
   Value method;
+  if (tableGet(vm, &vm->arrayMethods, name, &method)) {
+    return callNativeMethod(vm, AS_NATIVE_METHOD(method)->function, receiver, argCount);
+  }
   if (!getArrayProperty(vm, receiver, name, &method)) {
     runtimeError(vm, "(Array) has no '%s'.", name->chars);
     return false;
@@ -436,6 +814,9 @@ static bool invokeFromArray(VM* vm, Value receiver, ObjString* name, int argCoun
 
 static bool invokeFromNumber(VM* vm, Value receiver, ObjString* name, int argCount) {
   Value method;
+  if (tableGet(vm, &vm->numberMethods, name, &method)) {
+    return callNativeMethod(vm, AS_NATIVE_METHOD(method)->function, receiver, argCount);
+  }
   if (!getNumberProperty(vm, receiver, name, &method)) {
     runtimeError(vm, "(Number) has no '%s'.", name->chars);
     return false;
@@ -446,6 +827,9 @@ static bool invokeFromNumber(VM* vm, Value receiver, ObjString* name, int argCou
 
 static bool invokeFromString(VM* vm, Value receiver, ObjString* name, int argCount) {
   Value method;
+  if (tableGet(vm, &vm->stringMethods, name, &method)) {
+    return callNativeMethod(vm, AS_NATIVE_METHOD(method)->function, receiver, argCount);
+  }
   if (!getStringProperty(vm, receiver, name, &method)) {
     runtimeError(vm, "(String) has no '%s'.", name->chars);
     return false;
@@ -454,18 +838,87 @@ static bool invokeFromString(VM* vm, Value receiver, ObjString* name, int argCou
 }
 
 
-static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount) {
+// Inline caches
+//
+// Every OP_GET_PROPERTY and OP_INVOKE site has an InlineCache that maps
+// the receiver's class to the method found there last time, for up to
+// INLINE_CACHE_ENTRIES classes. A hit skips the lookups in both the
+// instance fields and klass->methods. That is only correct as long as
+// no field shadows a method, so such classes are never cached (see
+// checkShadowing() in shape.c). Methods are only added while a class is
+// declared, and every change to klass->methods bumps klass->version,
+// which makes the existing entries for that class miss.
+//
+// Field accesses cache the instance shape and the slot of the field,
+// and OP_SET_PROPERTY also the shape transition when it adds a field.
+
+static ObjClosure* cacheLookup(InlineCache* cache, ObjClass* klass) {
+  if (cache == NULL) return NULL;
+  for (int i = 0; i < cache->count; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->klass == klass && entry->version == klass->version) return entry->method;
+  }
+  return NULL;
+}
+
+static void cacheMethod(InlineCache* cache, ObjClass* klass, ObjClosure* method) {
+  if (cache == NULL || klass->fieldShadowsMethod) return;
+  CacheEntry* entry = NULL;
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].klass == klass) entry = &cache->entries[i]; // Stale
+  }
+  if (entry == NULL) {
+    if (cache->count == INLINE_CACHE_ENTRIES) return; // Megamorphic site
+    entry = &cache->entries[cache->count++];
+  }
+  entry->klass = klass;
+  entry->version = klass->version;
+  entry->method = method;
+}
+
+
+static bool getFieldCached(VM* vm, ObjInstance* instance, ObjString* name, InlineCache* cache, Value* value) {
+  if (instance->shape == NULL) return getField(vm, instance, name, value);
+
+  int slot = shapeFindSlot(vm, instance->shape, name);
+  if (slot < 0) return false;
+  cache->shape = instance->shape;
+  cache->transition = NULL;
+  cache->slot = slot;
+  *value = instance->fields[slot];
+  return true;
+}
+
+static void setFieldCached(VM* vm, ObjInstance* instance, ObjString* name, Value value, InlineCache* cache) {
+  Shape* before = instance->shape;
+  setField(vm, instance, name, value);
+  Shape* after = instance->shape;
+  if (before == NULL || after == NULL) return; // Dictionary mode
+
+  cache->shape = before;
+  if (after == before) {
+    cache->transition = NULL;
+    cache->slot = shapeFindSlot(vm, after, name);
+  } else {
+    cache->transition = after;
+    cache->slot = after->slotCount - 1;
+  }
+}
+
+
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount, InlineCache* cache) {
   Value method;
   if (!tableGet(vm, &klass->methods, name, &method)) {
     runtimeError(vm, "%s has no '%s'.", &klass->name->chars, name->chars);
     return false;
   }
 
+  cacheMethod(cache, klass, AS_CLOSURE(method));
   return call(vm, AS_CLOSURE(method), argCount);
 }
 
 
-static bool invoke(VM* vm, ObjString* name, int argCount) {
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
   Value receiver = peek(vm, argCount); // Stack slot zero
   //printf("vm:invoke() name=%s receiver=", name->chars);
   //printValue(receiver);
@@ -484,25 +937,29 @@ static bool invoke(VM* vm, ObjString* name, int argCount) {
 
   ObjInstance* instance = AS_INSTANCE(receiver);
 
+  ObjClosure* cached = cacheLookup(cache, instance->klass);
+  if (cached != NULL) return call(vm, cached, argCount);
+
   // Fields have precedence over methods, and a field may contain a plain function
   Value value;
-  if (tableGet(vm, &instance->fields, name, &value)) {
+  if (getField(vm, instance, name, &value)) {
     vm->stackTop[-argCount - 1] = value;
     return callValue(vm, value, argCount);
   }
 
   // Invoke as method
-  return invokeFromClass(vm, instance->klass, name, argCount);
+  return invokeFromClass(vm, instance->klass, name, argCount, cache);
 }
 
 
 
-static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name, InlineCache* cache) {
   Value method;
   if (!tableGet(vm, &klass->methods, name, &method)) {
     runtimeError(vm, "%s has no '%s'.", &klass->name->chars, name->chars);
     return false;
   }
+  cacheMethod(cache, klass, AS_CLOSURE(method));
 
   ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
   pop(vm);
@@ -548,10 +1005,11 @@ static void defineMethod(VM* vm, ObjString* name) {
   Value method = peek(vm, 0);
   ObjClass* klass = AS_CLASS(peek(vm, 1));
   tableSet(vm, &klass->methods, name, method);
+  klass->version++;
   pop(vm);
 }
 
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
   return IS_NULL(value) || // NULL is falsey
         (IS_BOOL(value) && !AS_BOOL(value)) || // FALSE is falsey
         (IS_NUMBER(value) && AS_NUMBER(value) == 0) || // The number 0 is falsey
@@ -609,7 +1067,7 @@ static bool arrayGetIndex(VM* vm) {
     return false;
   }
 
-  int index = (int) AS_NUMBER(pop(vm));
+  int64_t index = valueToInt(pop(vm));
   ObjArray* array = AS_ARRAY(pop(vm));
 
   if (index < 0 || index >= array->length ) {
@@ -633,7 +1091,7 @@ static bool arraySetIndex(VM* vm) {
     return false;
   }
 
-  int index = (int) AS_NUMBER(pop(vm));
+  int64_t index = valueToInt(pop(vm));
   ObjArray* array = AS_ARRAY(peek(vm, 0)); // Destination array is now on top of the stack
 
   if (index < 0 || index >= array->length ) {
@@ -770,6 +1228,11 @@ static void concatenateArrays(VM* vm) {
 VM* initVM() {
   VM* vm = malloc(sizeof(VM));
 
+  vm->frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  vm->frameCapacity = FRAMES_INITIAL;
+  vm->stack = malloc(sizeof(Value) * STACK_INITIAL);
+  vm->stackCapacity = STACK_INITIAL;
+  set_stack_limits(vm, DEFAULT_FRAMES_MAX, DEFAULT_STACK_MAX);
   resetStack(vm);
   vm->objects = NULL;
   vm->bytesAllocated = 0;
@@ -777,15 +1240,29 @@ VM* initVM() {
 
   vm->sleep = 0;
   vm->yield = false;
+  atomic_init(&vm->interrupt, 0);
+  vm->interruptReason = 0;
   set_error_callback(vm, NULL);
+  set_timeslice(vm, DEFAULT_TIMESLICE_USEC);
+  set_tick_budget(vm, 0);
+  vm->optimize = OPTIMIZE_FLOW;
+  set_jit(vm, 0);
+  vm->aotModule = NULL;
+  vm->cacheDirectory = NULL;
+  vm->instructions = 0;
 
   // GC graystack
   vm->grayCount = 0;
   vm->grayCapacity = 0;
   vm->grayStack = NULL;
 
-  initTable(&vm->globals);
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globals);
+  initValueArray(&vm->globalNames);
   initTable(&vm->strings);
+  initTable(&vm->arrayMethods);
+  initTable(&vm->stringMethods);
+  initTable(&vm->numberMethods);
 
   initValueArray(&vm->filenames); // Experimental include support
 
@@ -796,21 +1273,36 @@ VM* initVM() {
   vm->initString = NULL;
   vm->initString = copyString(vm, "init", 4);
 
-  defineNative(vm, "clock", clockNative);
-  defineNative(vm, "sleep", sleepNative);
+  defineArrayMethods(vm, &vm->arrayMethods);
+  defineStringMethods(vm, &vm->stringMethods);
+  defineNumberMethods(vm, &vm->numberMethods);
+
+  defineNativeUnboxed(vm, "clock", (NativeUnboxedFn){ .n0 = clockNative }, ">n");
+  defineNativeTyped(vm, "sleep", sleepNative, "n>n");
 
   return vm;
 }
 
 
-bool op_divide(VM* vm) {
+static bool op_subtract(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Operands must be numbers.");
     return false;
   }
-  double b = AS_NUMBER(pop(vm));
-  double a = AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL(a / b));
+  Value b = pop(vm);
+  Value a = pop(vm);
+  push(vm, subtractNumbers(a, b));
+  return true;
+}
+
+static bool op_divide(VM* vm) {
+  if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+    runtimeError(vm, "Operands must be numbers.");
+    return false;
+  }
+  Value b = pop(vm);
+  Value a = pop(vm);
+  push(vm, divideNumbers(a, b));
   if (isinf(AS_NUMBER(peek(vm, 0)))) {
     runtimeError(vm, "Division by zero.");
     return false;
@@ -818,15 +1310,15 @@ bool op_divide(VM* vm) {
   return true;
 }
 
-bool op_multiply(VM* vm) {
+static bool op_multiply(VM* vm) {
   // Multiplication may mean different things depending on value types
   //printf("vm:op_multiply()\n");
   if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
     //printf("vm:op_multiply() both operands are numbers\n");
     // NUMBER * NUMBER = simple multiplication
-    double b = AS_NUMBER(pop(vm));
-    double a = AS_NUMBER(pop(vm));
-    push(vm, NUMBER_VAL(a * b));
+    Value b = pop(vm);
+    Value a = pop(vm);
+    push(vm, multiplyNumbers(a, b));
     return true;
   }
 
@@ -868,15 +1360,15 @@ bool op_multiply(VM* vm) {
   return true;
 }
 
-bool op_add(VM* vm) {
+static bool op_add(VM* vm) {
   if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
     concatenateStrings(vm);
   } else if (IS_ARRAY(peek(vm, 0)) && IS_ARRAY(peek(vm, 1))) {
     concatenateArrays(vm);
   } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-    double b = AS_NUMBER(pop(vm));
-    double a = AS_NUMBER(pop(vm));
-    push(vm, NUMBER_VAL(a + b));
+    Value b = pop(vm);
+    Value a = pop(vm);
+    push(vm, addNumbers(a, b));
   } else {
     runtimeError(vm, "Operand types can not be added.");
     return false;
@@ -885,22 +1377,27 @@ bool op_add(VM* vm) {
 }
 
 
-bool op_modulo(VM* vm) {
+static bool op_modulo(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Operand must be a number.");
     return false;
   }
-  int b = (int) AS_NUMBER(pop(vm));
-  int a = (int) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL(a % b));
+  int64_t b = valueToInt(peek(vm, 0));
+  int64_t a = valueToInt(peek(vm, 1));
+  if (b == 0) {
+    runtimeError(vm, "Division by zero.");
+    return false;
+  }
+  pop(vm);
+  pop(vm);
+  push(vm, moduloInts(a, b));
   return true;
 }
 
 
-bool op_inc(VM* vm) {
+static bool op_inc(VM* vm) {
   if (IS_NUMBER(peek(vm, 0))) {
-    double a = AS_NUMBER(pop(vm));
-    push(vm, NUMBER_VAL(a + 1));
+    push(vm, addNumbers(pop(vm), INT_VAL(1)));
   } else {
     runtimeError(vm, "Can only increment numbers.");
     return false;
@@ -909,10 +1406,9 @@ bool op_inc(VM* vm) {
 }
 
 
-bool op_dec(VM* vm) {
+static bool op_dec(VM* vm) {
   if (IS_NUMBER(peek(vm, 0))) {
-    double a = AS_NUMBER(pop(vm));
-    push(vm, NUMBER_VAL(a - 1));
+    push(vm, subtractNumbers(pop(vm), INT_VAL(1)));
   } else {
     runtimeError(vm, "Can only decrement numbers.");
     return false;
@@ -921,9 +1417,9 @@ bool op_dec(VM* vm) {
 }
 
 
-bool op_negate(VM* vm) {
+static bool op_negate(VM* vm) {
   if (IS_NUMBER(peek(vm, 0))) {
-    push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+    push(vm, negateNumber(pop(vm)));
   } else if(IS_BOOL(peek(vm, 0))) {
     push(vm, BOOL_VAL(!AS_BOOL(pop(vm))));
   } else {
@@ -934,128 +1430,148 @@ bool op_negate(VM* vm) {
 }
 
 
-bool op_bin_not(VM* vm) {
+static bool op_bin_not(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0))) {
     runtimeError(vm, "Operand must be a number.");
     return false;
   }
-  uint32_t a = (uint32_t) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL((double) (~a)));
+  int64_t a = valueToInt(pop(vm));
+  push(vm, INT_VAL(~a));
   return true;
 }
 
 
-bool op_bin_shiftl(VM* vm) {
+static bool op_bin_shiftl(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Both operands must be numbers.");
     return false;
   }
-  uint32_t b = (uint32_t) AS_NUMBER(pop(vm));
-  uint32_t a = (uint32_t) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL((double) (a << b)));
+  int64_t b = valueToInt(pop(vm));
+  int64_t a = valueToInt(pop(vm));
+  push(vm, shiftLeftInts(a, b));
   return true;
 }
 
 
-bool op_bin_shiftr(VM* vm) {
+static bool op_bin_shiftr(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Both operands must be numbers.");
     return false;
   }
-  uint32_t b = (uint32_t) AS_NUMBER(pop(vm));
-  uint32_t a = (uint32_t) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL((double) (a >> b)));
+  int64_t b = valueToInt(pop(vm));
+  int64_t a = valueToInt(pop(vm));
+  push(vm, shiftRightInts(a, b));
   return true;
 }
 
 
-bool op_bin_and(VM* vm) {
+static bool op_bin_and(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Both operands must be numbers.");
     return false;
   }
-  uint32_t b = (uint32_t) AS_NUMBER(pop(vm));
-  uint32_t a = (uint32_t) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL((double) (a & b)));
+  int64_t b = valueToInt(pop(vm));
+  int64_t a = valueToInt(pop(vm));
+  push(vm, INT_VAL(a & b));
   return true;
 }
 
-bool op_bin_or(VM* vm) {
+static bool op_bin_or(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Both operands must be numbers.");
     return false;
   }
-  uint32_t b = (uint32_t) AS_NUMBER(pop(vm));
-  uint32_t a = (uint32_t) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL((double) (a | b)));
+  int64_t b = valueToInt(pop(vm));
+  int64_t a = valueToInt(pop(vm));
+  push(vm, INT_VAL(a | b));
   return true;
 }
 
-bool op_bin_xor(VM* vm) {
+static bool op_bin_xor(VM* vm) {
   if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
     runtimeError(vm, "Both operands must be numbers.");
     return false;
   }
-  uint32_t b = (uint32_t) AS_NUMBER(pop(vm));
-  uint32_t a = (uint32_t) AS_NUMBER(pop(vm));
-  push(vm, NUMBER_VAL((double) (a ^ b)));
+  int64_t b = valueToInt(pop(vm));
+  int64_t a = valueToInt(pop(vm));
+  push(vm, INT_VAL(a ^ b));
   return true;
 }
 
 
-bool op_equal(VM* vm) {
+static bool op_greater(VM* vm) {
   Value b = pop(vm);
   Value a = pop(vm);
-  push(vm, BOOL_VAL(valuesEqual(a, b)));
+  push(vm, BOOL_VAL(valuesGreater(a, b)));
   return true;
 }
 
-bool op_nequal(VM* vm) {
+static bool op_gequal(VM* vm) {
   Value b = pop(vm);
   Value a = pop(vm);
-  push(vm, BOOL_VAL(!valuesEqual(a, b)));
+  push(vm, BOOL_VAL(valuesEqual(b, a) || valuesGreater(a, b)));
   return true;
 }
 
-bool op_greater(VM* vm) {
+static bool op_equal(VM* vm) {
   Value b = pop(vm);
   Value a = pop(vm);
-  push(vm, BOOL_VAL(valuesGreater(a, b)));
+  push(vm, BOOL_VAL(valuesEqual(a, b)));
   return true;
 }
 
-bool op_gequal(VM* vm) {
+static bool op_nequal(VM* vm) {
   Value b = pop(vm);
   Value a = pop(vm);
-  push(vm, BOOL_VAL(valuesEqual(b, a) || valuesGreater(a, b)));
+  push(vm, BOOL_VAL(!valuesEqual(a, b)));
   return true;
 }
 
-bool op_less(VM* vm) {
+static bool op_less(VM* vm) {
   Value b = pop(vm);
   Value a = pop(vm);
   push(vm, BOOL_VAL(valuesGreater(b, a))); // Note: reverse
   return true;
 }
 
-bool op_lequal(VM* vm) {
+static bool op_lequal(VM* vm) {
   Value b = pop(vm);
   Value a = pop(vm);
   push(vm, BOOL_VAL(valuesEqual(b, a) || valuesGreater(b, a))); // Note: reverse
   return true;
 }
 
-bool op_not(VM* vm) {
-  push(vm, BOOL_VAL(isFalsey(pop(vm))));
-  return true;
-}
-
 InterpretResult run(VM* vm) {
-  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+  // The hot VM state lives in local variables so the C compiler can keep it
+  // in registers. frame->ip and vm->stackTop are only written back with
+  // SAVE_STATE() before anything that needs them: calls, allocations that
+  // may trigger the garbage collector, errors and leaving run().
+  CallFrame* frame;
+  uint8_t* ip;
+  Value* sp;
+  Value* slots;
+
+#define SAVE_STATE() \
+    do { \
+      frame->ip = ip; \
+      vm->stackTop = sp; \
+    } while (false)
+
+#define LOAD_STATE() \
+    do { \
+      frame = &vm->frames[vm->frameCount - 1]; \
+      ip = frame->ip; \
+      slots = frame->slots; \
+      sp = vm->stackTop; \
+    } while (false)
 
-#define READ_BYTE() (*frame->ip++)
+#define PUSH(value) (*sp++ = (value))
+#define POP()       (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 //#define READ_CONSTANT()
 //    (frame->closure->function->chunk.constants.values[READ_BYTE()])
@@ -1063,355 +1579,963 @@ InterpretResult run(VM* vm) {
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_SHORT()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() \
+    (&frame->closure->function->caches[READ_SHORT()])
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      SAVE_STATE(); \
+      runtimeError(vm, __VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 
+// Call a helper function that works on vm->stackTop
 #define CALL_OP(function) \
     do { \
+      SAVE_STATE(); \
       if (function(vm) == false) return INTERPRET_RUNTIME_ERROR; \
+      sp = vm->stackTop; \
     } while (false)
 
-#define BINARY_OP(valueType, op) \
+// The operation is one of the number functions in value.h, or one of
+// the comparisons below, and takes two number Values
+#define NUMBERS_EQUAL(a, b)   BOOL_VAL(COMPARE_NUMBERS(a, ==, b))
+#define NUMBERS_NEQUAL(a, b)  BOOL_VAL(COMPARE_NUMBERS(a, !=, b))
+#define NUMBERS_GREATER(a, b) BOOL_VAL(COMPARE_NUMBERS(a, >, b))
+#define NUMBERS_GEQUAL(a, b)  BOOL_VAL(COMPARE_NUMBERS(a, >=, b))
+#define NUMBERS_LESS(a, b)    BOOL_VAL(COMPARE_NUMBERS(a, <, b))
+#define NUMBERS_LEQUAL(a, b)  BOOL_VAL(COMPARE_NUMBERS(a, <=, b))
+
+// Checking for two integers first keeps the integer fast path short
+#define ARE_NUMBERS(a, b) (ARE_INTS(a, b) || (IS_NUMBER(a) && IS_NUMBER(b)))
+
+#define BINARY_OP(operation) \
     do { \
-      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
-        runtimeError(vm, "Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
       \
-      double b = AS_NUMBER(pop(vm)); \
-      double a = AS_NUMBER(pop(vm)); \
-      push(vm, valueType(a op b)); \
+      Value b = POP(); \
+      sp[-1] = operation(sp[-1], b); \
+    } while (false)
+
+// Fast path for NUMBER op NUMBER, anything else is handled by function()
+#define NUMBER_OP(operation, function) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (LIKELY(ARE_NUMBERS(a, b))) { \
+        sp--; \
+        sp[-1] = operation(a, b); \
+      } else { \
+        CALL_OP(function); \
+      } \
+    } while (false)
+
+// Quickening: the first time a generic arithmetic or comparison op sees
+// two numbers, it rewrites itself in place to its number-only variant.
+// The variant deoptimizes, i.e. rewrites itself back to the generic op,
+// as soon as it sees anything else, so a site is never stuck on a guard
+// that keeps failing. Code shared by VMs (see program.c) is never
+// written, so there the generic op stays.
+#define QUICKEN(offset, quickOp) \
+    do { \
+      if (frame->closure->function->program == NULL) ip[offset] = (quickOp); \
+    } while (false)
+
+#define QUICKEN_OP(operation, function, quickOp) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (LIKELY(ARE_NUMBERS(a, b))) { \
+        QUICKEN(-1, quickOp); \
+        sp--; \
+        sp[-1] = operation(a, b); \
+      } else { \
+        CALL_OP(function); \
+      } \
+    } while (false)
+
+// Fast path for INT op INT, used by the bitwise operators
+#define INTS_AND(a, b) INT_VAL((a) & (b))
+#define INTS_OR(a, b)  INT_VAL((a) | (b))
+#define INTS_XOR(a, b) INT_VAL((a) ^ (b))
+
+#define INT_OP(operation, function) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (LIKELY(ARE_INTS(a, b))) { \
+        sp--; \
+        sp[-1] = operation(AS_INT(a), AS_INT(b)); \
+      } else { \
+        CALL_OP(function); \
+      } \
+    } while (false)
+
+// Register instructions: a is a slot, b is given as operand, the result
+// goes to the slot in the last operand. Anything but two numbers is left
+// to the stack op, on copies of the operands pushed for it.
+#define REGISTER_OP(operand, operation, function) \
+    do { \
+      Value a = slots[READ_SHORT()]; \
+      Value b = (operand); \
+      uint16_t result = READ_SHORT(); \
+      if (LIKELY(ARE_NUMBERS(a, b))) { \
+        slots[result] = operation(a, b); \
+      } else { \
+        PUSH(a); \
+        PUSH(b); \
+        CALL_OP(function); \
+        slots[result] = POP(); \
+      } \
+    } while (false)
+
+#define QUICK_OP(operation, function, genericOp) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (LIKELY(ARE_NUMBERS(a, b))) { \
+        sp--; \
+        sp[-1] = operation(a, b); \
+      } else { \
+        ip[-1] = (genericOp); \
+        CALL_OP(function); \
+      } \
     } while (false)
 
 
+  if (atomic_load_explicit(&vm->interrupt, memory_order_relaxed) != 0) return takeInterrupt(vm);
+
+  // Still sleeping?
+  if (vm->sleep > 0) {
+    if (now() < vm->sleep) return INTERPRET_SLEEPING;
+    vm->sleep = 0;
+  }
+
   // Timeslice start
-  double start = now();
-  double end;
+  beginTimeslice(vm);
 
   vm->yield = false; // Reset flag
 
+  LOAD_STATE();
 
-  // Main loop
-  // Replace with iterator or timed loop for cooperative execution?
-  for (;;) {
+  // Work done before every instruction: sanity check and tracing
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    do { \
+      printf("        |    |    | "); \
+      for (Value* slot = vm->stack; slot < sp; slot++) { \
+        if (IS_STRING(*slot)) { \
+          printf("[\""); \
+          printValue(*slot); \
+          printf("\"]"); \
+        } else { \
+          printf("["); \
+          printValue(*slot); \
+          printf("]"); \
+        } \
+      } \
+      printf("\n"); \
+      disassembleInstruction(&frame->closure->function->chunk, \
+          (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#elif defined(DEBUG_COUNT_INSTRUCTIONS)
+#define TRACE_EXECUTION() (vm->instructions++)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
 
+#ifdef DEBUG
+#define CHECK_NUMBER() \
+    do { \
+      if (sp > vm->stack && IS_NUMBER(PEEK(0)) && isinf(AS_NUMBER(PEEK(0)))) { \
+        RUNTIME_ERROR("Invalid number value."); \
+      } \
+    } while (false)
+#else
+#define CHECK_NUMBER() do {} while (false)
+#endif
 
-    // Timeslice end?
-    end = now();
-    int delta_ms = (int) (1000.0 * (end - start));
-    //printf("t=%d\n", delta_ms);
-    if (delta_ms >= 10 || end < vm->sleep || vm->yield == true) return INTERPRET_RUNNING;
+// Count one tick against the timeslice, or stop here if the VM was
+// interrupted. The VM state is saved first so run() can simply be called
+// again to resume. The fuel is atomic only for vm_interrupt(), relaxed
+// loads and stores are plain moves.
+#define TICK() \
+    do { \
+      int left = atomic_load_explicit(&vm->fuel, memory_order_relaxed) - 1; \
+      atomic_store_explicit(&vm->fuel, left, memory_order_relaxed); \
+      if (left <= 0 && timesliceExpired(vm)) { \
+        SAVE_STATE(); \
+        return yieldResult(vm); \
+      } \
+    } while (false)
 
+#ifdef JIT
+// Count a tick against the current function, compile it once it is hot,
+// and run it as native code from ip. The native code returns at the first
+// instruction it doesn't handle, which run() then executes, see jit.c.
+#define JIT_ENTER() \
+    do { \
+      ObjFunction* function = frame->closure->function; \
+      if (function->jit == NULL) { \
+        if (vm->jitThreshold <= 0 || ++function->hotness < vm->jitThreshold) break; \
+        if (!compileJit(vm, function)) break; \
+      } \
+      SAVE_STATE(); \
+      if (runJit(vm, frame) == JIT_YIELD) return yieldResult(vm); \
+      LOAD_STATE(); \
+    } while (false)
+#else
+#define JIT_ENTER() do {} while (false)
+#endif
 
+// Run the current function as compiled C from ip if it has any, see aot.c,
+// else try the JIT
+#define NATIVE_ENTER() \
+    do { \
+      if (frame->closure->function->aot == NULL) { \
+        JIT_ENTER(); \
+        break; \
+      } \
+      SAVE_STATE(); \
+      if (runAot(vm, frame)) return yieldResult(vm); \
+      LOAD_STATE(); \
+    } while (false)
 
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("        |    |    | ");
-    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
-      if (IS_STRING(*slot)) {
-        printf("[\"");
-        printValue(*slot);
-        printf("\"]");
-      } else {
-        printf("[");
-        printValue(*slot);
-        printf("]");
-      }
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+  // With COMPUTED_GOTO every instruction handler ends with its own indirect
+  // jump to the next handler, which gives the branch predictor one jump per
+  // opcode to learn instead of the single shared jump of the switch.
+  // Without it, DISPATCH() simply returns to the top of the loop.
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    [OP_CONSTANT]      = &&op_OP_CONSTANT,
+    [OP_NULL]          = &&op_OP_NULL,
+    [OP_TRUE]          = &&op_OP_TRUE,
+    [OP_FALSE]         = &&op_OP_FALSE,
+    [OP_POP]           = &&op_OP_POP,
+    [OP_POPN]          = &&op_OP_POPN,
+    [OP_DUP]           = &&op_OP_DUP,
+    [OP_GET_LOCAL]     = &&op_OP_GET_LOCAL,
+    [OP_SET_LOCAL]     = &&op_OP_SET_LOCAL,
+    [OP_GET_GLOBAL]    = &&op_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL]    = &&op_OP_SET_GLOBAL,
+    [OP_MAKE_ARRAY]    = &&op_OP_MAKE_ARRAY,
+    [OP_GET_INDEX]     = &&op_OP_GET_INDEX,
+    [OP_SET_INDEX]     = &&op_OP_SET_INDEX,
+    [OP_GET_SLICE]     = &&op_OP_GET_SLICE,
+    [OP_SET_SLICE]     = &&op_OP_SET_SLICE,
+    [OP_GET_UPVALUE]   = &&op_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE]   = &&op_OP_SET_UPVALUE,
+    [OP_GET_PROPERTY]  = &&op_OP_GET_PROPERTY,
+    [OP_SET_PROPERTY]  = &&op_OP_SET_PROPERTY,
+    [OP_GET_SUPER]     = &&op_OP_GET_SUPER,
+    [OP_EQUAL]         = &&op_OP_EQUAL,
+    [OP_NEQUAL]        = &&op_OP_NEQUAL,
+    [OP_GREATER]       = &&op_OP_GREATER,
+    [OP_GEQUAL]        = &&op_OP_GEQUAL,
+    [OP_INC]           = &&op_OP_INC,
+    [OP_DEC]           = &&op_OP_DEC,
+    [OP_LESS]          = &&op_OP_LESS,
+    [OP_LEQUAL]        = &&op_OP_LEQUAL,
+    [OP_ADD]           = &&op_OP_ADD,
+    [OP_SUBTRACT]      = &&op_OP_SUBTRACT,
+    [OP_MULTIPLY]      = &&op_OP_MULTIPLY,
+    [OP_DIVIDE]        = &&op_OP_DIVIDE,
+    [OP_MODULO]        = &&op_OP_MODULO,
+    [OP_NOT]           = &&op_OP_NOT,
+    [OP_NEGATE]        = &&op_OP_NEGATE,
+    [OP_BIN_NOT]       = &&op_OP_BIN_NOT,
+    [OP_BIN_SHIFTL]    = &&op_OP_BIN_SHIFTL,
+    [OP_BIN_SHIFTR]    = &&op_OP_BIN_SHIFTR,
+    [OP_BIN_AND]       = &&op_OP_BIN_AND,
+    [OP_BIN_OR]        = &&op_OP_BIN_OR,
+    [OP_BIN_XOR]       = &&op_OP_BIN_XOR,
+    [OP_PRINT]         = &&op_OP_PRINT,
+    [OP_JUMP]          = &&op_OP_JUMP,
+    [OP_PJMP_IF_FALSE] = &&op_OP_PJMP_IF_FALSE,
+    [OP_QJMP_IF_FALSE] = &&op_OP_QJMP_IF_FALSE,
+    [OP_LOOP]          = &&op_OP_LOOP,
+    [OP_SWITCH_TABLE]  = &&op_OP_SWITCH_TABLE,
+    [OP_CALL]          = &&op_OP_CALL,
+    [OP_TAIL_CALL]     = &&op_OP_TAIL_CALL,
+    [OP_INVOKE]        = &&op_OP_INVOKE,
+    [OP_SUPER_INVOKE]  = &&op_OP_SUPER_INVOKE,
+    [OP_CLOSURE]       = &&op_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+    [OP_RETURN]        = &&op_OP_RETURN,
+    [OP_EXIT]          = &&op_OP_EXIT,
+    [OP_CLASS]         = &&op_OP_CLASS,
+    [OP_INHERIT]       = &&op_OP_INHERIT,
+    [OP_METHOD]        = &&op_OP_METHOD,
+    // Superinstructions
+    [OP_ADD_LOCALS]           = &&op_OP_ADD_LOCALS,
+    [OP_ADD_LOCAL_CONST]      = &&op_OP_ADD_LOCAL_CONST,
+    [OP_SUB_LOCAL_CONST]      = &&op_OP_SUB_LOCAL_CONST,
+    [OP_LESS_LOCAL_CONST_JMP] = &&op_OP_LESS_LOCAL_CONST_JMP,
+    [OP_INC_LOCAL]            = &&op_OP_INC_LOCAL,
+    [OP_DEC_LOCAL]            = &&op_OP_DEC_LOCAL,
+    [OP_SET_LOCAL_POP]        = &&op_OP_SET_LOCAL_POP,
+    [OP_MOVE]                 = &&op_OP_MOVE,
+    [OP_LOAD_CONST]           = &&op_OP_LOAD_CONST,
+    [OP_ADD_RR]               = &&op_OP_ADD_RR,
+    [OP_SUB_RR]               = &&op_OP_SUB_RR,
+    [OP_MUL_RR]               = &&op_OP_MUL_RR,
+    [OP_ADD_RK]               = &&op_OP_ADD_RK,
+    [OP_SUB_RK]               = &&op_OP_SUB_RK,
+    [OP_MUL_RK]               = &&op_OP_MUL_RK,
+    // Quickened instructions
+    [OP_EQUAL_NUM]            = &&op_OP_EQUAL_NUM,
+    [OP_NEQUAL_NUM]           = &&op_OP_NEQUAL_NUM,
+    [OP_GREATER_NUM]          = &&op_OP_GREATER_NUM,
+    [OP_GEQUAL_NUM]           = &&op_OP_GEQUAL_NUM,
+    [OP_LESS_NUM]             = &&op_OP_LESS_NUM,
+    [OP_LEQUAL_NUM]           = &&op_OP_LEQUAL_NUM,
+    [OP_ADD_NUM]              = &&op_OP_ADD_NUM,
+    [OP_SUBTRACT_NUM]         = &&op_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]         = &&op_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]           = &&op_OP_DIVIDE_NUM,
+    [OP_CALL_NATIVE]          = &&op_OP_CALL_NATIVE,
+  };
+
+#define CASE(opcode) op_##opcode
+#define DISPATCH() \
+    do { \
+      CHECK_NUMBER(); \
+      TRACE_EXECUTION(); \
+      goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(opcode) case opcode
+#define DISPATCH() continue
 #endif
 
-    uint8_t instruction;
+  uint8_t instruction;
+
+  // Main loop
+  for (;;) {
+#ifdef COMPUTED_GOTO
+    TRACE_EXECUTION();
+    goto *dispatchTable[instruction = READ_BYTE()];
+#else
+    CHECK_NUMBER();
+    TRACE_EXECUTION();
     switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
+#endif
+      CASE(OP_CONSTANT): {
         Value constant = READ_CONSTANT();
-        push(vm, constant);
-        break;
+        PUSH(constant);
+        DISPATCH();
       }
-      case OP_NULL:     push(vm, NULL_VAL); break;
-      case OP_TRUE:     push(vm, BOOL_VAL(true)); break;
-      case OP_FALSE:    push(vm, BOOL_VAL(false)); break;
-      case OP_POP:      pop(vm); break;
-      case OP_POPN: {
+      CASE(OP_NULL):     PUSH(NULL_VAL); DISPATCH();
+      CASE(OP_TRUE):     PUSH(BOOL_VAL(true)); DISPATCH();
+      CASE(OP_FALSE):    PUSH(BOOL_VAL(false)); DISPATCH();
+      CASE(OP_POP):      sp--; DISPATCH();
+      CASE(OP_POPN): {
         uint8_t count = READ_BYTE(); // Number of values to pop
-        while (count>0) { pop(vm); count--; }
-        break;
+        sp -= count;
+        DISPATCH();
       }
-      case OP_GET_LOCAL: {
+      CASE(OP_GET_LOCAL): {
 //        uint8_t slot = READ_BYTE(); // Stack index from bottom
         uint16_t slot = READ_SHORT(); // Stack index from bottom
-        push(vm, frame->slots[slot]);
-        break;
+        PUSH(slots[slot]);
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      CASE(OP_SET_LOCAL): {
 //        uint8_t slot = READ_BYTE(); // Stack index from bottom
         uint16_t slot = READ_SHORT(); // Stack index from bottom
-        frame->slots[slot] = peek(vm, 0);
-        break;
+        slots[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING(); // constant name from the bytecode
-        Value value;
-        if (!tableGet(vm, &vm->globals, name, &value)) {
-          runtimeError(vm, "Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_GET_GLOBAL): {
+        uint16_t slot = READ_SHORT(); // Global index from the bytecode
+        Value value = vm->globals.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.", AS_STRING(vm->globalNames.values[slot])->chars);
         }
-        push(vm, value);
-        break;
+        PUSH(value);
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (tableSet(vm, &vm->globals, name, peek(vm, 0))) {
-          tableDelete(vm, &vm->globals, name);
-          runtimeError(vm, "Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_SET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm->globals.values[slot])) {
+          RUNTIME_ERROR("Undefined variable '%s'.", AS_STRING(vm->globalNames.values[slot])->chars);
         }
-        break;
+        vm->globals.values[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING(); // constant no. from the bytecode
-        tableSet(vm, &vm->globals, name, peek(vm, 0));
-        pop(vm); // Don't pop value until safely stored
-        break;
+      CASE(OP_DEFINE_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        vm->globals.values[slot] = POP();
+        DISPATCH();
       }
-      case OP_MAKE_ARRAY: { // EXPERIMENTAL
+      CASE(OP_MAKE_ARRAY): { // EXPERIMENTAL
         uint8_t length = READ_BYTE();
+        SAVE_STATE();
         makeArray(vm, length);
-        break;
+        sp = vm->stackTop;
+        DISPATCH();
       }
-      case OP_GET_INDEX: { // EXPERIMENTAL
-        if (arrayGetIndex(vm) == false) return INTERPRET_RUNTIME_ERROR;
-        break;
-      }
-      case OP_SET_INDEX: { // EXPERIMENTAL
-        if (arraySetIndex(vm) == false) return INTERPRET_RUNTIME_ERROR;
-        break;
-      }
-      case OP_GET_SLICE: { // EXPERIMENTAL
-        if (arrayGetSlice(vm) == false) return INTERPRET_RUNTIME_ERROR;
-        break;
+      CASE(OP_GET_INDEX): { // EXPERIMENTAL
+        Value index = sp[-1];
+        Value array = sp[-2];
+        if (LIKELY(IS_INT(index) && IS_ARRAY(array))) {
+          int64_t i = AS_INT(index);
+          if (i >= 0 && i < AS_ARRAY(array)->length) {
+            sp--;
+            sp[-1] = AS_ARRAY(array)->values[i];
+            DISPATCH();
+          }
+        }
+        CALL_OP(arrayGetIndex); // Also reports the errors
+        DISPATCH();
       }
-      case OP_SET_SLICE: { // EXPERIMENTAL
-        if (arraySetSlice(vm) == false) return INTERPRET_RUNTIME_ERROR;
-        break;
+      CASE(OP_SET_INDEX): { // EXPERIMENTAL
+        Value index = sp[-2];
+        Value array = sp[-3];
+        if (LIKELY(IS_INT(index) && IS_ARRAY(array))) {
+          int64_t i = AS_INT(index);
+          if (i >= 0 && i < AS_ARRAY(array)->length) {
+            AS_ARRAY(array)->values[i] = sp[-1];
+            sp -= 2;
+            DISPATCH();
+          }
+        }
+        CALL_OP(arraySetIndex);
+        DISPATCH();
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(vm, *frame->closure->upvalues[slot]->location);
-        break;
+      CASE(OP_GET_SLICE):  CALL_OP(arrayGetSlice); DISPATCH(); // EXPERIMENTAL
+      CASE(OP_SET_SLICE):  CALL_OP(arraySetSlice); DISPATCH(); // EXPERIMENTAL
+      CASE(OP_GET_UPVALUE): {
+        uint16_t slot = READ_SHORT(); // Word like the other variable operands, see namedVariable()
+        PUSH(*frame->closure->upvalues[slot]->location);
+        DISPATCH();
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(vm, 0);
-        break;
+      CASE(OP_SET_UPVALUE): {
+        uint16_t slot = READ_SHORT();
+        *frame->closure->upvalues[slot]->location = PEEK(0);
+        DISPATCH();
       }
-      case OP_GET_PROPERTY: {
+      CASE(OP_GET_PROPERTY): {
         ObjString* name = READ_STRING();
-        Value value = peek(vm, 0);
-        Value result;
+        InlineCache* cache = READ_CACHE();
+        Value value = PEEK(0);
 
         if (strncmp(name->chars, "type", name->length)==0) {
-          result = getTypeAsValue(vm, value);
-          pop(vm);
-          push(vm, result);
-          return true;
+          SAVE_STATE();
+          sp[-1] = getTypeAsValue(vm, value);
+          DISPATCH();
         }
 
         // Check built-in properties -- OP_INVOKE must do the same
-        if (IS_ARRAY(peek(vm, 0))) return pushArrayProperty(vm, value, name);
-        if (IS_NUMBER(peek(vm, 0))) return pushNumberProperty(vm, value, name);
-        if (IS_STRING(peek(vm, 0))) return pushStringProperty(vm, value, name);
+        if (IS_ARRAY(value) || IS_NUMBER(value) || IS_STRING(value)) {
+          bool found;
+          SAVE_STATE();
+          if (IS_ARRAY(value)) found = pushArrayProperty(vm, value, name);
+          else if (IS_NUMBER(value)) found = pushNumberProperty(vm, value, name);
+          else found = pushStringProperty(vm, value, name);
+          if (!found) return INTERPRET_RUNTIME_ERROR;
+          sp = vm->stackTop;
+          DISPATCH();
+        }
 
-        if (!IS_INSTANCE(peek(vm, 0))) {
-          runtimeError(vm, "Type %s has no properties.", getTypeAsString(value));
-          return INTERPRET_RUNTIME_ERROR;
+        if (!IS_INSTANCE(value)) {
+          RUNTIME_ERROR("Type %s has no properties.", getTypeAsString(value));
         }
         // If we get this far, the receiver should be an object
+        // A cached method means there is no field by that name
+        ObjInstance* instance = AS_INSTANCE(value);
+        ObjClosure* method = cacheLookup(cache, instance->klass);
+        if (method != NULL) {
+          SAVE_STATE();
+          ObjBoundMethod* bound = newBoundMethod(vm, PEEK(0), method);
+          sp[-1] = OBJ_VAL(bound); // Replace instance
+          DISPATCH();
+        }
         // Fields take precedence so check those first
-        ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
-        if (tableGet(vm, &instance->fields, name, &value)) {
-          pop(vm); // Instance.
-          push(vm, value);
-          break;
+        if (instance->shape == cache->shape && instance->shape != NULL) {
+          sp[-1] = instance->fields[cache->slot]; // Replace instance
+          DISPATCH();
+        }
+        if (getFieldCached(vm, instance, name, cache, &value)) {
+          sp[-1] = value; // Replace instance
+          DISPATCH();
         }
         // Next, check if name refers to a method
-        if (!bindMethod(vm, instance->klass, name)) {
+        SAVE_STATE();
+        if (!bindMethod(vm, instance->klass, name, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        sp = vm->stackTop;
+        DISPATCH();
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(vm, 1))) {
-          runtimeError(vm, "Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_SET_PROPERTY): {
+        if (!IS_INSTANCE(PEEK(1))) {
+          RUNTIME_ERROR("Only instances have fields.");
         }
-        ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
-        tableSet(vm, &instance->fields, READ_STRING(), peek(vm, 0));
-        Value value = pop(vm);
-        pop(vm); // Instance
-        push(vm, value);
-        break;
+        ObjInstance* instance = AS_INSTANCE(PEEK(1));
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+        Shape* shape = instance->shape;
+        if (shape == cache->shape && shape != NULL &&
+            cache->slot < instance->capacity) {
+          instance->fields[cache->slot] = PEEK(0);
+          if (cache->transition != NULL) instance->shape = cache->transition;
+        } else {
+          SAVE_STATE();
+          setFieldCached(vm, instance, name, PEEK(0), cache);
+        }
+        Value value = POP();
+        sp[-1] = value; // Replace instance
+        DISPATCH();
       }
-      case OP_GET_SUPER: {
+      CASE(OP_GET_SUPER): {
         ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(pop(vm));
-        if (!bindMethod(vm, superclass, name)) {
+        ObjClass* superclass = AS_CLASS(POP());
+        SAVE_STATE();
+        if (!bindMethod(vm, superclass, name, NULL)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        sp = vm->stackTop;
+        DISPATCH();
+      }
+      CASE(OP_EQUAL): {
+        Value b = POP();
+        if (IS_NUMBER(sp[-1]) && IS_NUMBER(b)) QUICKEN(-1, OP_EQUAL_NUM);
+        sp[-1] = BOOL_VAL(valuesEqual(sp[-1], b));
+        DISPATCH();
+      }
+      CASE(OP_NEQUAL): {
+        Value b = POP();
+        if (IS_NUMBER(sp[-1]) && IS_NUMBER(b)) QUICKEN(-1, OP_NEQUAL_NUM);
+        sp[-1] = BOOL_VAL(!valuesEqual(sp[-1], b));
+        DISPATCH();
+      }
+      CASE(OP_GREATER):  QUICKEN_OP(NUMBERS_GREATER, op_greater, OP_GREATER_NUM); DISPATCH();
+      CASE(OP_GEQUAL):   QUICKEN_OP(NUMBERS_GEQUAL, op_gequal, OP_GEQUAL_NUM); DISPATCH();
+      CASE(OP_LESS):     QUICKEN_OP(NUMBERS_LESS, op_less, OP_LESS_NUM); DISPATCH();
+      CASE(OP_LEQUAL):   QUICKEN_OP(NUMBERS_LEQUAL, op_lequal, OP_LEQUAL_NUM); DISPATCH();
+      CASE(OP_DUP): {
+        Value value = PEEK(0);
+        PUSH(value);
+        DISPATCH();
+      }
+      CASE(OP_INC): {
+        Value a = sp[-1];
+        if (LIKELY(IS_INT(a) || IS_NUMBER(a))) {
+          sp[-1] = addNumbers(a, INT_VAL(1));
+        } else {
+          CALL_OP(op_inc);
+        }
+        DISPATCH();
+      }
+      CASE(OP_DEC): {
+        Value a = sp[-1];
+        if (LIKELY(IS_INT(a) || IS_NUMBER(a))) {
+          sp[-1] = subtractNumbers(a, INT_VAL(1));
+        } else {
+          CALL_OP(op_dec);
+        }
+        DISPATCH();
+      }
+      CASE(OP_ADD):        QUICKEN_OP(addNumbers, op_add, OP_ADD_NUM); DISPATCH();
+      CASE(OP_SUBTRACT):   QUICKEN_OP(subtractNumbers, op_subtract, OP_SUBTRACT_NUM); DISPATCH();
+      CASE(OP_MULTIPLY):   QUICKEN_OP(multiplyNumbers, op_multiply, OP_MULTIPLY_NUM); DISPATCH();
+      CASE(OP_DIVIDE): {
+        if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) QUICKEN(-1, OP_DIVIDE_NUM);
+        CALL_OP(op_divide);
+        DISPATCH();
+      }
+      CASE(OP_MODULO): {
+        Value b = sp[-1];
+        Value a = sp[-2];
+        if (LIKELY(ARE_INTS(a, b)) && AS_INT(b) != 0) {
+          sp--;
+          sp[-1] = moduloInts(AS_INT(a), AS_INT(b));
+        } else {
+          CALL_OP(op_modulo);
+        }
+        DISPATCH();
       }
-      case OP_EQUAL:      CALL_OP(op_equal); break;
-      case OP_NEQUAL:     CALL_OP(op_nequal); break;
-      case OP_GREATER:    CALL_OP(op_greater); break;
-      case OP_GEQUAL:     CALL_OP(op_gequal); break;
-      case OP_LESS:       CALL_OP(op_less); break;
-      case OP_LEQUAL:     CALL_OP(op_lequal); break;
-      case OP_DUP:        push(vm, peek(vm, 0)); break;
-      case OP_INC:        CALL_OP(op_inc); break;
-      case OP_DEC:        CALL_OP(op_dec); break;
-      case OP_ADD:        CALL_OP(op_add); break;
-      case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY:   CALL_OP(op_multiply); break;
-      case OP_DIVIDE:     CALL_OP(op_divide); break;
-      case OP_MODULO:     CALL_OP(op_modulo); break;
-      case OP_NOT:        CALL_OP(op_not); break;
-      case OP_NEGATE:     CALL_OP(op_negate); break;
-      case OP_BIN_NOT:    CALL_OP(op_bin_not); break;
-      case OP_BIN_SHIFTL: CALL_OP(op_bin_shiftl); break;
-      case OP_BIN_SHIFTR: CALL_OP(op_bin_shiftr); break;
-      case OP_BIN_AND:    CALL_OP(op_bin_and); break;
-      case OP_BIN_OR:     CALL_OP(op_bin_or); break;
-      case OP_BIN_XOR:    CALL_OP(op_bin_xor); break;
-      case OP_PRINT: {
-        printValue(pop(vm));
+      CASE(OP_NOT):
+        sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+        DISPATCH();
+      CASE(OP_NEGATE):     CALL_OP(op_negate); DISPATCH();
+      CASE(OP_BIN_NOT): {
+        Value a = sp[-1];
+        if (LIKELY(IS_INT(a))) {
+          sp[-1] = INT_VAL(~AS_INT(a));
+        } else {
+          CALL_OP(op_bin_not);
+        }
+        DISPATCH();
+      }
+      CASE(OP_BIN_SHIFTL): INT_OP(shiftLeftInts, op_bin_shiftl); DISPATCH();
+      CASE(OP_BIN_SHIFTR): INT_OP(shiftRightInts, op_bin_shiftr); DISPATCH();
+      CASE(OP_BIN_AND):    INT_OP(INTS_AND, op_bin_and); DISPATCH();
+      CASE(OP_BIN_OR):     INT_OP(INTS_OR, op_bin_or); DISPATCH();
+      CASE(OP_BIN_XOR):    INT_OP(INTS_XOR, op_bin_xor); DISPATCH();
+      CASE(OP_PRINT): {
+        printValue(POP());
         printf("\n");
-        break;
+        DISPATCH();
       }
-      case OP_JUMP: {
+      CASE(OP_JUMP): {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+        ip += offset;
+        DISPATCH();
       }
-      case OP_PJMP_IF_FALSE: { // POP, then if false JUMP
+      CASE(OP_PJMP_IF_FALSE): { // POP, then if false JUMP
         uint16_t offset = READ_SHORT();
-        if (isFalsey(pop(vm))) frame->ip += offset;
-        break;
+        if (isFalsey(POP())) ip += offset;
+        DISPATCH();
       }
-      case OP_QJMP_IF_FALSE: { // PEEK, then if false JUMP
+      CASE(OP_QJMP_IF_FALSE): { // PEEK, then if false JUMP
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(vm, 0))) frame->ip += offset;
-        break;
+        if (isFalsey(PEEK(0))) ip += offset;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP): {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+        ip -= offset;
+        TICK();
+        NATIVE_ENTER();
+        DISPATCH();
+      }
+      CASE(OP_SWITCH_TABLE): { // PEEK, then jump to the matching case
+        Chunk* chunk = &frame->closure->function->chunk;
+        SwitchTable* table = &chunk->switches[READ_SHORT()];
+        ip = chunk->code + findSwitchTarget(table, PEEK(0));
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_CALL): {
         int argCount = READ_BYTE();
-        if (!callValue(vm, peek(vm, argCount), argCount)) {
+        Value callee = PEEK(argCount);
+        if (IS_NATIVE(callee) && AS_NATIVE(callee)->arity >= 0) QUICKEN(-2, OP_CALL_NATIVE);
+        SAVE_STATE();
+        if (!callValue(vm, PEEK(argCount), argCount)) {
           printf("vm:callValue() returned false\n");
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm->frames[vm->frameCount - 1];
-        break;
+        LOAD_STATE();
+        if (vm->yield) return sleepResult(vm); // sleep() was called
+        TICK();
+        NATIVE_ENTER();
+        DISPATCH();
+      }
+      CASE(OP_CALL_NATIVE): { // Quickened OP_CALL of a typed native
+        int argCount = READ_BYTE();
+        Value callee = PEEK(argCount);
+        if (!IS_NATIVE(callee) || AS_NATIVE(callee)->arity < 0) {
+          // Deoptimize and run this call as OP_CALL
+          ip -= 2;
+          *ip = OP_CALL;
+          DISPATCH();
+        }
+        ObjNative* native = AS_NATIVE(callee);
+        if (native->isUnboxed && argCount == native->arity) {
+          Value* args = sp - argCount;
+          bool numbers = true;
+          for (int i = 0; i < argCount; i++) numbers = numbers && IS_NUMBER(args[i]);
+          if (numbers) {
+            double result = callUnboxed(native, args);
+            sp -= argCount;
+            sp[-1] = NUMBER_VAL(result);
+            TICK();
+            NATIVE_ENTER();
+            DISPATCH();
+          }
+        }
+        SAVE_STATE();
+        if (!callTypedNative(vm, native, argCount)) return INTERPRET_RUNTIME_ERROR;
+        LOAD_STATE();
+        if (vm->yield) return sleepResult(vm); // sleep() was called
+        TICK();
+        NATIVE_ENTER();
+        DISPATCH();
       }
-      case OP_INVOKE: {
+      CASE(OP_TAIL_CALL): {
+        int argCount = READ_BYTE();
+        Value callee = PEEK(argCount);
+        if (!IS_CLOSURE(callee)) {
+          // Natives, classes etc. are called as usual, OP_RETURN follows
+          SAVE_STATE();
+          if (!callValue(vm, callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+          LOAD_STATE();
+          if (vm->yield) return sleepResult(vm); // sleep() was called
+          TICK();
+          NATIVE_ENTER();
+          DISPATCH();
+        }
+
+        ObjClosure* closure = AS_CLOSURE(callee);
+        if (argCount != closure->function->arity) {
+          RUNTIME_ERROR("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        }
+        int needed = (int)(slots - sp) + closure->function->maxSlots + STACK_HEADROOM;
+        if (sp + needed > vm->stack + vm->stackCapacity) {
+          SAVE_STATE();
+          if (!growStack(vm, needed)) return INTERPRET_RUNTIME_ERROR;
+          LOAD_STATE();
+        }
+        closeUpvalues(vm, slots);
+
+        // Move the callee and arguments down over the current frame
+        Value* args = sp - argCount - 1;
+        for (int i = 0; i <= argCount; i++) slots[i] = args[i];
+        sp = slots + argCount + 1;
+        frame->closure = closure;
+        ip = closure->function->chunk.code;
+        TICK();
+        NATIVE_ENTER();
+        DISPATCH();
+      }
+      CASE(OP_INVOKE): {
         // = OP_GET_PROPERTY + OP_CALL combined
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
-        if (!invoke(vm, method, argCount)) {
+        InlineCache* cache = READ_CACHE();
+        SAVE_STATE();
+        if (!invoke(vm, method, argCount, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm->frames[vm->frameCount - 1];
-        break;
+        LOAD_STATE();
+        if (vm->yield) return sleepResult(vm); // sleep() was called
+        TICK();
+        NATIVE_ENTER();
+        DISPATCH();
       }
-      case OP_SUPER_INVOKE: {
+      CASE(OP_SUPER_INVOKE): {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(pop(vm));
-        if (!invokeFromClass(vm, superclass, method, argCount)) {
+        ObjClass* superclass = AS_CLASS(POP());
+        SAVE_STATE();
+        if (!invokeFromClass(vm, superclass, method, argCount, NULL)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm->frames[vm->frameCount - 1];
-        break;
+        LOAD_STATE();
+        TICK();
+        NATIVE_ENTER();
+        DISPATCH();
       }
-      case OP_CLOSURE: {
+      CASE(OP_CLOSURE): {
         ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+        SAVE_STATE();
         ObjClosure* closure = newClosure(vm, function);
-        push(vm, OBJ_VAL(closure));
+        PUSH(OBJ_VAL(closure));
+        vm->stackTop = sp; // Keep the closure safe from GC
         for (int i = 0; i < closure->upvalueCount; i++) {
           uint8_t isLocal = READ_BYTE();
           uint8_t index = READ_BYTE();
           if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+            closure->upvalues[i] = captureUpvalue(vm, slots + index);
           } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
         }
-        break;
+        DISPATCH();
       }
-      case OP_CLOSE_UPVALUE: {
-        closeUpvalues(vm, vm->stackTop - 1);
-        pop(vm);
-        break;
+      CASE(OP_CLOSE_UPVALUE): {
+        closeUpvalues(vm, sp - 1);
+        sp--;
+        DISPATCH();
       }
-      case OP_EXIT: {
+      CASE(OP_EXIT): {
         vm->stackTop = vm->stack;
         vm->frameCount = 0;
         return INTERPRET_OK;
       }
-      case OP_RETURN: {
-        Value result = pop(vm);
+      CASE(OP_RETURN): {
+        Value result = POP();
 
-        closeUpvalues(vm, frame->slots);
+        closeUpvalues(vm, slots);
 
         vm->frameCount--;
         if (vm->frameCount == 0) {
-          pop(vm);
+          vm->stackTop = sp - 1;
           return INTERPRET_OK;
         }
 
-        vm->stackTop = frame->slots;
-        push(vm, result);
+        sp = slots;
+        PUSH(result);
 
         frame = &vm->frames[vm->frameCount - 1];
-        break;
+        ip = frame->ip;
+        slots = frame->slots;
+        NATIVE_ENTER();
+        DISPATCH();
       }
-      case OP_CLASS:
-        push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
-        break;
-      case OP_INHERIT: {
-        Value superclass = peek(vm, 1);
+      CASE(OP_CLASS): {
+        ObjString* name = READ_STRING();
+        SAVE_STATE();
+        PUSH(OBJ_VAL(newClass(vm, name)));
+        DISPATCH();
+      }
+      CASE(OP_INHERIT): {
+        Value superclass = PEEK(1);
         if (!IS_CLASS(superclass)) {
-          runtimeError(vm, "Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Superclass must be a class.");
         }
-        ObjClass* subclass = AS_CLASS(peek(vm, 0));
+        ObjClass* subclass = AS_CLASS(PEEK(0));
+        SAVE_STATE();
         tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
-        pop(vm); // Subclass
-        break;
+        subclass->version++;
+        sp--; // Subclass
+        DISPATCH();
       }
-      case OP_METHOD:
-        defineMethod(vm, READ_STRING());
-        break;
+      CASE(OP_METHOD): {
+        ObjString* name = READ_STRING();
+        SAVE_STATE();
+        defineMethod(vm, name);
+        sp = vm->stackTop;
+        DISPATCH();
+      }
+
+      // Superinstructions, see optimizer.c for the sequences they replace
+      CASE(OP_ADD_LOCALS): {
+        Value a = slots[READ_SHORT()];
+        Value b = slots[READ_SHORT()];
+        PUSH(a);
+        PUSH(b);
+        NUMBER_OP(addNumbers, op_add);
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCAL_CONST): {
+        Value a = slots[READ_SHORT()];
+        Value b = READ_CONSTANT();
+        PUSH(a);
+        PUSH(b);
+        NUMBER_OP(addNumbers, op_add);
+        DISPATCH();
+      }
+      CASE(OP_SUB_LOCAL_CONST): {
+        Value a = slots[READ_SHORT()];
+        Value b = READ_CONSTANT();
+        PUSH(a);
+        PUSH(b);
+        BINARY_OP(subtractNumbers);
+        DISPATCH();
+      }
+      CASE(OP_LESS_LOCAL_CONST_JMP): {
+        Value a = slots[READ_SHORT()];
+        Value b = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        bool less;
+        if (LIKELY(ARE_NUMBERS(a, b))) {
+          less = COMPARE_NUMBERS(a, <, b);
+        } else {
+          less = valuesGreater(b, a); // Same as op_less()
+        }
+        if (!less) ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_INC_LOCAL): {
+        Value* local = &slots[READ_SHORT()];
+        if (!LIKELY(IS_INT(*local) || IS_NUMBER(*local))) RUNTIME_ERROR("Can only increment numbers.");
+        *local = addNumbers(*local, INT_VAL(1));
+        DISPATCH();
+      }
+      CASE(OP_DEC_LOCAL): {
+        Value* local = &slots[READ_SHORT()];
+        if (!LIKELY(IS_INT(*local) || IS_NUMBER(*local))) RUNTIME_ERROR("Can only decrement numbers.");
+        *local = subtractNumbers(*local, INT_VAL(1));
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL_POP): {
+        uint16_t slot = READ_SHORT();
+        slots[slot] = POP();
+        DISPATCH();
+      }
+      // Register instructions, see REGISTER_OP
+      CASE(OP_MOVE): {
+        Value value = slots[READ_SHORT()];
+        slots[READ_SHORT()] = value;
+        DISPATCH();
+      }
+      CASE(OP_LOAD_CONST): {
+        Value value = READ_CONSTANT();
+        slots[READ_SHORT()] = value;
+        DISPATCH();
+      }
+      CASE(OP_ADD_RR): REGISTER_OP(slots[READ_SHORT()], addNumbers, op_add); DISPATCH();
+      CASE(OP_SUB_RR): REGISTER_OP(slots[READ_SHORT()], subtractNumbers, op_subtract); DISPATCH();
+      CASE(OP_MUL_RR): REGISTER_OP(slots[READ_SHORT()], multiplyNumbers, op_multiply); DISPATCH();
+      CASE(OP_ADD_RK): REGISTER_OP(READ_CONSTANT(), addNumbers, op_add); DISPATCH();
+      CASE(OP_SUB_RK): REGISTER_OP(READ_CONSTANT(), subtractNumbers, op_subtract); DISPATCH();
+      CASE(OP_MUL_RK): REGISTER_OP(READ_CONSTANT(), multiplyNumbers, op_multiply); DISPATCH();
+      // Quickened instructions, see QUICKEN_OP
+      CASE(OP_EQUAL_NUM):    QUICK_OP(NUMBERS_EQUAL, op_equal, OP_EQUAL); DISPATCH();
+      CASE(OP_NEQUAL_NUM):   QUICK_OP(NUMBERS_NEQUAL, op_nequal, OP_NEQUAL); DISPATCH();
+      CASE(OP_GREATER_NUM):  QUICK_OP(NUMBERS_GREATER, op_greater, OP_GREATER); DISPATCH();
+      CASE(OP_GEQUAL_NUM):   QUICK_OP(NUMBERS_GEQUAL, op_gequal, OP_GEQUAL); DISPATCH();
+      CASE(OP_LESS_NUM):     QUICK_OP(NUMBERS_LESS, op_less, OP_LESS); DISPATCH();
+      CASE(OP_LEQUAL_NUM):   QUICK_OP(NUMBERS_LEQUAL, op_lequal, OP_LEQUAL); DISPATCH();
+      CASE(OP_ADD_NUM):      QUICK_OP(addNumbers, op_add, OP_ADD); DISPATCH();
+      CASE(OP_SUBTRACT_NUM): QUICK_OP(subtractNumbers, op_subtract, OP_SUBTRACT); DISPATCH();
+      CASE(OP_MULTIPLY_NUM): QUICK_OP(multiplyNumbers, op_multiply, OP_MULTIPLY); DISPATCH();
+      CASE(OP_DIVIDE_NUM): {
+        Value b = sp[-1];
+        Value a = sp[-2];
+        if (LIKELY(ARE_NUMBERS(a, b))) {
+          Value result = divideNumbers(a, b);
+          if (!isinf(AS_NUMBER(result))) {
+            sp--;
+            sp[-1] = result;
+            DISPATCH();
+          }
+        } else {
+          ip[-1] = OP_DIVIDE;
+        }
+        CALL_OP(op_divide); // Reports division by zero
+        DISPATCH();
+      }
+#ifndef COMPUTED_GOTO
       default: {
-        runtimeError(vm, "Internal error: unhandled OP_CODE %d.", instruction);
+        RUNTIME_ERROR("Internal error: unhandled OP_CODE %d.", instruction);
       }
     }
-#ifdef DEBUG
-    if (IS_NUMBER(peek(vm, 0)) && isinf(AS_NUMBER(peek(vm, 0)))) {
-      runtimeError(vm, "Invalid number value.");
-      return INTERPRET_RUNTIME_ERROR;
-    }
-#endif // DEBUG
+#endif
   }
 
 
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef RUNTIME_ERROR
+#undef CALL_OP
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef QUICKEN
+#undef QUICKEN_OP
+#undef QUICK_OP
+#undef INT_OP
+#undef REGISTER_OP
+#undef ARE_NUMBERS
+#undef NUMBERS_EQUAL
+#undef NUMBERS_NEQUAL
+#undef NUMBERS_GREATER
+#undef NUMBERS_GEQUAL
+#undef NUMBERS_LESS
+#undef NUMBERS_LEQUAL
+#undef INTS_AND
+#undef INTS_OR
+#undef INTS_XOR
+#undef TRACE_EXECUTION
+#undef CHECK_NUMBER
+#undef TICK
+#undef NATIVE_ENTER
+#undef JIT_ENTER
+#undef CASE
+#undef DISPATCH
 }
 
 
@@ -1419,7 +2543,7 @@ InterpretResult run(VM* vm) {
 static ObjFunction* interpret_inner(VM* vm, const char* source, const char* filename) {
   int fileno = -1;
   if (strlen(filename) > 0) fileno = addFilename(vm, filename);
-  return compile(vm, fileno, source);
+  return compileCached(vm, fileno, source, filename);
 }
 
 static void setup_initial_callframe(VM* vm, ObjFunction* function) {
@@ -1435,10 +2559,29 @@ static void setup_initial_callframe(VM* vm, ObjFunction* function) {
 InterpretResult interpret(VM* vm, const char* source, const char* filename) {
   ObjFunction* function = interpret_inner(vm, source, filename);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  if (vm->aotModule != NULL) attachAot(vm, function);
   //printf("====== compilation complete ======\n");
   setup_initial_callframe(vm, function);
   return INTERPRET_COMPILED;
 }
 
+// Like interpret(), for a script compiled to bytecode by writeBytecode()
+InterpretResult interpretBytecode(VM* vm, const char* bytes, size_t size) {
+  ObjFunction* function = readBytecode(vm, bytes, size);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  if (vm->aotModule != NULL) attachAot(vm, function);
+  setup_initial_callframe(vm, function);
+  return INTERPRET_COMPILED;
+}
+
+// Like interpret(), for a script compiled once by compileProgram()
+InterpretResult interpretProgram(VM* vm, struct Program* program) {
+  ObjFunction* function = instantiateProgram(vm, program);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  if (vm->aotModule != NULL) attachAot(vm, function);
+  setup_initial_callframe(vm, function);
+  return INTERPRET_COMPILED;
+}
+
 
 
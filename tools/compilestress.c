@@ -0,0 +1,145 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "file.h"
+#include "object.h"
+#include "vm.h"
+
+// Concurrent compiler stress test
+//
+// Compiles the scripts over and over on several threads at once, each
+// thread with its own VM, and checks every result against the same
+// scripts compiled once before the threads start. The compiler keeps all
+// of its state in the VM and the Compiler structs, so any difference, or
+// a crash, means some state is shared after all.
+//
+// Usage: func-compilestress [-t threads] [-n rounds] script.fun [...]
+
+typedef struct {
+  int scriptCount;
+  const char** paths;
+  char** sources;
+  ObjFunction** expected; // Compiled by the main thread
+  int rounds;
+  int failures;           // Written by the thread that owns this
+  pthread_t thread;
+} Worker;
+
+static bool sameValue(Value a, Value b);
+
+static bool sameFunction(ObjFunction* a, ObjFunction* b) {
+  Chunk* x = &a->chunk;
+  Chunk* y = &b->chunk;
+  if (a->arity != b->arity || a->upvalueCount != b->upvalueCount ||
+      a->maxSlots != b->maxSlots || a->cacheCount != b->cacheCount ||
+      (a->name == NULL) != (b->name == NULL) ||
+      (a->name != NULL && !sameValue(OBJ_VAL(a->name), OBJ_VAL(b->name)))) {
+    return false;
+  }
+  if (x->count != y->count || x->constants.count != y->constants.count ||
+      x->switchCount != y->switchCount) {
+    return false;
+  }
+  size_t count = (size_t)x->count;
+  if (memcmp(x->code, y->code, count) != 0 ||
+      memcmp(x->files, y->files, count * sizeof(int)) != 0 ||
+      memcmp(x->lines, y->lines, count * sizeof(int)) != 0 ||
+      memcmp(x->chars, y->chars, count * sizeof(int)) != 0) {
+    return false;
+  }
+  for (int i = 0; i < x->constants.count; i++) {
+    if (!sameValue(x->constants.values[i], y->constants.values[i])) return false;
+  }
+  for (int i = 0; i < x->switchCount; i++) {
+    if (x->switches[i].count != y->switches[i].count ||
+        x->switches[i].missTarget != y->switches[i].missTarget) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Values of different VMs
+static bool sameValue(Value a, Value b) {
+  if (IS_FUNCTION(a)) return IS_FUNCTION(b) && sameFunction(AS_FUNCTION(a), AS_FUNCTION(b));
+  if (IS_STRING(a)) {
+    return IS_STRING(b) && AS_STRING(a)->length == AS_STRING(b)->length &&
+           memcmp(AS_STRING(a)->chars, AS_STRING(b)->chars, (size_t)AS_STRING(a)->length) == 0;
+  }
+  return memcmp(&a, &b, sizeof(Value)) == 0;
+}
+
+static ObjFunction* compileScript(VM* vm, const char* path, const char* source) {
+  return compile(vm, addFilename(vm, path), source, vm->optimize);
+}
+
+static void* work(void* argument) {
+  Worker* worker = argument;
+  VM* vm = initVM();
+  for (int round = 0; round < worker->rounds; round++) {
+    for (int i = 0; i < worker->scriptCount; i++) {
+      ObjFunction* function = compileScript(vm, worker->paths[i], worker->sources[i]);
+      if (function == NULL || !sameFunction(function, worker->expected[i])) worker->failures++;
+    }
+  }
+  freeVM(vm);
+  return NULL;
+}
+
+int main(int argc, const char* argv[]) {
+  int threads = 8;
+  int rounds = 50;
+  int arg = 1;
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (strcmp(argv[arg], "-t") == 0) threads = atoi(argv[arg + 1]);
+    else if (strcmp(argv[arg], "-n") == 0) rounds = atoi(argv[arg + 1]);
+    else break;
+  }
+  if (arg >= argc || threads < 1 || rounds < 1) {
+    fprintf(stderr, "Usage: func-compilestress [-t threads] [-n rounds] script.fun [...]\n");
+    return 64;
+  }
+
+  // The expected results, compiled in the order the workers use, so the
+  // global slots and file numbers are the same
+  int scriptCount = argc - arg;
+  char** sources = malloc(sizeof(char*) * (size_t)scriptCount);
+  ObjFunction** expected = malloc(sizeof(ObjFunction*) * (size_t)scriptCount);
+  Worker* workers = malloc(sizeof(Worker) * (size_t)threads);
+  if (sources == NULL || expected == NULL || workers == NULL) return 74;
+  VM* vm = initVM();
+  for (int i = 0; i < scriptCount; i++) {
+    if (readFile(argv[arg + i], &sources[i]) <= 0) return 74;
+    expected[i] = compileScript(vm, argv[arg + i], sources[i]);
+    if (expected[i] == NULL) return 65;
+    push(vm, OBJ_VAL(expected[i])); // Keep safe from GC
+  }
+
+  for (int i = 0; i < threads; i++) {
+    Worker* worker = &workers[i];
+    worker->scriptCount = scriptCount;
+    worker->paths = argv + arg;
+    worker->sources = sources;
+    worker->expected = expected;
+    worker->rounds = rounds;
+    worker->failures = 0;
+    if (pthread_create(&worker->thread, NULL, work, worker) != 0) return 71;
+  }
+  int failures = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    failures += workers[i].failures;
+  }
+
+  printf("%d threads, %d compiles, %d failed\n", threads, threads * rounds * scriptCount, failures);
+  freeVM(vm);
+  for (int i = 0; i < scriptCount; i++) free(sources[i]);
+  free(sources);
+  free(expected);
+  free(workers);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "object.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "vm.h"
+
+// Interrupt test
+//
+// Stops VMs with vm_interrupt() from another thread, in a tight loop
+// without a timeslice, deep in calls while they are resumed over and
+// over, and while they sleep, alone and in a scheduler. Checks the result
+// and reason, that the scripts carry on where they were, and that
+// vm_abort() leaves a VM that runs the next script from scratch.
+//
+// Usage: func-interrupttest
+
+#define CHECK(condition) \
+    do { \
+      if (!(condition)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+      } \
+    } while (false)
+
+typedef struct {
+  VM* vm;
+  atomic_int started; // Set by the runner once the VM is running
+  atomic_int stop;
+  int reason;
+  double every;       // Seconds between interrupts, 0 = once
+} Watchdog;
+
+static int failures = 0;
+
+static void* watch(void* argument) {
+  Watchdog* dog = argument;
+  while (atomic_load(&dog->started) == 0) waitUntil(now() + 0.0001);
+  do {
+    waitUntil(now() + (dog->every > 0 ? dog->every : 0.01));
+    vm_interrupt(dog->vm, dog->reason);
+  } while (dog->every > 0 && atomic_load(&dog->stop) == 0);
+  return NULL;
+}
+
+static double getNumber(VM* vm, const char* name) {
+  ObjString* string = copyString(vm, name, (int)strlen(name));
+  return to_double(vm->globals.values[resolveGlobal(vm, string)]);
+}
+
+static InterpretResult start(VM* vm, const char* source) {
+  InterpretResult result = interpret(vm, source, "interrupttest");
+  CHECK(result == INTERPRET_COMPILED);
+  return result;
+}
+
+// A loop that never ends nor yields, stopped from another thread
+static void testLoop(int jit) {
+  VM* vm = initVM();
+  set_timeslice(vm, 0);
+  set_jit(vm, jit);
+  Watchdog dog = { .vm = vm, .reason = 42 };
+  atomic_init(&dog.started, 0);
+  atomic_init(&dog.stop, 0);
+  InterpretResult result = start(vm, "var n = 0; while (true) { n = n + 1; }");
+  pthread_t thread;
+  pthread_create(&thread, NULL, watch, &dog);
+  atomic_store(&dog.started, 1);
+  while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) result = run(vm);
+  pthread_join(thread, NULL);
+  CHECK(result == INTERPRET_INTERRUPTED);
+  CHECK(get_interrupt_reason(vm) == 42);
+  CHECK(getNumber(vm, "n") > 0);
+
+  // Still looping after the interrupt
+  double n = getNumber(vm, "n");
+  vm_interrupt(vm, 7);
+  CHECK(run(vm) == INTERPRET_INTERRUPTED);
+  CHECK(get_interrupt_reason(vm) == 7);
+  CHECK(getNumber(vm, "n") >= n);
+
+  // Dropped, the next script starts on an empty stack
+  vm_abort(vm);
+  CHECK(vm->frameCount == 0 && vm->stackTop == vm->stack);
+  result = start(vm, "var m = 1 + 2;");
+  while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) result = run(vm);
+  CHECK(result == INTERPRET_OK);
+  CHECK(getNumber(vm, "m") == 3);
+  CHECK(vm->frameCount == 0);
+  freeVM(vm);
+}
+
+// Interrupted deep in calls again and again, each time resumed
+static void testResume(int jit) {
+  VM* vm = initVM();
+  set_timeslice(vm, 0);
+  set_jit(vm, jit);
+  Watchdog dog = { .vm = vm, .reason = 3, .every = 0.0002 };
+  atomic_init(&dog.started, 0);
+  atomic_init(&dog.stop, 0);
+  InterpretResult result = start(vm,
+      "fun count(depth, n) {\n"
+      "  if (depth > 0) return count(depth - 1, n) + 1;\n"
+      "  var sum = 0;\n"
+      "  for (var i = 0; i < n; i++) sum = sum + i;\n"
+      "  return sum;\n"
+      "}\n"
+      "var total = 0;\n"
+      "for (var j = 0; j < 20; j++) total = total + count(50, 100000);\n");
+  pthread_t thread;
+  pthread_create(&thread, NULL, watch, &dog);
+  atomic_store(&dog.started, 1);
+  int interrupts = 0;
+  bool deep = false;
+  while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING ||
+         result == INTERPRET_INTERRUPTED) {
+    if (result == INTERPRET_INTERRUPTED) {
+      interrupts++;
+      CHECK(get_interrupt_reason(vm) == 3);
+      if (vm->frameCount > 50) deep = true;
+    }
+    result = run(vm);
+  }
+  atomic_store(&dog.stop, 1);
+  pthread_join(thread, NULL);
+  CHECK(result == INTERPRET_OK);
+  CHECK(getNumber(vm, "total") == 20 * (4999950000.0 + 50));
+  CHECK(vm->frameCount == 0);
+  CHECK(interrupts > 0);
+  CHECK(deep);
+  freeVM(vm);
+}
+
+// Sleeping for an hour, interrupted instead
+static void testSleep(void) {
+  VM* vm = initVM();
+  InterpretResult result = start(vm, "sleep(3600000); var woke = 1;");
+  while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) result = run(vm);
+  CHECK(result == INTERPRET_SLEEPING);
+  vm_interrupt(vm, 9);
+  CHECK(run(vm) == INTERPRET_INTERRUPTED);
+  CHECK(get_interrupt_reason(vm) == 9);
+  CHECK(run(vm) == INTERPRET_SLEEPING); // Resumed, still sleeping
+  vm_abort(vm);
+  CHECK(get_wake_time(vm) == 0);
+  freeVM(vm);
+}
+
+static void done(VM* vm, InterpretResult result, void* data) {
+  (unused)vm;
+  *(InterpretResult*)data = result;
+}
+
+// The scheduler has the sleeping VMs parked, one of them is interrupted
+static void testScheduler(void) {
+  VM* vms[3];
+  InterpretResult results[3];
+  Scheduler* scheduler = newScheduler(2, done);
+  for (int i = 0; i < 3; i++) {
+    vms[i] = initVM();
+    results[i] = start(vms[i], i == 0 ? "sleep(3600000);" : "sleep(20);");
+    schedule(scheduler, vms[i], &results[i]);
+  }
+  double before = now();
+  waitUntil(before + 0.05); // Parked by now
+  interruptScheduled(scheduler, vms[0], 5);
+  waitScheduler(scheduler);
+  CHECK(now() - before < 10);
+  CHECK(results[0] == INTERPRET_INTERRUPTED);
+  CHECK(get_interrupt_reason(vms[0]) == 5);
+  CHECK(results[1] == INTERPRET_OK && results[2] == INTERPRET_OK);
+  freeScheduler(scheduler);
+  for (int i = 0; i < 3; i++) freeVM(vms[i]);
+}
+
+int main(void) {
+  for (int jit = 0; jit <= 1; jit++) {
+    testLoop(jit);
+    testResume(jit);
+  }
+  testSleep();
+  testScheduler();
+  printf("%s\n", failures == 0 ? "Interrupts ok" : "Interrupts FAILED");
+  return failures == 0 ? 0 : 1;
+}
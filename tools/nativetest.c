@@ -0,0 +1,142 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "object.h"
+#include "vm.h"
+
+// Typed native test
+//
+// Defines natives with defineNativeTyped() and defineNativeUnboxed(),
+// checks that bad signatures are refused, and that calls with the wrong
+// number or types of arguments, or a wrong return type, are runtime
+// errors. Each call site is run twice before the bad call so that it
+// fails in the quickened OP_CALL_NATIVE, not only in OP_CALL. Also
+// rebinds a quickened site to a script function, with and without JIT.
+//
+// Usage: func-nativetest
+
+#define CHECK(condition) \
+    do { \
+      if (!(condition)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+      } \
+    } while (false)
+
+static int failures = 0;
+static char lastError[256];
+
+static void keepError(const char* format, ...) {
+  snprintf(lastError, sizeof(lastError), "%s", format);
+}
+
+static bool pickNative(void* vm, int argCount, Value* args, Value* result) {
+  (unused)vm;
+  (unused)argCount;
+  *result = AS_BOOL(args[2]) ? args[0] : args[1];
+  return true;
+}
+
+static bool liarNative(void* vm, int argCount, Value* args, Value* result) {
+  (unused)vm;
+  (unused)argCount;
+  (unused)args;
+  *result = BOOL_VAL(true);
+  return true;
+}
+
+static InterpretResult runScript(VM* vm, const char* source) {
+  lastError[0] = '\0';
+  InterpretResult result = interpret(vm, source, "nativetest");
+  while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) result = run(vm);
+  return result;
+}
+
+static double getNumber(VM* vm, const char* name) {
+  ObjString* string = copyString(vm, name, (int)strlen(name));
+  return to_double(vm->globals.values[resolveGlobal(vm, string)]);
+}
+
+// Fails with the error, the good calls before it succeed
+static void expectError(VM* vm, const char* source, const char* error) {
+  CHECK(runScript(vm, source) == INTERPRET_RUNTIME_ERROR);
+  if (strstr(lastError, error) == NULL) {
+    printf("expected \"%s\", got \"%s\"\n", error, lastError);
+    failures++;
+  }
+  CHECK(getNumber(vm, "good") == 2);
+}
+
+static void testSignatures(VM* vm) {
+  CHECK(defineNativeTyped(vm, "pick", pickNative, "aab>a"));
+  CHECK(defineNativeTyped(vm, "liar", liarNative, "n>n"));
+  CHECK(defineNativeUnboxed(vm, "hypot", (NativeUnboxedFn){ .n2 = hypot }, "nn>n"));
+  CHECK(defineNativeUnboxed(vm, "sqrt", (NativeUnboxedFn){ .n1 = sqrt }, "n>n"));
+
+  CHECK(!defineNativeTyped(vm, "bad", pickNative, "n"));
+  CHECK(!defineNativeTyped(vm, "bad", pickNative, "n>"));
+  CHECK(!defineNativeTyped(vm, "bad", pickNative, "x>n"));
+  CHECK(!defineNativeTyped(vm, "bad", pickNative, "n>nn"));
+  CHECK(!defineNativeTyped(vm, "bad", pickNative, "nnnnnnnnn>n"));
+  CHECK(!defineNativeUnboxed(vm, "bad", (NativeUnboxedFn){ .n1 = sqrt }, "s>n"));
+  CHECK(!defineNativeUnboxed(vm, "bad", (NativeUnboxedFn){ .n1 = sqrt }, "n>s"));
+  CHECK(!defineNativeUnboxed(vm, "bad", (NativeUnboxedFn){ .n1 = sqrt }, "nnnn>n"));
+  ObjString* bad = copyString(vm, "bad", 3);
+  CHECK(IS_UNDEFINED(vm->globals.values[resolveGlobal(vm, bad)]));
+}
+
+static void testErrors(VM* vm) {
+  CHECK(runScript(vm, "var good = 0;"
+                      "var h = hypot(3, 4) + hypot(6, 8);"
+                      "var p = pick(1, \"one\", true) + pick(\"two\", 2, false);") == INTERPRET_OK);
+  CHECK(getNumber(vm, "h") == 15);
+  CHECK(getNumber(vm, "p") == 3);
+
+  expectError(vm, "good = 0; fun f(x) { var r = hypot(3, x); good++; return r; }"
+                  " f(4); f(4); f(\"4\");",
+              "Argument 2 must be a number, got string.");
+  expectError(vm, "good = 0; fun f(x) { var r = hypot(x, 4); good++; return r; }"
+                  " f(3); f(3); f(true);",
+              "Argument 1 must be a number, got boolean.");
+  expectError(vm, "good = 0; var g = sqrt; fun f() { var r = g(9); good++; return r; }"
+                  " f(); f(); g = hypot; f();",
+              "Expected 2 arguments but got 1.");
+  expectError(vm, "good = 0; fun f(x) { var r = pick(1, 2, x); good++; return r; }"
+                  " f(true); f(false); f(0);",
+              "Argument 3 must be a boolean, got number.");
+  expectError(vm, "good = 0; fun f(x) { var r = pick(x, x, x); good++; return r; }"
+                  " f(true); f(false); f(\"x\");",
+              "Argument 3 must be a boolean, got string.");
+  expectError(vm, "good = 2; fun f() { return liar(1); } f();",
+              "liar() returned boolean, expected number.");
+}
+
+// The global called at the same site changes from native to script
+static void testDeoptimize(VM* vm) {
+  CHECK(runScript(vm,
+      "var callee = hypot;"
+      "fun call() { return callee(3, 4); }"
+      "fun script(a, b) { return a * b; }"
+      "var sum = call() + call();"
+      "callee = script;"
+      "sum = sum + call() + call();"
+      "callee = pick;"
+      "sum = sum + call(); ") == INTERPRET_RUNTIME_ERROR);
+  CHECK(strstr(lastError, "Expected 3 arguments but got 2.") != NULL);
+  CHECK(getNumber(vm, "sum") == 34);
+}
+
+int main(void) {
+  for (int jit = 0; jit <= 1; jit++) {
+    VM* vm = initVM();
+    set_jit(vm, jit);
+    set_error_callback(vm, keepError);
+    testSignatures(vm);
+    testErrors(vm);
+    testDeoptimize(vm);
+    freeVM(vm);
+  }
+  printf("%s\n", failures == 0 ? "Typed natives ok" : "Typed natives FAILED");
+  return failures == 0 ? 0 : 1;
+}
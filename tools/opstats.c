@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "debug.h"
+#include "file.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Opcode n-gram statistics
+//
+// Compiles one or more scripts (without running them) and ranks the
+// opcode sequences found in the resulting bytecode, including nested
+// functions and methods. Sequences that span a jump target are not
+// counted since the peephole optimizer can not fuse those anyway.
+// Use this to decide which sequences deserve a superinstruction.
+//
+// Usage: func-opstats [-n maxlength] [-t top] [-r] script.fun [...]
+//   -r  count the raw bytecode, before the optimizer
+
+#define MAX_NGRAM 6
+
+typedef struct {
+  uint8_t ops[MAX_NGRAM];
+  int length;
+  long count;
+} Ngram;
+
+static Ngram* ngrams = NULL;
+static int ngramCount = 0;
+static int ngramCapacity = 0;
+
+static void countNgram(uint8_t* ops, int length) {
+  for (int i = 0; i < ngramCount; i++) {
+    if (ngrams[i].length == length && memcmp(ngrams[i].ops, ops, length) == 0) {
+      ngrams[i].count++;
+      return;
+    }
+  }
+  if (ngramCount == ngramCapacity) {
+    ngramCapacity = ngramCapacity < 64 ? 64 : ngramCapacity * 2;
+    ngrams = realloc(ngrams, sizeof(Ngram) * ngramCapacity);
+    if (ngrams == NULL) exit(74);
+  }
+  memcpy(ngrams[ngramCount].ops, ops, length);
+  ngrams[ngramCount].length = length;
+  ngrams[ngramCount].count = 1;
+  ngramCount++;
+}
+
+static void countChunk(Chunk* chunk, int maxLength) {
+  // Find instruction boundaries and jump targets
+  int* starts = malloc(sizeof(int) * (chunk->count + 1));
+  char* isTarget = calloc(chunk->count + 1, 1);
+  int count = 0;
+  for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset)) {
+    starts[count++] = offset;
+    int target = getJumpTarget(chunk, offset);
+    if (target >= 0 && target <= chunk->count) isTarget[target] = 1;
+  }
+
+  uint8_t ops[MAX_NGRAM];
+  for (int i = 0; i < count; i++) {
+    for (int length = 1; length <= maxLength && i + length <= count; length++) {
+      int offset = starts[i + length - 1];
+      if (length > 1 && isTarget[offset]) break;
+      ops[length - 1] = chunk->code[offset];
+      if (length > 1) countNgram(ops, length);
+    }
+  }
+  free(starts);
+  free(isTarget);
+
+  // Recurse into functions and methods
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) countChunk(&AS_FUNCTION(constant)->chunk, maxLength);
+  }
+}
+
+static int compareNgrams(const void* a, const void* b) {
+  const Ngram* na = a;
+  const Ngram* nb = b;
+  if (na->count != nb->count) return na->count < nb->count ? 1 : -1;
+  return na->length - nb->length;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: func-opstats [-n maxlength] [-t top] [-r] script.fun [...]\n");
+  exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+  int maxLength = 4;
+  int top = 25;
+  bool raw = false;
+  VM* vm = initVM();
+
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      maxLength = atoi(argv[++i]);
+      if (maxLength < 2 || maxLength > MAX_NGRAM) usage();
+      continue;
+    }
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      top = atoi(argv[++i]);
+      continue;
+    }
+    if (strcmp(argv[i], "-r") == 0) {
+      raw = true;
+      continue;
+    }
+
+    char* source;
+    if (readFile(argv[i], &source) <= 0) {
+      fprintf(stderr, "Could not read \"%s\".\n", argv[i]);
+      exit(74);
+    }
+    ObjFunction* function = compile(vm, addFilename(vm, argv[i]), source,
+        raw ? OPTIMIZE_NONE : OPTIMIZE_FLOW);
+    free(source);
+    if (function == NULL) exit(65);
+    countChunk(&function->chunk, maxLength);
+    files++;
+  }
+  if (files == 0) usage();
+
+  qsort(ngrams, ngramCount, sizeof(Ngram), compareNgrams);
+  for (int length = 2; length <= maxLength; length++) {
+    printf("== %d-grams ==\n", length);
+    int shown = 0;
+    for (int i = 0; i < ngramCount && shown < top; i++) {
+      if (ngrams[i].length != length) continue;
+      printf("%6ld ", ngrams[i].count);
+      for (int j = 0; j < length; j++) printf(" %s", getOpcodeName(ngrams[i].ops[j]));
+      printf("\n");
+      shown++;
+    }
+  }
+
+  free(ngrams);
+  freeVM(vm);
+  return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Stack VM vs. register instructions (REGISTER_OPS, see chunk.h)
+#
+# Builds the interpreter both ways, with and without DEBUG_COUNT_INSTRUCTIONS,
+# and prints the number of instructions run() executed and the best wall time
+# of a few runs for each script.
+#
+# Usage: tools/regbench.sh [script.fun ...]   (default: tests/bench.fun)
+# Set CC, CFLAGS or RUNS to override the defaults.
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RUNS=${RUNS:-5}
+[ $# -gt 0 ] || set -- tests/bench.fun
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for variant in stack register; do
+  flags=""
+  [ $variant = register ] && flags="-DREGISTER_OPS"
+  $CC $CFLAGS $flags -Iinclude src/*.c -o "$dir/$variant" -lm 2>/dev/null
+  $CC $CFLAGS $flags -DDEBUG_COUNT_INSTRUCTIONS -Iinclude src/*.c -o "$dir/$variant-count" -lm 2>/dev/null
+done
+
+# Best of RUNS wall times in milliseconds
+best() {
+  best=""
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$1" "$2" > /dev/null 2>&1 || true
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    if [ -z "$best" ] || [ $ms -lt "$best" ]; then best=$ms; fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+printf "%-24s %14s %14s %7s %9s %9s\n" script "stack instr" "register instr" ratio "stack ms" "reg ms"
+for script in "$@"; do
+  stack=$("$dir/stack-count" "$script" 2>&1 >/dev/null | sed -n 's/^\([0-9]*\) instructions$/\1/p')
+  register=$("$dir/register-count" "$script" 2>&1 >/dev/null | sed -n 's/^\([0-9]*\) instructions$/\1/p')
+  ratio=$(awk "BEGIN { printf \"%.2f\", $register / $stack }")
+  printf "%-24s %14s %14s %7s %9s %9s\n" "$(basename "$script")" "$stack" "$register" "$ratio" \
+    "$(best "$dir/stack" "$script")" "$(best "$dir/register" "$script")"
+done
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "object.h"
+#include "vm.h"
+
+// Stack limit test
+//
+// Runs deep recursion under low limits set with set_stack_limits(), on
+// frames and on values, and checks for a clean "Stack overflow." runtime
+// error after which the VM runs the next script. Then raises the limits
+// above the defaults and checks that the stacks grow to fit. A native
+// that returns a big array built with to_numberValueArray() grows the
+// stack too, and fails cleanly at the limit.
+//
+// Usage: func-stacktest
+
+#define CHECK(condition) \
+    do { \
+      if (!(condition)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+      } \
+    } while (false)
+
+static int failures = 0;
+static int overflows = 0;
+
+static void countOverflows(const char* format, ...) {
+  if (strstr(format, "Stack overflow.") != NULL) overflows++;
+}
+
+// numbers(n) returns [0, 1, ..., n-1]
+static bool numbersNative(void* vm, int argCount, Value* args, Value* result) {
+  static double numbers[1000];
+  int count = (int)to_double(args[0]);
+  if (argCount != 1 || count < 0 || count > 1000) return false;
+  for (int i = 0; i < count; i++) numbers[i] = i;
+  *result = to_numberValueArray(vm, numbers, count);
+  return true;
+}
+
+static InterpretResult runScript(VM* vm, const char* source) {
+  InterpretResult result = interpret(vm, source, "stacktest");
+  while (result == INTERPRET_COMPILED || result == INTERPRET_RUNNING) result = run(vm);
+  return result;
+}
+
+static double getNumber(VM* vm, const char* name) {
+  ObjString* string = copyString(vm, name, (int)strlen(name));
+  return to_double(vm->globals.values[resolveGlobal(vm, string)]);
+}
+
+// Fails with a stack overflow and leaves the VM ready for the next script
+static void expectOverflow(VM* vm, const char* source) {
+  int before = overflows;
+  CHECK(runScript(vm, source) == INTERPRET_RUNTIME_ERROR);
+  CHECK(overflows == before + 1);
+  CHECK(vm->frameCount == 0 && vm->stackTop == vm->stack);
+  CHECK(runScript(vm, "var after = 1;") == INTERPRET_OK);
+}
+
+int main(void) {
+  const char* down = "fun down(n) { return 1 + down(n + 1); } down(0);";
+  const char* wide = "fun wide(n) { var a = n; var b = n; var c = n; var d = n;"
+                     " return a + b + c + d + wide(n + 1); } wide(0);";
+  const char* array = "var a = [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,"
+                      " 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, numbers(250)];"
+                      " var length = a[30].length + a.length; var last = a[30][249];";
+  const char* deep = "fun sum(n) { if (n == 0) return 0; return n + sum(n - 1); }"
+                     " var total = sum(5000);";
+
+  VM* vm = initVM();
+  set_error_callback(vm, countOverflows);
+  defineGlobal(vm, "numbers", to_nativeValue(vm, "numbers", numbersNative));
+
+  // The native pushes far more than the headroom of its caller
+  CHECK(runScript(vm, array) == INTERPRET_OK);
+  CHECK(getNumber(vm, "length") == 281);
+  CHECK(getNumber(vm, "last") == 249);
+
+  // And more than the stack may hold
+  set_stack_limits(vm, DEFAULT_FRAMES_MAX, 200);
+  expectOverflow(vm, array);
+
+  // Frames run out first
+  set_stack_limits(vm, 100, DEFAULT_STACK_MAX);
+  expectOverflow(vm, down);
+
+  // Values run out first
+  set_stack_limits(vm, DEFAULT_FRAMES_MAX, 300);
+  expectOverflow(vm, wide);
+
+  // The defaults are too low for this, raised limits are not
+  set_stack_limits(vm, DEFAULT_FRAMES_MAX, DEFAULT_STACK_MAX);
+  expectOverflow(vm, deep);
+  set_stack_limits(vm, 6000, 6000 * UINT8_COUNT);
+  CHECK(runScript(vm, deep) == INTERPRET_OK);
+  CHECK(getNumber(vm, "total") == 12502500);
+  CHECK(vm->frameCapacity > DEFAULT_FRAMES_MAX);
+
+  freeVM(vm);
+  printf("%s\n", failures == 0 ? "Stack limits ok" : "Stack limits FAILED");
+  return failures == 0 ? 0 : 1;
+}